@@ -0,0 +1,114 @@
+#ifndef CHUNKPOOL_H
+#define CHUNKPOOL_H
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Preallocated pool of fixed-size packet buffers ("chunks") owned by one capture thread.  The owner takes chunks,
+// fills them and hands them on by reference; whichever thread is done with a chunk puts it back.  The free list is a
+// lock-free stack of chunk indexes; the head carries a generation tag in its upper half so a chunk taken and returned
+// between another thread's load and compare-and-swap cannot corrupt it (ABA).
+//
+// The memory is mapped and populated by the thread calling chunkpool_init, so with the kernel's first-touch policy it
+// is local to that thread's NUMA node: call it from the capture thread that will own the pool.
+
+struct chunkpool
+{
+    _Atomic uint64_t head;    // (generation << 32) | (index + 1) of the first free chunk, 0 when empty
+    _Atomic uint32_t *next;   // next[index] = (index + 1) of the following free chunk
+    char *mem;                // nchunks * chunk_size bytes
+    size_t chunk_size;
+    uint32_t nchunks;
+    _Atomic uint64_t waits;   // chunkpool_get calls that found the pool empty
+};
+
+/// @brief Put a chunk back on the free list.  Safe from any thread.
+static inline void chunkpool_put(struct chunkpool *cp, void *chunk)
+{
+    uint32_t idx = ((char *)chunk - cp->mem) / cp->chunk_size;
+    uint64_t old = atomic_load_explicit(&cp->head, memory_order_relaxed), new;
+
+    do
+    {
+        atomic_store_explicit(&cp->next[idx], (uint32_t)old, memory_order_relaxed);
+        new = (((old >> 32) + 1) << 32) | (idx + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&cp->head, &old, new, memory_order_release, memory_order_relaxed));
+}
+
+/// @brief Take a free chunk.
+/// @return Chunk, or NULL if all chunks are in use.
+static inline void *chunkpool_tryget(struct chunkpool *cp)
+{
+    uint64_t old = atomic_load_explicit(&cp->head, memory_order_acquire), new;
+
+    do
+    {
+        uint32_t idx = (uint32_t)old;
+
+        if (idx == 0)
+            return NULL;
+
+        new = (((old >> 32) + 1) << 32) | atomic_load_explicit(&cp->next[idx - 1], memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&cp->head, &old, new, memory_order_acquire, memory_order_acquire));
+
+    return cp->mem + (size_t)((uint32_t)old - 1) * cp->chunk_size;
+}
+
+/// @brief Take a free chunk, waiting for one to be put back if all are in use.
+static inline void *chunkpool_get(struct chunkpool *cp)
+{
+    void *chunk;
+
+    if ((chunk = chunkpool_tryget(cp)) != NULL)
+        return chunk;
+
+    atomic_fetch_add_explicit(&cp->waits, 1, memory_order_relaxed);
+    while ((chunk = chunkpool_tryget(cp)) == NULL)
+        sched_yield();
+
+    return chunk;
+}
+
+/// @brief Allocate and populate the pool's memory (on the calling thread's NUMA node) and free every chunk.
+/// @param cp Pool.
+/// @param nchunks Number of chunks.
+/// @param chunk_size Size of each chunk in bytes.
+static inline void chunkpool_init(struct chunkpool *cp, uint32_t nchunks, size_t chunk_size)
+{
+    memset(cp, 0, sizeof(*cp));
+    cp->nchunks    = nchunks;
+    cp->chunk_size = chunk_size;
+
+    cp->mem = mmap(NULL, (size_t)nchunks * chunk_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (cp->mem == MAP_FAILED)
+    {
+        perror("mmap chunk pool");
+        exit(1);
+    }
+
+    if ((cp->next = calloc(nchunks, sizeof(*cp->next))) == NULL)
+    {
+        perror("malloc failure");
+        exit(1);
+    }
+
+    for (uint32_t i = nchunks; i > 0; i--) // so chunks are handed out in address order
+        chunkpool_put(cp, cp->mem + (size_t)(i - 1) * chunk_size);
+}
+
+/// @brief Release the pool's memory.  Every chunk must have been put back.
+static inline void chunkpool_free(struct chunkpool *cp)
+{
+    munmap(cp->mem, (size_t)cp->nchunks * cp->chunk_size);
+    free(cp->next);
+    cp->mem  = NULL;
+    cp->next = NULL;
+}
+
+#endif
@@ -23,6 +23,8 @@
 #include <GraphBLAS.h>
 #endif
 
+#include "tarwriter.h"
+
 #define WINDOWSIZE (1 << 23)
 #define SUBWINSIZE (1 << 17)
 #define PKTBUFSIZE (1 << 17)
@@ -31,33 +33,6 @@
 
 #define BSWAP(a) (pstate->swapped ? ntohl(a) : (a))
 
-struct posix_tar_header
-{                     /* byte offset */
-  char name[100];     /*   0 */
-  char mode[8];       /* 100 */
-  char uid[8];        /* 108 */
-  char gid[8];        /* 116 */
-  char size[12];      /* 124 */
-  char mtime[12];     /* 136 */
-  char chksum[8];     /* 148 */
-  char typeflag;      /* 156 */
-  char linkname[100]; /* 157 */
-  char magic[6];      /* 257 */
-  char version[2];    /* 263 */
-  char uname[32];     /* 265 */
-  char gname[32];     /* 297 */
-  char devmajor[8];   /* 329 */
-  char devminor[8];   /* 337 */
-  char prefix[155];   /* 345 */
-                      /* 500 */
-  char padding1[12];  /* 512 */
-};
-
-#define TMAGIC "ustar" /* ustar and a null */
-#define TMAGLEN 6
-#define TVERSION "00" /* 00 and no null */
-#define TVERSLEN 2
-
 struct _serialized_blob
 {
   void *blob_data;
@@ -0,0 +1,352 @@
+#ifndef EVEFLOW_H
+#define EVEFLOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Scanner for Suricata EVE flow records, in place of a yyjson DOM per record.
+//
+// It walks the top-level object of one record for "src_ip", "dest_ip" and "flow" (and, in "flow",
+// "pkts_toserver" and "pkts_toclient"), skips every other value without building or copying anything, and parses
+// the dotted quads and packet counts where they lie.  Strings are skipped 16 bytes at a time with SSE2.
+//
+// It accepts only records it reads exactly as yyjson_read_opts() + inet_aton() would: skipped values are checked
+// against the JSON grammar too.  Anything else is left to the caller's yyjson path (which also reports errors):
+// escapes in keys or addresses, non-ASCII bytes, a number with an exponent or more than 19 digits, a packet count
+// that is not a non-negative integer, an address that is not a plain dotted quad, a missing field, or nesting
+// deeper than EVEFLOW_MAX_DEPTH.
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define EVEFLOW_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define EVEFLOW_MAX_DIGITS 19 // longest integer parsed: every 19 digit number fits a uint64_t
+#define EVEFLOW_MAX_DEPTH  32 // deepest value skipped
+
+/// @brief Fields of an EVE flow record.
+struct eveflow
+{
+    uint32_t src_saddr, dst_saddr; // network byte order, as inet_aton() gives them
+    uint64_t pkts_toserver, pkts_toclient;
+};
+
+static inline const char *eveflow_ws(const char *p, const char *end)
+{
+    while (p < end && (unsigned char)*p <= ' ' && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+/// @brief Find the closing quote of a string.
+/// @param p First byte after the opening quote.
+/// @param escapes Set if the string has escape sequences (checked, not decoded).
+/// @return The closing quote, or NULL if the string is malformed, not ASCII, or not closed before end.
+static inline const char *eveflow_string_end(const char *p, const char *end, int *escapes)
+{
+    while (p < end)
+    {
+#ifdef EVEFLOW_HAVE_SSE2
+        // Stop at a quote, a backslash, or a byte outside 0x20-0x7f (signed compare: less than 0x20).
+        while (end - p >= 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            int mask  = _mm_movemask_epi8(_mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                _mm_cmplt_epi8(v, _mm_set1_epi8(0x20))));
+
+            if (mask != 0)
+            {
+                p += __builtin_ctz(mask);
+                break;
+            }
+            p += 16;
+        }
+        if (p >= end)
+            break;
+#endif
+        unsigned char c = *p;
+
+        if (c == '"')
+            return p;
+        if (c < 0x20 || c >= 0x80)
+            return NULL;
+        if (c == '\\')
+        {
+            *escapes = 1;
+            if (++p >= end)
+                return NULL;
+            if (*p == 'u')
+            {
+                if (end - p < 5)
+                    return NULL;
+                for (int i = 1; i <= 4; i++)
+                    if (!((p[i] >= '0' && p[i] <= '9') || ((p[i] | 0x20) >= 'a' && (p[i] | 0x20) <= 'f')))
+                        return NULL;
+                if ((p[1] | 0x20) == 'd' && p[2] >= '8') // a surrogate: yyjson checks the pair
+                    return NULL;
+                p += 4;
+            }
+            else if (*p == '\0' || strchr("\"\\/bfnrt", *p) == NULL)
+            {
+                return NULL;
+            }
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/// @brief Skip a JSON number, or parse it if it is a non-negative integer.
+/// @param value Integer value, or UINT64_MAX if the number has a sign or a fraction.
+/// @return First byte after the number, or NULL if malformed, with an exponent or too long (left to yyjson).
+static inline const char *eveflow_number(const char *p, const char *end, uint64_t *value)
+{
+    const char *digits;
+    uint64_t v = 0;
+    int plain  = 1;
+
+    if (p < end && *p == '-')
+    {
+        plain = 0;
+        p++;
+    }
+    digits = p;
+    if (p >= end || *p < '0' || *p > '9')
+        return NULL;
+    if (*p == '0')
+        p++;
+    else
+        while (p < end && *p >= '0' && *p <= '9')
+            v = 10 * v + (*p++ - '0');
+    if (p - digits > EVEFLOW_MAX_DIGITS)
+        return NULL;
+    if (p < end && *p == '.')
+    {
+        plain = 0;
+        if (++p >= end || *p < '0' || *p > '9')
+            return NULL;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+        return NULL;
+
+    *value = plain ? v : UINT64_MAX;
+    return p;
+}
+
+/// @brief Parse a dotted quad the way inet_aton() reads it, when it is 4 decimal numbers of 0-255 (no leading
+///        zeros: inet_aton() reads those as octal).
+/// @return 1 with the address in network byte order, or 0 for anything else.
+static inline int eveflow_ip4(const char *p, const char *end, uint32_t *addr)
+{
+    uint8_t b[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        const char *digits;
+        unsigned v = 0;
+
+        if (i > 0 && (p >= end || *p++ != '.'))
+            return 0;
+        digits = p;
+        while (p < end && *p >= '0' && *p <= '9' && p - digits < 4)
+            v = 10 * v + (*p++ - '0');
+        if (p == digits || p - digits > 3 || v > 255 || (p - digits > 1 && *digits == '0'))
+            return 0;
+        b[i] = v;
+    }
+    if (p != end)
+        return 0;
+
+    memcpy(addr, b, sizeof(*addr));
+    return 1;
+}
+
+/// @brief Skip a JSON value, checking its syntax.
+/// @param depth Nesting depth of the value; deeper than EVEFLOW_MAX_DEPTH is left to yyjson.
+/// @return First byte after the value, or NULL if it is malformed or not handled by this scanner.
+static inline const char *eveflow_skip(const char *p, const char *end, int depth)
+{
+    int escapes = 0;
+    uint64_t num;
+
+    if (p >= end)
+        return NULL;
+
+    switch (*p)
+    {
+        case '"':
+            return (p = eveflow_string_end(p + 1, end, &escapes)) == NULL ? NULL : p + 1;
+        case '{':
+        case '[':
+        {
+            const char close = *p == '{' ? '}' : ']';
+
+            if (depth >= EVEFLOW_MAX_DEPTH)
+                return NULL;
+            if ((p = eveflow_ws(p + 1, end)) < end && *p == close)
+                return p + 1;
+            while (1)
+            {
+                if (close == '}')
+                {
+                    if (p >= end || *p != '"' || (p = eveflow_string_end(p + 1, end, &escapes)) == NULL)
+                        return NULL;
+                    if ((p = eveflow_ws(p + 1, end)) >= end || *p != ':')
+                        return NULL;
+                    p = eveflow_ws(p + 1, end);
+                }
+                if ((p = eveflow_skip(p, end, depth + 1)) == NULL)
+                    return NULL;
+                if ((p = eveflow_ws(p, end)) >= end)
+                    return NULL;
+                if (*p == close)
+                    return p + 1;
+                if (*p != ',')
+                    return NULL;
+                p = eveflow_ws(p + 1, end);
+            }
+        }
+        case 't':
+            return end - p >= 4 && memcmp(p, "true", 4) == 0 ? p + 4 : NULL;
+        case 'f':
+            return end - p >= 5 && memcmp(p, "false", 5) == 0 ? p + 5 : NULL;
+        case 'n':
+            return end - p >= 4 && memcmp(p, "null", 4) == 0 ? p + 4 : NULL;
+        default:
+            return eveflow_number(p, end, &num);
+    }
+}
+
+/// @brief Read the key of an object member, and move to its value.
+/// @param key Key, if it has no escape sequences (else NULL: decoding them is left to yyjson).
+/// @return First byte of the value, or NULL if malformed.
+static inline const char *eveflow_key(const char *p, const char *end, const char **key, size_t *keylen)
+{
+    const char *k = p + 1;
+    int escapes   = 0;
+
+    if (p >= end || *p != '"' || (p = eveflow_string_end(k, end, &escapes)) == NULL)
+        return NULL;
+    *key    = escapes ? NULL : k;
+    *keylen = p - k;
+    if ((p = eveflow_ws(p + 1, end)) >= end || *p != ':')
+        return NULL;
+    return eveflow_ws(p + 1, end);
+}
+
+#define EVEFLOW_KEY(key, keylen, name) ((keylen) == sizeof(name) - 1 && !memcmp(key, name, sizeof(name) - 1))
+
+/// @brief Read the packet counts of the "flow" object.
+/// @return First byte after the object, or NULL if it is not an object the scanner handles.
+static inline const char *eveflow_counts(const char *p, const char *end, struct eveflow *flow)
+{
+    int have_toserver = 0, have_toclient = 0;
+
+    if (p >= end || *p != '{')
+        return NULL;
+    if ((p = eveflow_ws(p + 1, end)) < end && *p == '}')
+        return p + 1;
+    while (1)
+    {
+        const char *key;
+        size_t keylen;
+        uint64_t *count = NULL;
+
+        if ((p = eveflow_key(p, end, &key, &keylen)) == NULL || key == NULL)
+            return NULL;
+
+        // The first of duplicate keys counts, as with yyjson_obj_get().
+        if (EVEFLOW_KEY(key, keylen, "pkts_toserver") && !have_toserver++)
+            count = &flow->pkts_toserver;
+        else if (EVEFLOW_KEY(key, keylen, "pkts_toclient") && !have_toclient++)
+            count = &flow->pkts_toclient;
+
+        if (count != NULL)
+        {
+            // yyjson_get_uint() casts negative integers and gives 0 for reals: left to yyjson.
+            if ((p = eveflow_number(p, end, count)) == NULL || *count == UINT64_MAX)
+                return NULL;
+        }
+        else if ((p = eveflow_skip(p, end, 2)) == NULL)
+        {
+            return NULL;
+        }
+
+        if ((p = eveflow_ws(p, end)) >= end)
+            return NULL;
+        if (*p == '}')
+            return p + 1;
+        if (*p != ',')
+            return NULL;
+        p = eveflow_ws(p + 1, end);
+    }
+}
+
+/// @brief Scan one EVE flow record.
+/// @param str Record, one JSON object (need not be NUL terminated; anything after the object is ignored).
+/// @param len Length of the record.
+/// @param flow Addresses and packet counts (missing counts are 0, as with yyjson_get_uint()).
+/// @return 1 if the record was read, 0 if it must be parsed with yyjson.
+static inline int eveflow_scan(const char *str, size_t len, struct eveflow *flow)
+{
+    const char *p   = str;
+    const char *end = str + len;
+    int have_src = 0, have_dst = 0, have_flow = 0;
+
+    flow->pkts_toserver = 0;
+    flow->pkts_toclient = 0;
+
+    if ((p = eveflow_ws(p, end)) >= end || *p != '{')
+        return 0;
+    p = eveflow_ws(p + 1, end);
+    while (1)
+    {
+        const char *key;
+        size_t keylen;
+        uint32_t *addr = NULL;
+
+        if ((p = eveflow_key(p, end, &key, &keylen)) == NULL || key == NULL)
+            return 0;
+
+        if (EVEFLOW_KEY(key, keylen, "src_ip") && !have_src++)
+            addr = &flow->src_saddr;
+        else if (EVEFLOW_KEY(key, keylen, "dest_ip") && !have_dst++)
+            addr = &flow->dst_saddr;
+
+        if (addr != NULL)
+        {
+            const char *ip = p + 1;
+            int escapes    = 0;
+
+            if (p >= end || *p != '"' || (p = eveflow_string_end(ip, end, &escapes)) == NULL || escapes ||
+                !eveflow_ip4(ip, p, addr))
+                return 0;
+            p++;
+        }
+        else if (EVEFLOW_KEY(key, keylen, "flow") && !have_flow++)
+        {
+            if ((p = eveflow_counts(p, end, flow)) == NULL)
+                return 0;
+        }
+        else if ((p = eveflow_skip(p, end, 1)) == NULL)
+        {
+            return 0;
+        }
+
+        if ((p = eveflow_ws(p, end)) >= end)
+            return 0;
+        if (*p == '}')
+            break;
+        if (*p != ',')
+            return 0;
+        p = eveflow_ws(p + 1, end);
+    }
+
+    return have_src && have_dst && have_flow;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef IP4CACHE_H
+#define IP4CACHE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Precomputed IPv4 anonymization table (see makecache): one uint32_t per address.
+#define IP4CACHE_ENTRIES (UINT_MAX - 1)
+#define IP4CACHE_SIZE    (sizeof(uint32_t) * IP4CACHE_ENTRIES)
+
+/// @brief Map a read-only file shared, so every process using the same table shares one page cache copy.
+static inline uint32_t *ip4cache_mmap_fd(int fd, size_t len, int extra_flags, const char *path)
+{
+    void *table = mmap(NULL, len, PROT_READ, MAP_SHARED | extra_flags, fd, 0);
+
+    if (table == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    return (uint32_t *)table;
+}
+
+/// @brief Copy the table into a hugetlbfs file (once per boot, shared by every later run) and map it from there.
+/// @param src_fd Open descriptor of the table file.
+/// @param path Path of the table file.
+/// @param hugedir hugetlbfs mount point.
+/// @param len Set to the length of the mapping (a multiple of the huge page size).
+static inline uint32_t *ip4cache_map_hugetlbfs(int src_fd, const char *path, const char *hugedir, size_t *len)
+{
+    char name[PATH_MAX], tmpname[PATH_MAX + 32], base[PATH_MAX];
+    struct statfs sfs;
+    struct stat st;
+    uint8_t *table;
+    size_t done = 0;
+    int fd;
+
+    if (statfs(hugedir, &sfs) == -1)
+    {
+        perror("statfs hugetlbfs");
+        exit(1);
+    }
+
+    snprintf(base, sizeof(base), "%s", path);
+    snprintf(name, sizeof(name), "%s/%s", hugedir, basename(base));
+    *len = (IP4CACHE_SIZE + sfs.f_bsize - 1) / sfs.f_bsize * sfs.f_bsize;
+
+    if ((fd = open(name, O_RDONLY)) != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size == *len)
+    {
+        fprintf(stderr, "mapping anonymization table from hugetlbfs: %s\n", name);
+        return ip4cache_mmap_fd(fd, *len, 0, name);
+    }
+
+    if (fd != -1)
+        close(fd);
+
+    // Fill a private name first, then rename: other sensors starting now never see a partial copy.
+    snprintf(tmpname, sizeof(tmpname), "%s.%d", name, getpid());
+    fprintf(stderr, "copying anonymization table to hugetlbfs: %s\n", name);
+
+    if ((fd = open(tmpname, O_CREAT | O_RDWR | O_EXCL, 0644)) == -1 || ftruncate(fd, *len) == -1)
+    {
+        fprintf(stderr, "hugetlbfs %s: %s\n", tmpname, strerror(errno));
+        exit(1);
+    }
+
+    if ((table = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap %s: %s\n", tmpname, strerror(errno));
+        unlink(tmpname);
+        exit(1);
+    }
+
+    while (done < IP4CACHE_SIZE)
+    {
+        ssize_t n = pread(src_fd, table + done, IP4CACHE_SIZE - done, done);
+
+        if (n <= 0)
+        {
+            perror("read anonymization table");
+            unlink(tmpname);
+            exit(1);
+        }
+
+        done += n;
+    }
+
+    if (mprotect(table, *len, PROT_READ) == -1 || rename(tmpname, name) == -1)
+    {
+        perror("hugetlbfs rename");
+        exit(1);
+    }
+
+    close(fd);
+
+    return (uint32_t *)table;
+}
+
+/// @brief Map a precomputed IPv4 anonymization table (generated with makecache).
+/// @param path Path of the table file.
+/// @param mode NULL or "lazy": fault in only the pages that are looked up.  "populate": read the whole table in at
+///        startup.  Otherwise, a hugetlbfs mount point to keep a shared huge page copy of the table in.
+/// @param len Set to the length of the mapping, for munmap().
+/// @return The table; exits on error.
+static inline uint32_t *ip4cache_map(const char *path, const char *mode, size_t *len)
+{
+    struct stat st;
+    uint32_t *table;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+    {
+        perror("open anonymization table");
+        exit(1);
+    }
+
+    fprintf(stderr, "table is %ld bytes\n", (long)st.st_size);
+
+    if ((size_t)st.st_size < IP4CACHE_SIZE)
+    {
+        fprintf(stderr, "anonymization table is truncated (expected %zu bytes)\n", IP4CACHE_SIZE);
+        exit(1);
+    }
+
+    *len = IP4CACHE_SIZE;
+
+    if (mode == NULL || strcmp(mode, "lazy") == 0)
+    {
+        table = ip4cache_mmap_fd(fd, *len, 0, path);
+        madvise(table, *len, MADV_RANDOM); // lookups are scattered: no readahead around each fault
+    }
+    else if (strcmp(mode, "populate") == 0)
+    {
+        table = ip4cache_mmap_fd(fd, *len, MAP_POPULATE, path);
+    }
+    else
+    {
+        table = ip4cache_map_hugetlbfs(fd, path, mode, len);
+    }
+
+    close(fd);
+
+    return table;
+}
+
+/// @brief Unmap a table mapped with ip4cache_map().
+static inline void ip4cache_unmap(uint32_t *table, size_t len)
+{
+    if (table != NULL)
+        munmap(table, len);
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef IP4MEMO_H
+#define IP4MEMO_H
+
+#include <GraphBLAS.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cryptopANT.h"
+
+// Memo of CryptopANT results, filled on first use and shared by every thread.  It is split into shards, each an
+// open addressing table of (address << 32 | anonymized address) words: lookups are lock-free atomic loads, inserts
+// take the shard lock.  A shard that fills up is emptied, which bounds the memo to 8 bytes per slot.  It can be
+// saved to disk and loaded back at startup, so a restarted sensor doesn't pay for its working set again.
+//
+// It also implements anonymization after aggregation: a matrix built on raw addresses is remapped by anonymizing
+// each distinct row and column index once (CryptopANT is a bijection, so the result equals a matrix built from
+// anonymized tuples).
+
+#define IP4MEMO_SHARD_BITS   6 // 64 shards
+#define IP4MEMO_SHARDS       (1 << IP4MEMO_SHARD_BITS)
+#define IP4MEMO_DEFAULT_BITS 24 // 2^24 slots (128 MB), up to 12M addresses
+#define IP4MEMO_MAGIC        "IP4MEMO1"
+#define IP4MEMO_NPROBES      4
+
+/// @brief How a tool anonymizes addresses; the same values in pcap2grb, json2grb and suricata2grb.
+enum anon_mode
+{
+    ANON_NONE = 0,   // raw addresses
+    ANON_CRYPTOPANT, // CryptopANT, per packet or record (-a)
+    ANON_TABLE,      // precomputed IPv4 table (-c, pcap2grb)
+    ANON_AFTER_AGG,  // CryptopANT after aggregation, each distinct address once through the memo (-A)
+    ANON_MEMO,       // CryptopANT per packet or record, through the memo (-m)
+    ANON_CRYPTOPAN,  // Crypto-PAn, a batch per subwindow (-k)
+};
+
+/// @brief One shard of the memo (on its own cache lines).
+struct ip4memo_shard
+{
+    pthread_mutex_t lock; // inserts and flushes
+    uint64_t *slots;      // (address << 32) | anonymized address; 0 is an empty slot (address 0 is kept aside)
+    size_t count;
+    uint64_t flushes;
+} __attribute__((aligned(64)));
+
+/// @brief Concurrent, bounded memo of anonymized IPv4 addresses.
+struct ip4memo
+{
+    struct ip4memo_shard shards[IP4MEMO_SHARDS];
+    unsigned int slot_bits; // log2 of the slots per shard
+    uint32_t zero_val;      // anonymized 0.0.0.0, valid once zero_valid is set
+    int zero_valid;
+    uint64_t misses;               // CryptopANT calls
+    pthread_mutex_t scramble_lock; // scramble_ip4() is not thread safe
+};
+
+/// @brief On-disk memo header, followed by count (address, anonymized address) pairs.
+struct ip4memo_file_header
+{
+    char magic[8];
+    uint32_t probe[IP4MEMO_NPROBES]; // anonymized probe addresses: the memo only loads under the same key
+    uint64_t count;
+};
+
+static const uint32_t ip4memo_probe_addrs[IP4MEMO_NPROBES] = { 0x01020304, 0x0A000001, 0x7F000001, 0xC0A80001 };
+
+/// @brief Allocate an empty memo.
+/// @param m Memo.
+/// @param bits log2 of the total number of slots (8 bytes each).
+static inline void ip4memo_init(struct ip4memo *m, unsigned int bits)
+{
+    memset(m, 0, sizeof(*m));
+
+    if (bits < IP4MEMO_SHARD_BITS + 4)
+        bits = IP4MEMO_SHARD_BITS + 4;
+
+    m->slot_bits = bits - IP4MEMO_SHARD_BITS;
+    pthread_mutex_init(&m->scramble_lock, NULL);
+
+    for (int i = 0; i < IP4MEMO_SHARDS; i++)
+    {
+        pthread_mutex_init(&m->shards[i].lock, NULL);
+
+        if ((m->shards[i].slots = calloc((size_t)1 << m->slot_bits, sizeof(uint64_t))) == NULL)
+        {
+            perror("malloc failure");
+            exit(1);
+        }
+    }
+}
+
+/// @brief Release a memo.
+static inline void ip4memo_free(struct ip4memo *m)
+{
+    for (int i = 0; i < IP4MEMO_SHARDS; i++)
+    {
+        free(m->shards[i].slots);
+        pthread_mutex_destroy(&m->shards[i].lock);
+    }
+
+    pthread_mutex_destroy(&m->scramble_lock);
+}
+
+/// @brief Number of addresses currently in the memo.
+static inline size_t ip4memo_count(struct ip4memo *m)
+{
+    size_t count = 0;
+
+    for (int i = 0; i < IP4MEMO_SHARDS; i++)
+        count += __atomic_load_n(&m->shards[i].count, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+/// @brief Anonymize one address with CryptopANT.
+static inline uint32_t ip4memo_scramble(struct ip4memo *m, uint32_t addr)
+{
+    uint32_t anon;
+
+    pthread_mutex_lock(&m->scramble_lock);
+    anon = scramble_ip4(addr, 16); // preserve 16 upper bits
+    pthread_mutex_unlock(&m->scramble_lock);
+
+    __atomic_add_fetch(&m->misses, 1, __ATOMIC_RELAXED);
+
+    return anon;
+}
+
+/// @brief Hash of an address: the top bits pick the shard, the next ones the first slot to probe.
+static inline uint64_t ip4memo_hash(uint32_t addr)
+{
+    return (uint64_t)addr * 0x9E3779B97F4A7C15ull; // Fibonacci hashing
+}
+
+/// @brief Look addr up in its shard without locking.
+/// @return 1 and sets *anon if found.
+static inline int ip4memo_find(const struct ip4memo *m, const struct ip4memo_shard *sh, uint64_t h, uint32_t addr,
+                               uint32_t *anon)
+{
+    size_t mask = ((size_t)1 << m->slot_bits) - 1;
+    size_t s    = (h >> (64 - IP4MEMO_SHARD_BITS - m->slot_bits)) & mask;
+    uint64_t v;
+
+    while ((v = __atomic_load_n(&sh->slots[s], __ATOMIC_ACQUIRE)) != 0)
+    {
+        if ((uint32_t)(v >> 32) == addr)
+        {
+            *anon = (uint32_t)v;
+            return 1;
+        }
+        s = (s + 1) & mask;
+    }
+
+    return 0;
+}
+
+/// @brief Add an address to its shard (emptying the shard first if it is 3/4 full).  Caller holds the shard lock.
+static inline void ip4memo_put_locked(struct ip4memo *m, struct ip4memo_shard *sh, uint64_t h, uint32_t addr,
+                                      uint32_t anon)
+{
+    size_t mask = ((size_t)1 << m->slot_bits) - 1;
+    size_t s;
+
+    if (4 * (sh->count + 1) > 3 * (mask + 1))
+    {
+        for (s = 0; s <= mask; s++) // readers may be probing: never tear a slot
+            __atomic_store_n(&sh->slots[s], 0, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&sh->count, 0, __ATOMIC_RELAXED);
+        sh->flushes++;
+    }
+
+    s = (h >> (64 - IP4MEMO_SHARD_BITS - m->slot_bits)) & mask;
+    while (__atomic_load_n(&sh->slots[s], __ATOMIC_RELAXED) != 0)
+        s = (s + 1) & mask;
+
+    __atomic_store_n(&sh->slots[s], ((uint64_t)addr << 32) | anon, __ATOMIC_RELEASE);
+    __atomic_store_n(&sh->count, sh->count + 1, __ATOMIC_RELAXED);
+}
+
+/// @brief Anonymized address, from the memo or (first use) CryptopANT.  Thread safe.
+static inline uint32_t ip4memo_get(struct ip4memo *m, uint32_t addr)
+{
+    uint64_t h               = ip4memo_hash(addr);
+    struct ip4memo_shard *sh = &m->shards[h >> (64 - IP4MEMO_SHARD_BITS)];
+    uint32_t anon;
+
+    if (addr == 0)
+    {
+        if (!__atomic_load_n(&m->zero_valid, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&sh->lock);
+            if (!m->zero_valid)
+            {
+                m->zero_val = ip4memo_scramble(m, 0);
+                __atomic_store_n(&m->zero_valid, 1, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&sh->lock);
+        }
+
+        return m->zero_val;
+    }
+
+    if (ip4memo_find(m, sh, h, addr, &anon))
+        return anon;
+
+    pthread_mutex_lock(&sh->lock);
+
+    if (!ip4memo_find(m, sh, h, addr, &anon)) // unless another thread got there first
+    {
+        anon = ip4memo_scramble(m, addr);
+        ip4memo_put_locked(m, sh, h, addr, anon);
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+
+    return anon;
+}
+
+/// @brief Anonymize an array of addresses in place.
+/// @param m Memo.
+/// @param idx Addresses (matrix indices).
+/// @param n Number of addresses.
+static inline void ip4memo_map(struct ip4memo *m, GrB_Index *idx, GrB_Index n)
+{
+    GrB_Index prev = UINT64_MAX;
+    uint32_t anon  = 0;
+
+    for (GrB_Index i = 0; i < n; i++)
+    {
+        if (idx[i] != prev) // row indices come out of extractTuples sorted: reuse the last result
+        {
+            prev = idx[i];
+            anon = ip4memo_get(m, (uint32_t)idx[i]);
+        }
+        idx[i] = anon;
+    }
+}
+
+/// @brief Replace a matrix built on raw addresses by the same matrix on anonymized addresses.
+/// @param m Memo.
+/// @param A Matrix (GrB_UINT32, 2^32 x 2^32); replaced by a new matrix.
+/// @return GrB_SUCCESS or the first GraphBLAS error.
+static inline GrB_Info ip4memo_anonymize_matrix(struct ip4memo *m, GrB_Matrix *A)
+{
+    GrB_Index nvals = 0;
+    GrB_Index *I = NULL, *J = NULL;
+    uint32_t *X = NULL;
+    GrB_Info info;
+
+    if ((info = GrB_Matrix_nvals(&nvals, *A)) != GrB_SUCCESS)
+        return info;
+
+    I = malloc(sizeof(GrB_Index) * (nvals + 1));
+    J = malloc(sizeof(GrB_Index) * (nvals + 1));
+    X = malloc(sizeof(uint32_t) * (nvals + 1));
+
+    if (I == NULL || J == NULL || X == NULL)
+    {
+        perror("malloc failure");
+        exit(1);
+    }
+
+    if ((info = GrB_Matrix_extractTuples_UINT32(I, J, X, &nvals, *A)) == GrB_SUCCESS)
+    {
+        ip4memo_map(m, I, nvals);
+        ip4memo_map(m, J, nvals);
+
+        GrB_free(A);
+        if ((info = GrB_Matrix_new(A, GrB_UINT32, 4294967296, 4294967296)) == GrB_SUCCESS)
+            info = GrB_Matrix_build(*A, I, J, X, nvals, GrB_PLUS_UINT32);
+    }
+
+    free(I);
+    free(J);
+    free(X);
+
+    return info;
+}
+
+/// @brief Fill in the probe addresses of a memo file header for the current CryptopANT key.
+static inline void ip4memo_probe(struct ip4memo *m, struct ip4memo_file_header *fh)
+{
+    pthread_mutex_lock(&m->scramble_lock);
+    for (int i = 0; i < IP4MEMO_NPROBES; i++)
+        fh->probe[i] = scramble_ip4(ip4memo_probe_addrs[i], 16);
+    pthread_mutex_unlock(&m->scramble_lock);
+}
+
+/// @brief Warm-start the memo from a file written by ip4memo_save() under the same key.
+/// @param m Memo.
+/// @param path Memo file; a missing file is not an error.
+/// @return Number of addresses loaded, or -1 if the file is unusable.
+static inline long ip4memo_load(struct ip4memo *m, const char *path)
+{
+    struct ip4memo_file_header fh, cur;
+    uint32_t pair[2];
+    uint64_t i;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+    {
+        if (errno != ENOENT)
+            perror("open anonymization memo");
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    ip4memo_probe(m, &cur);
+
+    if (fread(&fh, sizeof(fh), 1, fp) != 1 || memcmp(fh.magic, IP4MEMO_MAGIC, sizeof(fh.magic)) != 0 ||
+        memcmp(fh.probe, cur.probe, sizeof(fh.probe)) != 0)
+    {
+        fprintf(stderr, "WARN: ignoring anonymization memo %s (bad file, or made with another key)\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    for (i = 0; i < fh.count && fread(pair, sizeof(pair), 1, fp) == 1; i++)
+    {
+        uint64_t h               = ip4memo_hash(pair[0]);
+        struct ip4memo_shard *sh = &m->shards[h >> (64 - IP4MEMO_SHARD_BITS)];
+        uint32_t anon;
+
+        if (pair[0] == 0)
+        {
+            m->zero_val   = pair[1];
+            m->zero_valid = 1;
+            continue;
+        }
+
+        pthread_mutex_lock(&sh->lock);
+        if (!ip4memo_find(m, sh, h, pair[0], &anon))
+            ip4memo_put_locked(m, sh, h, pair[0], pair[1]);
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    fclose(fp);
+
+    return i;
+}
+
+/// @brief Save the memo (written to a temporary file, then renamed into place).
+/// @param m Memo.
+/// @param path Memo file.
+/// @return Number of addresses saved, or -1 on error.
+static inline long ip4memo_save(struct ip4memo *m, const char *path)
+{
+    struct ip4memo_file_header fh = { 0 };
+    char tmp[PATH_MAX + 32];
+    uint64_t count = 0;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+
+    if ((fp = fopen(tmp, "wb")) == NULL)
+    {
+        perror("open anonymization memo");
+        return -1;
+    }
+
+    memcpy(fh.magic, IP4MEMO_MAGIC, sizeof(fh.magic));
+    ip4memo_probe(m, &fh);
+    fwrite(&fh, sizeof(fh), 1, fp); // count is filled in below
+
+    if (__atomic_load_n(&m->zero_valid, __ATOMIC_ACQUIRE))
+    {
+        uint32_t pair[2] = { 0, m->zero_val };
+
+        fwrite(pair, sizeof(pair), 1, fp);
+        count++;
+    }
+
+    for (int i = 0; i < IP4MEMO_SHARDS; i++)
+    {
+        struct ip4memo_shard *sh = &m->shards[i];
+
+        pthread_mutex_lock(&sh->lock);
+        for (size_t s = 0; s < (size_t)1 << m->slot_bits; s++)
+        {
+            if (sh->slots[s] != 0)
+            {
+                uint32_t pair[2] = { (uint32_t)(sh->slots[s] >> 32), (uint32_t)sh->slots[s] };
+
+                fwrite(pair, sizeof(pair), 1, fp);
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    fh.count = count;
+    if (fseek(fp, 0L, SEEK_SET) != 0 || fwrite(&fh, sizeof(fh), 1, fp) != 1 || fclose(fp) != 0 ||
+        rename(tmp, path) != 0)
+    {
+        perror("write anonymization memo");
+        unlink(tmp);
+        return -1;
+    }
+
+    return count;
+}
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef TARWRITER_H
+#define TARWRITER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Support for minimal output tar file creation
+struct posix_tar_header
+{                       /* byte offset */
+    char name[100];     /*   0 - filename */
+    char mode[8];       /* 100 - octal mode */
+    char uid[8];        /* 108 - user ID */
+    char gid[8];        /* 116 - group ID */
+    char size[12];      /* 124 - file size */
+    char mtime[12];     /* 136 - modification time */
+    char chksum[8];     /* 148 - checksum */
+    char typeflag;      /* 156 - type */
+    char linkname[100]; /* 157 - link name */
+    char magic[6];      /* 257 - tar magic, USTAR */
+    char version[2];    /* 263 - tar version */
+    char uname[32];     /* 265 - user name */
+    char gname[32];     /* 297 - group name */
+    char devmajor[8];   /* 329 - device major */
+    char devminor[8];   /* 337 - device minor */
+    char prefix[155];   /* 345 - prefix */
+                        /* 500 */
+    char padding1[12];  /* 512 - unused padding to fill 512 bytes */
+};
+
+#define TMAGIC   "ustar" /* ustar and a null */
+#define TMAGLEN  6
+#define TVERSION "00" /* 00 and no null */
+#define TVERSLEN 2
+
+#define TAR_BLOCKSIZE 512
+#define TAR_EOFSIZE   (2 * TAR_BLOCKSIZE) // end-of-archive marker: two zero blocks
+
+/// @brief One open output tar file.  The descriptor stays open across entries; each entry (header, data and
+///        padding) goes out in a single pwritev(), into space preallocated from the size of the previous file.
+struct tar_writer
+{
+    int fd;
+    char name[PATH_MAX];
+    uint64_t offset;   // where the next entry goes
+    uint64_t reserved; // bytes preallocated so far
+    uint64_t hint;     // size of the last file closed with this writer, used to preallocate the next one
+};
+
+/// @brief Initialize a tar writer with no open file.
+static inline void tar_writer_init(struct tar_writer *tw)
+{
+    memset(tw, 0, sizeof(*tw));
+    tw->fd = -1;
+}
+
+/// @brief True if the writer has a file open.
+static inline int tar_writer_is_open(const struct tar_writer *tw)
+{
+    return tw->fd >= 0;
+}
+
+/// @brief Reserve disk space up to at least end (best effort, the file size is not changed).
+static inline void tar_writer_reserve(struct tar_writer *tw, uint64_t end)
+{
+    if (end <= tw->reserved)
+        return;
+
+    if (end < tw->reserved * 2) // grow geometrically when the hint was too small
+        end = tw->reserved * 2;
+
+#ifdef FALLOC_FL_KEEP_SIZE // _GNU_SOURCE
+    if (fallocate(tw->fd, FALLOC_FL_KEEP_SIZE, tw->reserved, end - tw->reserved) == 0)
+    {
+        tw->reserved = end;
+        return;
+    }
+#endif
+
+    tw->reserved = UINT64_MAX; // not supported here, don't try again
+}
+
+/// @brief Find where the next entry of an existing archive goes, walking its entries header by header (so the data
+///        of an entry is never mistaken for an end-of-archive marker, whatever it ends with).
+/// @param fd Archive, open for reading.
+/// @param size Size of the archive.
+/// @return Offset of the end-of-archive marker, or size if the archive has none (it was closed unfinished) or is
+///         not one this writer can walk.
+static inline uint64_t tar_writer_end(int fd, uint64_t size)
+{
+    static const unsigned char zero[TAR_BLOCKSIZE] = { 0 };
+    struct posix_tar_header th;
+    uint64_t off = 0;
+
+    while (off + TAR_BLOCKSIZE <= size)
+    {
+        char octal[sizeof(th.size) + 1];
+        uint64_t entry;
+
+        if (pread(fd, &th, sizeof(th), off) != sizeof(th))
+            return size;
+        if (memcmp(&th, zero, sizeof(th)) == 0) // a zero block where a header goes: the marker
+            return off;
+        if (memcmp(th.magic, TMAGIC, TMAGLEN - 1) != 0)
+            return size;
+
+        memcpy(octal, th.size, sizeof(th.size));
+        octal[sizeof(th.size)] = '\0';
+        entry                  = strtoull(octal, NULL, 8);
+        off += TAR_BLOCKSIZE + (entry + TAR_BLOCKSIZE - 1) / TAR_BLOCKSIZE * TAR_BLOCKSIZE;
+    }
+
+    return size;
+}
+
+/// @brief Open (or create) a tar file for appending.  An end-of-archive marker left by an earlier writer is
+///        overwritten by the next entry.
+/// @param tw Tar writer, with no open file.
+/// @param name Path of the tar file.
+static inline void tar_writer_open(struct tar_writer *tw, const char *name)
+{
+    struct stat st;
+
+    if ((tw->fd = open(name, O_CREAT | O_RDWR, 0660)) == -1 || fstat(tw->fd, &st) == -1)
+    {
+        perror("open tar");
+        exit(1);
+    }
+
+    snprintf(tw->name, sizeof(tw->name), "%s", name);
+    tw->offset   = st.st_size > 0 ? tar_writer_end(tw->fd, st.st_size) : 0;
+    tw->reserved = st.st_size;
+
+    if (tw->hint > 0)
+        tar_writer_reserve(tw, tw->offset + tw->hint);
+}
+
+/// @brief Write all of an I/O vector at the writer's offset.
+static inline void tar_writer_pwritev(struct tar_writer *tw, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = pwritev(tw->fd, iov, iovcnt, tw->offset);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("write tar error");
+            exit(4);
+        }
+
+        tw->offset += n;
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) // skip what was written, then retry the rest
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/// @brief Append one file entry (header, data and padding to a 512 byte boundary).
+/// @param tw Tar writer with an open file.
+/// @param entry_name Name of the entry in the archive.
+/// @param data Entry contents.
+/// @param size Size of data.
+static inline void tar_writer_add(struct tar_writer *tw, const char *entry_name, const void *data, uint64_t size)
+{
+    static const unsigned char padblock[TAR_BLOCKSIZE] = { 0 };
+    struct posix_tar_header th                         = { 0 }; // let's make a tar file, or close enough
+    const unsigned char *th_ptr                        = (const unsigned char *)&th;
+    size_t tmp_chksum                                  = 0;
+    size_t aligned                                     = (sizeof(th) + size) % TAR_BLOCKSIZE;
+    struct iovec iov[3];
+
+    snprintf(th.name, sizeof(th.name), "%s", entry_name);
+    sprintf(th.uid, "%06o ", 0);
+    sprintf(th.gid, "%06o ", 0);
+    snprintf(th.size, sizeof(th.size), "%011lo", (unsigned long)size);
+    sprintf(th.mode, "%06o", 0644);
+    sprintf(th.magic, "%s", TMAGIC);
+    snprintf(th.mtime, sizeof(th.mtime), "%011o", (unsigned int)time(NULL));
+    th.typeflag = '0';
+    memset(th.chksum, ' ', 8); // or checksum computed below will be wrong!
+
+    for (size_t b = 0; b < sizeof(struct posix_tar_header); b++)
+        tmp_chksum += th_ptr[b];
+
+    sprintf(th.chksum, "%06o ", (unsigned int)tmp_chksum);
+
+    iov[0].iov_base = &th;
+    iov[0].iov_len  = sizeof(th);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = size;
+    iov[2].iov_base = (void *)padblock;
+    iov[2].iov_len  = aligned ? TAR_BLOCKSIZE - aligned : 0;
+
+    tar_writer_reserve(tw, tw->offset + sizeof(th) + size + iov[2].iov_len + TAR_EOFSIZE);
+    tar_writer_pwritev(tw, iov, 3);
+}
+
+/// @brief Append already formatted tar entries (e.g. another archive without its end-of-archive marker).
+static inline void tar_writer_add_raw(struct tar_writer *tw, const void *data, uint64_t size)
+{
+    struct iovec iov = { (void *)data, size };
+
+    tar_writer_reserve(tw, tw->offset + size + TAR_EOFSIZE);
+    tar_writer_pwritev(tw, &iov, 1);
+}
+
+/// @brief Close the writer's file, releasing unused preallocated space.
+/// @param tw Tar writer; nothing happens if no file is open.
+/// @param finish Write the end-of-archive marker.  Leave it off for a file that more entries will be appended to.
+static inline void tar_writer_close(struct tar_writer *tw, int finish)
+{
+    static const unsigned char zero[TAR_EOFSIZE] = { 0 };
+
+    if (tw->fd < 0)
+        return;
+
+    if (finish)
+    {
+        struct iovec iov = { (void *)zero, sizeof(zero) };
+
+        tar_writer_pwritev(tw, &iov, 1);
+    }
+
+    if (ftruncate(tw->fd, tw->offset) == -1) // drop an old marker or preallocated blocks past the end
+    {
+        perror("ftruncate tar");
+    }
+
+    if (close(tw->fd) == -1)
+    {
+        perror("close tar");
+        exit(4);
+    }
+
+    tw->hint = tw->offset;
+    tw->fd   = -1;
+}
+
+#endif
@@ -0,0 +1,459 @@
+#ifndef WINPOOL_H
+#define WINPOOL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Fixed pool of worker threads fed by a bounded FIFO of full packet windows.  When the workers fall behind, the
+// producer either waits (block), discards the oldest queued window (drop) or writes the new window to disk, to be
+// read back when a worker gets to it (spill).  A window that cannot be spilled (disk full, ...) is queued like a
+// blocked one.  Memory is bounded by (queue depth + workers) windows in every case.
+//
+// A window is a list of memory segments (so it can be built from buffers by reference) plus an owner object that
+// the pool releases once the window has been processed, dropped or spilled.
+
+#define WINPOOL_BLOCK 0 // producer waits for room in the queue
+#define WINPOOL_DROP  1 // oldest queued window is discarded
+#define WINPOOL_SPILL 2 // new window goes to a file in the spill directory
+
+/// @brief Process one window; it is released by the pool afterwards.
+typedef void (*winpool_fn)(const struct iovec *iov, int iovcnt, const struct tm *t, uint64_t count);
+
+/// @brief Release a window's owner object.
+typedef void (*winpool_release_fn)(void *owner);
+
+/// @brief One queued window, in memory (iov) or spilled to disk (spill; iov keeps the segment sizes).
+struct winpool_job
+{
+    struct iovec *iov;
+    int iovcnt;
+    size_t len; // total bytes
+    void *owner;
+    winpool_release_fn release; // NULL: free(owner)
+    struct tm t;
+    uint64_t count; // caller's size of the window (e.g. packets)
+    char *spill;
+    struct winpool_job *next;
+};
+
+/// @brief Pool counters, for sizing the pool and queue to the link.
+struct winpool_stats
+{
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t dropped;    // windows discarded by the drop policy
+    uint64_t spilled;    // windows written to disk by the spill policy
+    uint64_t spill_failed; // windows the spill policy could not write, blocked on instead
+    uint64_t stalls;     // submissions that found the queue full
+    double stall_time;   // seconds the producer waited (block policy)
+    unsigned depth;      // windows queued in memory
+    unsigned spill_depth; // windows queued on disk
+    unsigned max_depth;  // highest depth seen
+    unsigned busy;       // workers processing a window
+};
+
+struct winpool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    struct winpool_job *head, *tail;
+    unsigned queue_size; // in-memory queue bound
+    unsigned nworkers;
+    int policy;
+    int closed;
+    char spill_dir[PATH_MAX];
+    uint64_t spill_seq;
+    winpool_fn fn;
+    pthread_t *threads;
+    struct winpool_stats st;
+};
+
+/// @brief Parse a backpressure policy name.
+/// @return WINPOOL_BLOCK, WINPOOL_DROP, WINPOOL_SPILL or -1.
+static inline int winpool_policy(const char *name)
+{
+    if (strcmp(name, "block") == 0)
+        return WINPOOL_BLOCK;
+    if (strcmp(name, "drop") == 0)
+        return WINPOOL_DROP;
+    if (strcmp(name, "spill") == 0)
+        return WINPOOL_SPILL;
+
+    return -1;
+}
+
+/// @brief Release the memory of a window (not the job itself).
+static inline void winpool_release(struct winpool_job *job)
+{
+    if (job->release != NULL)
+        job->release(job->owner);
+    else
+        free(job->owner);
+
+    job->owner = NULL;
+}
+
+/// @brief Read a spilled window back (and remove its file).  The segments keep their sizes, in one buffer.
+static inline void winpool_unspill(struct winpool_job *job)
+{
+    size_t done = 0;
+    char *buf;
+    int fd;
+
+    if ((buf = malloc(job->len)) == NULL)
+    {
+        perror("malloc failure");
+        exit(1);
+    }
+
+    if ((fd = open(job->spill, O_RDONLY)) == -1)
+    {
+        perror("open spilled window");
+        exit(1);
+    }
+
+    while (done < job->len)
+    {
+        ssize_t n = read(fd, buf + done, job->len - done);
+
+        if (n <= 0)
+        {
+            perror("read spilled window");
+            exit(1);
+        }
+        done += n;
+    }
+
+    close(fd);
+    unlink(job->spill);
+    free(job->spill);
+    job->spill = NULL;
+
+    job->owner   = buf;
+    job->release = NULL;
+    for (int i = 0; i < job->iovcnt; buf += job->iov[i++].iov_len)
+        job->iov[i].iov_base = buf;
+}
+
+/// @brief Write a window to a new file in the spill directory.
+/// @return 0, or -1 if it could not be written (the window stays in memory).
+static inline int winpool_spill(struct winpool *p, struct winpool_job *job, uint64_t seq)
+{
+    char name[PATH_MAX + 64];
+    size_t done = 0;
+    int fd;
+
+    snprintf(name, sizeof(name), "%s/.winpool.%d.%lu.spill", p->spill_dir, getpid(), (unsigned long)seq);
+
+    if ((fd = open(name, O_CREAT | O_EXCL | O_WRONLY, 0600)) == -1)
+    {
+        perror("open spill file");
+        return -1;
+    }
+
+    for (int i = 0; i < job->iovcnt; i++)
+    {
+        for (done = 0; done < job->iov[i].iov_len;)
+        {
+            ssize_t n = write(fd, (const char *)job->iov[i].iov_base + done, job->iov[i].iov_len - done);
+
+            if (n <= 0)
+            {
+                perror("write spill file");
+                close(fd);
+                unlink(name);
+                return -1;
+            }
+            done += n;
+        }
+    }
+
+    close(fd);
+    winpool_release(job);
+    job->spill = strdup(name);
+
+    return 0;
+}
+
+/// @brief Wait (with the lock held) until there is room in the in-memory queue, and account the time.
+static inline void winpool_wait(struct winpool *p)
+{
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (p->st.depth >= p->queue_size)
+        pthread_cond_wait(&p->not_full, &p->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    p->st.stall_time += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+static inline void *winpool_worker(void *arg)
+{
+    struct winpool *p = (struct winpool *)arg;
+    struct winpool_job *job;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&p->lock);
+        while (p->head == NULL && !p->closed)
+            pthread_cond_wait(&p->not_empty, &p->lock);
+
+        if ((job = p->head) == NULL) // closed and drained
+        {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+
+        if ((p->head = job->next) == NULL)
+            p->tail = NULL;
+
+        if (job->spill != NULL)
+        {
+            p->st.spill_depth--;
+        }
+        else
+        {
+            p->st.depth--;
+            pthread_cond_signal(&p->not_full);
+        }
+        p->st.busy++;
+        pthread_mutex_unlock(&p->lock);
+
+        if (job->spill != NULL)
+            winpool_unspill(job);
+
+        p->fn(job->iov, job->iovcnt, &job->t, job->count);
+        winpool_release(job);
+        free(job->iov);
+        free(job);
+
+        pthread_mutex_lock(&p->lock);
+        p->st.busy--;
+        p->st.completed++;
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/// @brief Start the worker threads.
+/// @param p Pool.
+/// @param nworkers Number of worker threads.
+/// @param queue_size Windows that may wait in memory for a worker.
+/// @param policy WINPOOL_BLOCK, WINPOOL_DROP or WINPOOL_SPILL.
+/// @param spill_dir Directory for spilled windows (WINPOOL_SPILL).
+/// @param fn Window processing function.
+static inline void winpool_start(struct winpool *p, unsigned nworkers, unsigned queue_size, int policy,
+                                 const char *spill_dir, winpool_fn fn)
+{
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->not_empty, NULL);
+    pthread_cond_init(&p->not_full, NULL);
+
+    p->nworkers   = nworkers > 0 ? nworkers : 1;
+    p->queue_size = queue_size > 0 ? queue_size : 1;
+    p->policy     = policy;
+    p->fn         = fn;
+    snprintf(p->spill_dir, sizeof(p->spill_dir), "%s", spill_dir != NULL ? spill_dir : ".");
+
+    if ((p->threads = calloc(p->nworkers, sizeof(pthread_t))) == NULL)
+    {
+        perror("malloc failure");
+        exit(1);
+    }
+
+    for (unsigned i = 0; i < p->nworkers; i++)
+    {
+        if (pthread_create(&p->threads[i], NULL, winpool_worker, p) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+}
+
+/// @brief Queue a full window.  The pool owns the window from now on.
+/// @param p Pool.
+/// @param iov Window contents (copied; the memory it points to is not).
+/// @param iovcnt Number of segments.
+/// @param owner Object holding the window's memory, released when the pool is done with it.
+/// @param release Function releasing owner (NULL: free).
+/// @param t Window start time.
+/// @param count Size of the window, passed on to the processing function.
+static inline void winpool_submit(struct winpool *p, const struct iovec *iov, int iovcnt, void *owner,
+                                  winpool_release_fn release, const struct tm *t, uint64_t count)
+{
+    struct winpool_job *job = calloc(1, sizeof(*job));
+    uint64_t seq;
+
+    if (job == NULL || (job->iov = malloc(sizeof(*iov) * (iovcnt > 0 ? iovcnt : 1))) == NULL)
+    {
+        perror("malloc failure");
+        exit(1);
+    }
+
+    memcpy(job->iov, iov, sizeof(*iov) * iovcnt);
+    job->iovcnt  = iovcnt;
+    job->owner   = owner;
+    job->release = release;
+    job->t       = *t;
+    job->count   = count;
+
+    for (int i = 0; i < iovcnt; i++)
+        job->len += iov[i].iov_len;
+
+    pthread_mutex_lock(&p->lock);
+    p->st.submitted++;
+    seq = p->spill_seq++;
+
+    if (p->st.depth >= p->queue_size)
+    {
+        p->st.stalls++;
+
+        if (p->policy == WINPOOL_BLOCK)
+        {
+            winpool_wait(p);
+        }
+        else if (p->policy == WINPOOL_DROP)
+        {
+            struct winpool_job **pp = &p->head, *old, *prev = NULL;
+
+            while ((*pp)->spill != NULL) // oldest window in memory (there is one: depth > 0)
+            {
+                prev = *pp;
+                pp   = &(*pp)->next;
+            }
+
+            old = *pp;
+            *pp = old->next;
+            if (p->tail == old)
+                p->tail = prev;
+
+            p->st.depth--;
+            p->st.dropped++;
+            winpool_release(old);
+            free(old->iov);
+            free(old);
+        }
+        else // spill: write outside the lock, so workers keep draining the queue
+        {
+            pthread_mutex_unlock(&p->lock);
+            int spilled = winpool_spill(p, job, seq);
+            pthread_mutex_lock(&p->lock);
+
+            if (spilled == 0)
+            {
+                p->st.spilled++;
+            }
+            else // still in memory: wait for room rather than grow the queue
+            {
+                p->st.spill_failed++;
+                winpool_wait(p);
+            }
+        }
+    }
+
+    if (job->spill != NULL)
+        p->st.spill_depth++;
+    else if (++p->st.depth > p->st.max_depth)
+        p->st.max_depth = p->st.depth;
+
+    if (p->tail != NULL)
+        p->tail->next = job;
+    else
+        p->head = job;
+    p->tail = job;
+
+    pthread_cond_signal(&p->not_empty);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/// @brief Snapshot of the pool counters.
+static inline struct winpool_stats winpool_get_stats(struct winpool *p)
+{
+    struct winpool_stats st;
+
+    pthread_mutex_lock(&p->lock);
+    st = p->st;
+    pthread_mutex_unlock(&p->lock);
+
+    return st;
+}
+
+/// @brief Print the pool counters on one line.
+static inline void winpool_print_stats(struct winpool *p, FILE *fp)
+{
+    struct winpool_stats st = winpool_get_stats(p);
+
+    fprintf(fp,
+            "windows: %lu submitted, %lu done, %u queued (%u on disk), %u/%u workers busy, max queue %u/%u, "
+            "%lu stalls (%.1fs blocked), %lu dropped, %lu spilled (%lu failed)\n",
+            (unsigned long)st.submitted, (unsigned long)st.completed, st.depth + st.spill_depth, st.spill_depth,
+            st.busy, p->nworkers, st.max_depth, p->queue_size, (unsigned long)st.stalls, st.stall_time,
+            (unsigned long)st.dropped, (unsigned long)st.spilled, (unsigned long)st.spill_failed);
+}
+
+/// @brief Write the pool counters to a file in Prometheus text format (written to a temporary file, then renamed,
+///        as the node_exporter textfile collector expects).
+/// @param p Pool.
+/// @param path Stats file.
+/// @param prefix Metric name prefix.
+static inline void winpool_write_stats(struct winpool *p, const char *path, const char *prefix)
+{
+    struct winpool_stats st = winpool_get_stats(p);
+    char tmp[PATH_MAX + 32];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    if ((fp = fopen(tmp, "w")) == NULL)
+    {
+        perror("open stats file");
+        return;
+    }
+
+    fprintf(fp, "%s_windows_submitted_total %lu\n", prefix, (unsigned long)st.submitted);
+    fprintf(fp, "%s_windows_completed_total %lu\n", prefix, (unsigned long)st.completed);
+    fprintf(fp, "%s_windows_dropped_total %lu\n", prefix, (unsigned long)st.dropped);
+    fprintf(fp, "%s_windows_spilled_total %lu\n", prefix, (unsigned long)st.spilled);
+    fprintf(fp, "%s_windows_spill_failed_total %lu\n", prefix, (unsigned long)st.spill_failed);
+    fprintf(fp, "%s_queue_stalls_total %lu\n", prefix, (unsigned long)st.stalls);
+    fprintf(fp, "%s_queue_stall_seconds_total %.6f\n", prefix, st.stall_time);
+    fprintf(fp, "%s_queue_depth %u\n", prefix, st.depth);
+    fprintf(fp, "%s_queue_spill_depth %u\n", prefix, st.spill_depth);
+    fprintf(fp, "%s_queue_depth_max %u\n", prefix, st.max_depth);
+    fprintf(fp, "%s_queue_size %u\n", prefix, p->queue_size);
+    fprintf(fp, "%s_workers_busy %u\n", prefix, st.busy);
+    fprintf(fp, "%s_workers %u\n", prefix, p->nworkers);
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0)
+    {
+        perror("write stats file");
+        unlink(tmp);
+    }
+}
+
+/// @brief Process every queued window, then stop the workers.
+static inline void winpool_finish(struct winpool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->closed = 1;
+    pthread_cond_broadcast(&p->not_empty);
+    pthread_mutex_unlock(&p->lock);
+
+    for (unsigned i = 0; i < p->nworkers; i++)
+        pthread_join(p->threads[i], NULL);
+
+    free(p->threads);
+    p->threads = NULL;
+}
+
+#endif
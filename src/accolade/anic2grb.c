@@ -23,6 +23,7 @@
 #include <unistd.h>
 
 #include "cryptopANT.h"
+#include "ip4cache.h"
 #include <GraphBLAS.h>
 
 #define WINDOWSIZE  (1 << 23)
@@ -83,7 +84,8 @@ struct _serialized_blob
 static int numrings = 1;
 static char keyfile[PATH_MAX];
 static char cachefile[PATH_MAX];
-const size_t cachesize = sizeof(uint32_t) * (UINT_MAX - 1);
+static char *cachemode = NULL; // --cache-mode
+size_t cachesize       = 0;    // length of the ip4cache mapping
 uint32_t *ip4cache     = NULL;
 
 // If at first you don't succeed, just abort.
@@ -173,17 +175,18 @@ int main(int argc, char **argv)
     while (1)
     {
         static struct option long_options[] = {
-            {"id",      required_argument, 0, 'i'},
-            { "mode",   required_argument, 0, 'm'},
-            { "blocks", required_argument, 0, 'b'},
-            { "quota",  required_argument, 0, 'q'},
-            { "cache",  required_argument, 0, 'c'},
-            { 0,        0,                 0, 0  }
+            {"id",          required_argument, 0, 'i'},
+            { "mode",       required_argument, 0, 'm'},
+            { "blocks",     required_argument, 0, 'b'},
+            { "quota",      required_argument, 0, 'q'},
+            { "cache",      required_argument, 0, 'c'},
+            { "cache-mode", required_argument, 0, 'M'},
+            { 0,            0,                 0, 0  }
         };
         int option_index = 0;
         char c;
 
-        if ((c = getopt_long(argc, argv, "a:c:i:m:b:q:", long_options, &option_index)) == -1)
+        if ((c = getopt_long(argc, argv, "a:c:i:m:M:b:q:", long_options, &option_index)) == -1)
             break;
 
         switch (c)
@@ -192,6 +195,9 @@ int main(int argc, char **argv)
                 snprintf(cachefile, sizeof(cachefile) - 1, "%s", optarg);
                 args.cache = 1;
                 break;
+            case 'M':
+                cachemode = optarg;
+                break;
             case 'i':
                 args.anic_id = atoi(optarg);
                 break;
@@ -215,32 +221,12 @@ int main(int argc, char **argv)
 
     if (args.cache == 1)
     {
-        FILE *fp;
-        size_t filesize = 0, ret = 0;
         struct timespec ts_start;
 
-        fprintf(stderr, "loading anonymization table: %s\n", cachefile);
-        ip4cache = malloc(cachesize);
+        fprintf(stderr, "mapping anonymization table: %s\n", cachefile);
 
         TIC(CLOCK_MONOTONIC, "table load");
-        if ((fp = fopen(cachefile, "rb")) == NULL)
-        {
-            perror("fopen");
-            return 1;
-        }
-
-        fseek(fp, 0L, SEEK_END);
-        filesize = ftell(fp);
-        fseek(fp, 0L, SEEK_SET);
-        fprintf(stderr, "table is %ld bytes\n", filesize);
-
-        if ((ret = fread(ip4cache, filesize, 1, fp)) < 1)
-        {
-            perror("fread");
-            return 1;
-        }
-
-        fclose(fp);
+        ip4cache = ip4cache_map(cachefile, cachemode, &cachesize);
         TOC(CLOCK_MONOTONIC, "table load");
     }
 
@@ -0,0 +1,99 @@
+#!/bin/bash
+#
+# Offline dpdk2grb benchmark, on DPDK virtual devices instead of a NIC (see README.md):
+#
+#  1. net_pcap: replay a pcap file through dpdk2grb (one queue), report its rates, and check that its matrices are
+#     identical to those pcap2grb makes from the same file.
+#  2. net_null: receive generated packets for a fixed time, to measure the RX and extraction path alone.
+#
+# usage: bench_dpdk2grb.sh DPDK2GRB PCAP2GRB PCAP_FILE [SECONDS]
+#
+# EAL_ARGS overrides the EAL options (default: no hugepages, 4 GB); BENCH_DIR keeps the output (default: a
+# temporary directory, removed afterwards).
+
+set -u
+
+if [ $# -lt 3 ]; then
+    echo "usage: $0 DPDK2GRB PCAP2GRB PCAP_FILE [SECONDS]" >&2
+    exit 1
+fi
+
+DPDK2GRB=$1
+PCAP2GRB=$2
+PCAP=$(realpath "$3")
+SECONDS_NULL=${4:-10}
+EAL_ARGS=${EAL_ARGS:---no-huge -m 4096}
+WINDOWSIZE=8388608 # packets per dpdk2grb window
+
+if [ -n "${BENCH_DIR:-}" ]; then
+    OUT=$BENCH_DIR
+    mkdir -p "$OUT"
+else
+    OUT=$(mktemp -d)
+    trap 'rm -rf "$OUT"' EXIT
+fi
+
+rm -rf "$OUT/dpdk" "$OUT/pcap" "$OUT/null"
+mkdir -p "$OUT/dpdk" "$OUT/pcap" "$OUT/null"
+
+# MD5 of every matrix, in output order.  dpdk2grb names windows <time>.<packets>[.<n>].tar, the n-th window
+# after the first to start in the same second; the last, partial window follows the full ones.
+dpdk_matrices()
+{
+    for f in $(ls "$1" | awk -F. -v w=$WINDOWSIZE '/\.tar$/ { print $1, ($2 == w ? 0 : 1), (NF == 4 ? $3 : 0), $0 }' |
+               sort -k1,1 -k2,2n -k3,3n | cut -d' ' -f4); do
+        for m in $(tar -tf "$1/$f"); do
+            tar -xOf "$1/$f" "$m" | md5sum | cut -d' ' -f1
+        done
+    done
+}
+
+# pcap2grb names them <time>-<usec>.<packets>.tar.
+pcap_matrices()
+{
+    for f in $(ls "$1" | grep '\.tar$' | sort -t- -k1,1 -k2,2 -k3,3n); do
+        for m in $(tar -tf "$1/$f"); do
+            tar -xOf "$1/$f" "$m" | md5sum | cut -d' ' -f1
+        done
+    done
+}
+
+report()
+{
+    grep -E "stopped:|^AGG [0-9]+: [0-9]+ windows|^Writer:|^Port [0-9]+:" "$1" | sed 's/^/    /'
+}
+
+status=0
+
+echo "== net_pcap: $PCAP"
+$DPDK2GRB $EAL_ARGS --no-pci --file-prefix dpdk2grb-bench --vdev="net_pcap0,rx_pcap=$PCAP" -l 0-2 -- \
+    -q 1 -I 2 -o "$OUT/dpdk" 2> "$OUT/dpdk.log" || { echo "dpdk2grb failed, see $OUT/dpdk.log"; exit 1; }
+report "$OUT/dpdk.log"
+
+$PCAP2GRB -i "$PCAP" -o "$OUT/pcap" 2> "$OUT/pcap.log" || { echo "pcap2grb failed, see $OUT/pcap.log"; exit 1; }
+
+dpdk_matrices "$OUT/dpdk" > "$OUT/dpdk.md5"
+pcap_matrices "$OUT/pcap" > "$OUT/pcap.md5"
+
+# pcap2grb leaves out the trailing partial subwindow; dpdk2grb writes it.
+n=$(wc -l < "$OUT/pcap.md5")
+if [ ! -s "$OUT/dpdk.md5" ]; then
+    echo "  MISMATCH with pcap2grb: dpdk2grb wrote no matrices (see $OUT)"
+    status=1
+elif head -n "$n" "$OUT/dpdk.md5" | cmp -s - "$OUT/pcap.md5" && [ $(wc -l < "$OUT/dpdk.md5") -le $((n + 1)) ]; then
+    echo "  $n matrices identical to pcap2grb's"
+else
+    echo "  MISMATCH with pcap2grb: $(wc -l < "$OUT/dpdk.md5") matrices against $n (see $OUT)"
+    status=1
+fi
+
+echo "== net_null: ${SECONDS_NULL}s of generated 64 byte packets (not IPv4: RX and extraction only)"
+timeout -s INT $((SECONDS_NULL + 30)) $DPDK2GRB $EAL_ARGS --no-pci --file-prefix dpdk2grb-bench \
+    --vdev="net_null0,size=64" -l 0-2 -- -q 1 -o "$OUT/null" 2> "$OUT/null.log" &
+pid=$!
+sleep "$SECONDS_NULL"
+kill -INT $pid 2> /dev/null
+wait $pid || { echo "dpdk2grb failed, see $OUT/null.log"; status=1; }
+report "$OUT/null.log"
+
+exit $status
@@ -1,14 +1,25 @@
 #include "rte_build_config.h"
 #define _GNU_SOURCE 1
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <rte_eal.h>
 #include <rte_ethdev.h>
+#include <rte_errno.h>
 #include <rte_ether.h>
 #include <rte_lcore.h>
 #include <rte_mbuf.h>
+#include <rte_mbuf_dyn.h>
+#include <rte_mbuf_ptype.h>
+#include <rte_mempool.h>
+#include <rte_pause.h>
+#include <rte_prefetch.h>
 #include <rte_ring.h>
+#include <rte_spinlock.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +31,13 @@
 
 #include <GraphBLAS.h>
 
+#include "tarwriter.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_AVX2_GATHER 1
+#include <immintrin.h>
+#endif
+
 #define RX_RING_SIZE    8192 // Can be retrieved with ethtool -g <ADAPTER>
 #define NUM_MBUFS       ((8192 - 1) * 32)
 #define MBUF_CACHE_SIZE 500
@@ -28,6 +46,12 @@
 #define WINDOWSIZE      (1 << 23)
 #define SUBWINSIZE      (1 << 17)
 #define PKTBUFSIZE      (1 << 17)
+#define EXTRACT_CHUNK   32 // packets classified, then gathered, at a time (their headers stay in L1)
+#define PREFETCH_AHEAD  4  // packets between a header prefetch and its use
+#define ADDR_OFFSET     offsetof(struct rte_ipv4_hdr, src_addr) // followed by dst_addr
+#define MAX_PAUSES      64 // rte_pause() calls per empty poll, at most, while backing off
+#define SLEEP_MS        10 // longest sleep when idle, so -L and -I deadlines are still met
+#define WRITE_REORDER   64 // windows the writer can hold while waiting for an earlier one
 
 // If at first you don't succeed, just abort.
 #ifndef NO_GRAPHBLAS_DEBUG
@@ -46,36 +70,27 @@
 
 const int buffer_size = (sizeof(uint32_t) * WINDOWSIZE) * 2;
 uint32_t *ip4cache    = NULL;
-char *output_path     = "/scratch";
-
-struct rte_ring *ring;
-
-struct posix_tar_header
-{                       /* byte offset */
-    char name[100];     /*   0 */
-    char mode[8];       /* 100 */
-    char uid[8];        /* 108 */
-    char gid[8];        /* 116 */
-    char size[12];      /* 124 */
-    char mtime[12];     /* 136 */
-    char chksum[8];     /* 148 */
-    char typeflag;      /* 156 */
-    char linkname[100]; /* 157 */
-    char magic[6];      /* 257 */
-    char version[2];    /* 263 */
-    char uname[32];     /* 265 */
-    char gname[32];     /* 297 */
-    char devmajor[8];   /* 329 */
-    char devminor[8];   /* 337 */
-    char prefix[155];   /* 345 */
-                        /* 500 */
-    char padding1[12];  /* 512 */
-};
-
-#define TMAGIC   "ustar" /* ustar and a null */
-#define TMAGLEN  6
-#define TVERSION "00" /* 00 and no null */
-#define TVERSLEN 2
+char *output_path     = NULL; // -o: no output (timing only) unless set
+double max_latency    = 0; // -L: seconds before a partial window is flushed, 0 for no limit
+uint16_t capture_port = 0; // -p
+double idle_exit      = 0; // -I: seconds without packets before an RX lcore stops, 0 to run until signaled
+unsigned spin_polls   = 1000; // -A: empty polls before backing off with rte_pause()
+unsigned pause_polls  = 1000; // -A: empty polls backing off before sleeping
+int rx_interrupts     = 0;    // -i: sleep on RX interrupts rather than with usleep()
+int rx_timestamp_offset = -1; // mbuf dynamic field of the RX timestamp, -1 if the port gives none
+uint64_t rx_timestamp_flag;   // ol_flags bit set on mbufs whose RX timestamp is valid
+
+static volatile bool force_quit; // SIGINT, SIGTERM
+
+struct rte_ring *ring;       // RX lcores -> aggregation lcores
+struct rte_ring *write_ring; // aggregation lcores -> writer thread, NULL without -o
+struct rte_mempool *winbuf_pool; // window buffers, on the port's socket
+uint64_t window_seq;         // next window sequence number, in the order the RX lcores queue them
+rte_spinlock_t window_lock = RTE_SPINLOCK_INITIALIZER;
+uint64_t write_next;         // sequence number of the next window to write
+unsigned rx_running;         // RX lcores still capturing: the aggregators stop once none are and the ring is empty
+unsigned agg_running;        // aggregation lcores still running: the writer stops once none are
+uint64_t windows_dropped;    // windows lost on a full ring
 
 struct _serialized_blob
 {
@@ -88,16 +103,60 @@ struct _serialized_blob
 struct graphblas_worker_args
 {
     uint32_t *pktbuf;
-    struct tm *t;
-    size_t windowsize;
+    struct tm t;       // capture time of the first packet
+    size_t windowsize; // packets in pktbuf: WINDOWSIZE, or fewer if flushed by -L
     size_t subwinsize;
+    uint64_t seq;    // output order
+    uint64_t queued; // TSC when the RX lcore queued it
 };
 
+// A window built by an aggregation lcore, waiting to be written.
+struct window_result
+{
+    uint64_t seq;
+    struct tm t;
+    size_t windowsize;
+    int nsubwins;
+    struct _serialized_blob *blob_list;
+    uint64_t queued;
+};
+
+struct agg_stats
+{
+    unsigned id;
+    uint64_t windows;
+    uint64_t packets;
+    uint64_t busy_cycles; // building matrices
+    uint64_t start_cycles;
+    uint64_t latency_cycles; // queued to built, summed
+    uint64_t max_latency_cycles;
+};
+
+// What an RX lcore does between polls: adaptive polling goes from spinning to pausing to sleeping as the empty
+// polls add up, and back to spinning with the first packet.
+enum poll_state
+{
+    POLL_BUSY,  // the last poll returned packets
+    POLL_SPIN,  // poll again at once
+    POLL_PAUSE, // rte_pause() before the next poll, longer each time
+    POLL_SLEEP, // wait for an RX interrupt, or usleep()
+    POLL_STATES
+};
+
+static const char *poll_state_name[POLL_STATES] = { "busy", "spin", "pause", "sleep" };
+
 struct lcore_worker_args
 {
     uint16_t port_id;
     uint16_t queue_id;
     struct rte_mempool *mbuf_pool;
+    uint64_t packets;      // received
+    uint64_t pairs;        // IPv4 packets, kept in windows
+    uint64_t first_cycles; // TSC of the first and last non-empty bursts
+    uint64_t last_cycles;
+    uint64_t buffer_waits; // window buffers not available at once
+    uint64_t poll_cycles[POLL_STATES];
+    uint64_t wakeups; // by an RX interrupt
 };
 
 static const struct rte_eth_conf port_conf_default = {
@@ -109,11 +168,20 @@ static const struct rte_eth_conf port_conf_default = {
         {
                  .rss_conf =
                 {
-                    .rss_key = NULL,
-                    .rss_hf  = RTE_ETH_RSS_TCP,
+                    .rss_key = NULL, // set by port_init
+                    .rss_hf  = RTE_ETH_RSS_IP,
                 }, },
 };
 
+// Symmetric Toeplitz key: a 16 bit period makes the hash of (src, dst) equal to that of (dst, src), so both
+// directions of a conversation land on the same queue.
+static uint8_t rss_key_symmetric[64] = {
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+};
+
 static inline void timespec_diff(struct timespec *a, struct timespec *b, struct timespec *result)
 {
     result->tv_sec  = a->tv_sec - b->tv_sec;
@@ -125,10 +193,170 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b, struct
     }
 }
 
-static void buffer_to_grb(uint32_t *pktbuf, size_t windowsize, size_t subwinsize, struct tm *t)
+// Offset of the IPv4 header in an Ethernet frame, untagged, 802.1Q or QinQ (802.1ad), or 0 if it carries no IPv4.
+static inline uint16_t ipv4_offset_sw(const uint8_t *base, uint16_t len)
 {
+    uint16_t off        = 12;
+    uint16_t ether_type = *(const uint16_t *)(base + off);
+
+    for (int tags = 0; tags < 2 && (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN) ||
+                                    ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_QINQ));
+         tags++)
+    {
+        off += 4;
+        ether_type = *(const uint16_t *)(base + off);
+    }
+
+    off += 2;
+    if (ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) || off + sizeof(struct rte_ipv4_hdr) > len ||
+        (base[off] >> 4) != 4)
+        return 0;
+
+    return off;
+}
+
+// As ipv4_offset_sw(), but with the PMD's packet type when it has one: other protocols are then skipped without
+// touching the packet, and the L2 type gives the header offset (checked, in case a PMD reports tagged frames as
+// plain Ethernet).
+static inline uint16_t ipv4_offset(const struct rte_mbuf *m)
+{
+    const uint8_t *base = rte_pktmbuf_mtod(m, const uint8_t *);
+    uint32_t ptype      = m->packet_type;
+    uint16_t off        = 0;
+
+    if ((ptype & RTE_PTYPE_L3_MASK) != 0)
+    {
+        if (!RTE_ETH_IS_IPV4_HDR(ptype))
+            return 0;
+
+        switch (ptype & RTE_PTYPE_L2_MASK)
+        {
+            case RTE_PTYPE_L2_ETHER:
+                off = 14;
+                break;
+            case RTE_PTYPE_L2_ETHER_VLAN:
+                off = 18;
+                break;
+            case RTE_PTYPE_L2_ETHER_QINQ:
+                off = 22;
+                break;
+        }
+
+        if (off != 0 && *(const uint16_t *)(base + off - 2) == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) &&
+            off + sizeof(struct rte_ipv4_hdr) <= rte_pktmbuf_data_len(m) && (base[off] >> 4) == 4)
+            return off;
+    }
+
+    return ipv4_offset_sw(base, rte_pktmbuf_data_len(m));
+}
+
+// Copy the (source, destination) address pairs, 8 contiguous bytes from offset 12 of each IPv4 header, leaving out
+// global broadcasts (as pcap2grb does).
+static uint32_t gather_pairs_scalar(const uint8_t *const *src, uint32_t n, uint64_t *pairs)
+{
+    uint32_t npairs = 0;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t addrs[2];
+
+        memcpy(addrs, src[i], sizeof(addrs));
+        if (likely(addrs[0] != UINT32_MAX && addrs[1] != UINT32_MAX))
+            memcpy(&pairs[npairs++], addrs, sizeof(addrs));
+    }
+
+    return npairs;
+}
+
+#ifdef HAVE_AVX2_GATHER
+// Four pairs per 64 bit gather, addressed relative to the first header of the chunk.  The (rare) groups with a
+// broadcast address are redone by the scalar kernel.
+__attribute__((target("avx2"))) static uint32_t gather_pairs_avx2(const uint8_t *const *src, uint32_t n,
+                                                                  uint64_t *pairs)
+{
+    const uint8_t *base = src[0];
+    const __m256i vbase = _mm256_set1_epi64x((intptr_t)base);
+    const __m256i bcast = _mm256_set1_epi32(-1);
+    uint32_t npairs     = 0;
+    uint32_t i          = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i offs = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *)&src[i]), vbase);
+        __m256i v    = _mm256_i64gather_epi64((const long long *)base, offs, 1);
+
+        if (likely(_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, bcast)) == 0))
+        {
+            _mm256_storeu_si256((__m256i *)&pairs[npairs], v);
+            npairs += 4;
+        }
+        else
+            npairs += gather_pairs_scalar(src + i, 4, pairs + npairs);
+    }
+
+    return npairs + gather_pairs_scalar(src + i, n - i, pairs + npairs);
+}
+#endif
+
+static uint32_t (*gather_pairs)(const uint8_t *const *, uint32_t, uint64_t *) = gather_pairs_scalar;
+
+/// @brief Extract the IPv4 (source, destination) pairs of a burst, as stored in the window buffers.
+/// @param bufs Received packets (not freed).
+/// @param nb_rx Number of packets.
+/// @param pairs Output, room for nb_rx pairs.
+/// @return Number of IPv4 packets (pairs written).
+static uint32_t extract_burst(struct rte_mbuf **bufs, uint16_t nb_rx, uint64_t *pairs)
+{
+    const uint8_t *src[EXTRACT_CHUNK];
+    uint32_t npairs = 0;
+
+    for (uint16_t i = 0; i < PREFETCH_AHEAD && i < nb_rx; i++)
+        rte_prefetch0(rte_pktmbuf_mtod(bufs[i], void *));
+
+    for (uint16_t chunk = 0; chunk < nb_rx; chunk += EXTRACT_CHUNK)
+    {
+        uint16_t end = RTE_MIN(nb_rx, chunk + EXTRACT_CHUNK);
+        uint32_t n   = 0;
+
+        // Classify, with the headers a few packets ahead (and their mbufs, further ahead) on their way in.
+        for (uint16_t i = chunk; i < end; i++)
+        {
+            uint16_t off;
+
+            if (i + 2 * PREFETCH_AHEAD < nb_rx)
+                rte_prefetch0(bufs[i + 2 * PREFETCH_AHEAD]);
+            if (i + PREFETCH_AHEAD < nb_rx)
+                rte_prefetch0(rte_pktmbuf_mtod(bufs[i + PREFETCH_AHEAD], void *));
+
+            if ((off = ipv4_offset(bufs[i])) != 0)
+                src[n++] = rte_pktmbuf_mtod_offset(bufs[i], const uint8_t *, off + ADDR_OFFSET);
+        }
+
+        if (n != 0)
+            npairs += gather_pairs(src, n, pairs + npairs);
+    }
+
+    return npairs;
+}
+
+// Build and serialize the matrices of one window, on an aggregation lcore.  Frees the packet buffer and args.
+static struct window_result *build_window(struct graphblas_worker_args *args)
+{
+    struct window_result *res = malloc(sizeof(*res));
+    size_t windowsize         = args->windowsize;
+    size_t subwinsize         = args->subwinsize;
+
+    if (res == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot allocate window result\n");
+
+    res->seq        = args->seq;
+    res->t          = args->t;
+    res->windowsize = windowsize;
+    res->nsubwins   = 0;
+    res->blob_list  = NULL;
+    res->queued     = args->queued;
+
 #ifndef NO_GRAPHBLAS_DEBUG
-    char tmp_t[64], f_name[PATH_MAX];
     GrB_Descriptor desc = NULL;
     void *blob          = NULL;
     GrB_Index blob_size = 0;
@@ -140,21 +368,24 @@ static void buffer_to_grb(uint32_t *pktbuf, size_t windowsize, size_t subwinsize
     GrB_Index *C = malloc(sizeof(GrB_Index) * subwinsize);
     uint32_t *V  = malloc(sizeof(uint32_t) * subwinsize);
 
-    struct _serialized_blob *blob_list = malloc(sizeof(struct _serialized_blob) * (windowsize / subwinsize));
-    uint32_t *bufptr                   = pktbuf;
-
-    // With matrices this small (2^17), NTHREADS == 1 yields best performance for serialization.
-    GxB_set(GxB_NTHREADS, 1);
+    int nsubwins                       = (windowsize + subwinsize - 1) / subwinsize; // last one partial if flushed
+    struct _serialized_blob *blob_list = malloc(sizeof(struct _serialized_blob) * nsubwins);
+    uint32_t *bufptr                   = args->pktbuf;
 
     // Configure compression.  ZSTD level 1 is best.
     GrB_Descriptor_new(&desc);
     GxB_Desc_set(desc, GxB_COMPRESSION, GxB_COMPRESSION_ZSTD + 1);
 
-    for (int subblock = 0; subblock < (windowsize / subwinsize); subblock++)
+    for (int subblock = 0; subblock < nsubwins; subblock++)
     {
+        size_t n = windowsize - (size_t)subblock * subwinsize; // packets left
+
+        if (n > subwinsize)
+            n = subwinsize;
+
         LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
 
-        for (i = 0; i < subwinsize; i++)
+        for (i = 0; i < n; i++)
         {
             uint32_t srcip = (ip4cache == NULL ? *bufptr++ : ip4cache[*bufptr++]);
             uint32_t dstip = (ip4cache == NULL ? *bufptr++ : ip4cache[*bufptr++]);
@@ -164,7 +395,7 @@ static void buffer_to_grb(uint32_t *pktbuf, size_t windowsize, size_t subwinsize
             V[i] = 1;
         }
 
-        LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, R, C, V, subwinsize, GrB_PLUS_UINT32));
+        LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, R, C, V, n, GrB_PLUS_UINT32));
         LAGRAPH_TRY_EXIT(GxB_Matrix_serialize(&blob, &blob_size, Gmat, desc));
 
         blob_list[subblock].blob_size = blob_size;
@@ -175,104 +406,143 @@ static void buffer_to_grb(uint32_t *pktbuf, size_t windowsize, size_t subwinsize
     free(R);
     free(C);
     free(V);
+    GrB_free(&desc);
+
+    res->nsubwins  = nsubwins;
+    res->blob_list = blob_list;
+#endif
 
-    strftime(tmp_t, sizeof(tmp_t), "%Y%m%d-%H%M%S", t);
-    snprintf(f_name, sizeof(f_name), "%s/%s.%ld.tar", output_path, tmp_t, windowsize);
+    rte_mempool_put(winbuf_pool, args->pktbuf);
+    free(args);
 
-#ifdef SAVETHEBLOB
-    int fd;
-    if ((fd = open(f_name, O_CREAT | O_WRONLY | O_TRUNC, 0660)) != -1)
+    return res;
+}
+
+static void free_window(struct window_result *res)
+{
+#ifndef NO_GRAPHBLAS_DEBUG
+    for (int i = 0; i < res->nsubwins; i++)
     {
-        size_t offset                     = 0;
-        const unsigned char padblock[512] = { 0 };
+        free(res->blob_list[i].blob_data);
+    }
 
-        for (int i = 0; i < (windowsize / subwinsize); i++)
-        {
-            struct posix_tar_header th = { 0 }; // let's make a tar file, or close enough
+    free(res->blob_list);
+#endif
+    free(res);
+}
 
-            const unsigned char *th_ptr = (const unsigned char *)&th;
-            size_t tmp_chksum           = 0;
-            size_t aligned;
+// Write one window's matrices to a tar file, on the writer thread.  Frees the result.
+static void write_window(struct window_result *res)
+{
+#ifndef NO_GRAPHBLAS_DEBUG
+    char tmp_t[64], f_name[PATH_MAX];
+    struct _serialized_blob *blob_list = res->blob_list;
 
-            sprintf(th.name, "%d.grb", i);
-            sprintf(th.uid, "%06o ", 0);
-            sprintf(th.gid, "%06o ", 0);
-            sprintf(th.size, "%011o", (unsigned int)blob_list[i].blob_size);
-            sprintf(th.mode, "%06o", 0644);
-            sprintf(th.magic, "%s", TMAGIC);
-            sprintf(th.mtime, "%011o", (unsigned int)time(NULL));
-            th.typeflag = '0';
-            memset(th.chksum, ' ', 8); // or checksum computed below will be wrong!
+    strftime(tmp_t, sizeof(tmp_t), "%Y%m%d-%H%M%S", &res->t);
+    snprintf(f_name, sizeof(f_name), "%s/%s.%ld.tar", output_path, tmp_t, res->windowsize);
 
-            for (int b = 0; b < sizeof(struct posix_tar_header); b++)
-                tmp_chksum += th_ptr[b];
+    // Windows shorter than a second (fast links, replays, -L) can share a name: number the later ones.
+    int fd;
+    for (int n = 1; (fd = open(f_name, O_CREAT | O_EXCL | O_WRONLY, 0660)) == -1 && errno == EEXIST; n++)
+        snprintf(f_name, sizeof(f_name), "%s/%s.%ld.%d.tar", output_path, tmp_t, res->windowsize, n);
 
-            sprintf(th.chksum, "%06o ", (unsigned int)tmp_chksum);
+    if (fd != -1)
+    {
+        struct tar_writer tw;
+        char entry_name[32];
 
-            write(fd, &th, sizeof(th));
-            write(fd, blob_list[i].blob_data, blob_list[i].blob_size);
+        close(fd);
 
-            offset += sizeof(th) + blob_list[i].blob_size;
-            aligned = offset % 512; // pad output file to 512 byte alignment
-            if (aligned != 0)
-            {
-                write(fd, padblock, 512 - aligned);
-                offset += 512 - aligned;
-            }
+        // Reopened through the tar writer, which exits on a write error rather than leave a short window behind.
+        tar_writer_init(&tw);
+        tar_writer_open(&tw, f_name);
+        for (int i = 0; i < res->nsubwins; i++)
+        {
+            snprintf(entry_name, sizeof(entry_name), "%d.grb", i);
+            tar_writer_add(&tw, entry_name, blob_list[i].blob_data, blob_list[i].blob_size);
         }
-        close(fd);
+        tar_writer_close(&tw, 1);
     }
     else
         perror("open");
 #endif
 
-    for (int i = 0; i < (windowsize / subwinsize); i++)
-    {
-        free(blob_list[i].blob_data);
-    }
-
-    free(blob_list);
-#endif
-    return;
+    free_window(res);
 }
 
-static void graphblas_worker(void *arg)
+static void usage(char *prog)
 {
-    size_t windowsize = ((struct graphblas_worker_args *)arg)->windowsize;
-    size_t subwinsize = ((struct graphblas_worker_args *)arg)->subwinsize;
-    uint32_t *pktbuf  = ((struct graphblas_worker_args *)arg)->pktbuf;
-    struct tm *t      = ((struct graphblas_worker_args *)arg)->t;
-
-    // pthread_detach(pthread_self());
-
-    time_t dummytime;
-    time(&dummytime);
-    fprintf(stderr, "spawned graphblas_worker thread for full block @ %s", ctime(&dummytime));
-    fflush(stderr);
-    buffer_to_grb(pktbuf, windowsize, subwinsize, t);
-
-    free(pktbuf);
-    free(arg);
-
-    // pthread_exit(NULL);
+    fprintf(stderr, "Usage: %s [EAL options] -- [options]\n\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t-p port    Capture from this port.  Default: 0\n");
+    fprintf(stderr, "\t-q queues  Number of RX (RSS) queues.  Default: one per worker lcore\n");
+    fprintf(stderr, "\t-m map     Queue to lcore map: q:lcore[,q:lcore...].  Default: worker lcores in order\n");
+    fprintf(stderr, "\t-g lcores  Aggregation lcores: lcore[,lcore...].  Default: worker lcores not polling a queue\n");
+    fprintf(stderr, "\t-b iters   Benchmark packet header extraction (cycles/packet) on a synthetic burst, and exit\n");
+    fprintf(stderr, "\t-o dir     Write the matrices to tar files in this directory.  Default: none (timing only)\n");
+    fprintf(stderr, "\t-c cpu     CPU for the -o writer thread.  Default: the process's CPUs no EAL lcore runs on\n");
+    fprintf(stderr, "\t-w bufs    Window buffers (64 MB each).  Default: 2 per queue, 1 per aggregation lcore\n");
+    fprintf(stderr, "\t-A s:p     Empty polls spinning (s), then pausing (p), before sleeping.  Default: 1000:1000\n");
+    fprintf(stderr, "\t-i         Sleep on RX interrupts (if the PMD has them) rather than polling every 10 us\n");
+    fprintf(stderr, "\t-I seconds Stop once no packets have arrived for this long (e.g. at the end of a pcap vdev)\n");
+    fprintf(stderr, "\t-L seconds Flush partial windows once their first packet has waited this long\n");
+
+    exit(1);
 }
 
-static inline int port_init(uint16_t port, struct rte_mempool *mbuf_pool)
+static inline int port_init(uint16_t port, struct rte_mempool *mbuf_pool, uint16_t rx_rings)
 {
     struct rte_eth_conf port_conf = port_conf_default;
-    //const uint16_t rx_rings = rte_lcore_count() - 1, tx_rings = 0; // we'll save one lcore for the aggregation thread?
-    const uint16_t rx_rings = 4, tx_rings = 0; // we'll save one lcore for the aggregation thread?
+    struct rte_eth_dev_info dev_info;
+    const uint16_t tx_rings = 0;
     int retval;
 
-    if (port >= rte_eth_dev_count_avail())
+    if (!rte_eth_dev_is_valid_port(port))
         return -1;
 
+    if ((retval = rte_eth_dev_info_get(port, &dev_info)) != 0)
+        return retval;
+
+    // RSS on the IPv4/IPv6 addresses only, so UDP, ICMP and fragments are spread over the queues like TCP.
+    port_conf.rx_adv_conf.rss_conf.rss_key     = rss_key_symmetric;
+    port_conf.rx_adv_conf.rss_conf.rss_key_len = dev_info.hash_key_size;
+    port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
+    port_conf.intr_conf.rxq = rx_interrupts;
+
+    if (dev_info.hash_key_size > sizeof(rss_key_symmetric))
+    {
+        fprintf(stderr, "Port %u: unsupported RSS key size %u.\n", port, dev_info.hash_key_size);
+        return -EINVAL;
+    }
+
+    // Per-packet capture times name the windows; without them, the time of the RX burst does.
+    if (dev_info.rx_offload_capa & RTE_ETH_RX_OFFLOAD_TIMESTAMP)
+        port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_TIMESTAMP;
+
+    if (port_conf.rx_adv_conf.rss_conf.rss_hf != RTE_ETH_RSS_IP)
+        fprintf(stderr, "WARN: port %u hashes only part of the IP flow types (0x%" PRIx64 ").\n", port,
+                port_conf.rx_adv_conf.rss_conf.rss_hf);
+
     fprintf(stderr, "Initializing port: %u\n", port);
     retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 
     if (retval != 0)
         return retval;
 
+    if (port_conf.rxmode.offloads & RTE_ETH_RX_OFFLOAD_TIMESTAMP)
+    {
+        if (rte_mbuf_dyn_rx_timestamp_register(&rx_timestamp_offset, &rx_timestamp_flag) == 0)
+            fprintf(stderr, "Naming windows after the RX timestamps of their first packets.\n");
+        else
+        {
+            fprintf(stderr, "WARN: no RX timestamp field (%s): naming windows after the RX time.\n",
+                    rte_strerror(rte_errno));
+            rx_timestamp_offset = -1;
+        }
+    }
+    else
+        fprintf(stderr, "No RX timestamps from the PMD: naming windows after the RX time.\n");
+
     fprintf(stderr, "Creating %u RX Queues.\n", rx_rings);
     for (uint16_t q = 0; q < rx_rings; q++)
     {
@@ -282,6 +552,15 @@ static inline int port_init(uint16_t port, struct rte_mempool *mbuf_pool)
             return retval;
     }
 
+    // Only the L2 and L3 packet types are used (to skip other protocols unread): the PMD can leave out the rest.
+    if (rte_eth_dev_get_supported_ptypes(port, RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK, NULL, 0) > 0)
+    {
+        fprintf(stderr, "Classifying packets with the PMD's packet types.\n");
+        rte_eth_dev_set_ptypes(port, RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK, NULL, 0);
+    }
+    else
+        fprintf(stderr, "No packet types from the PMD: classifying packets in software.\n");
+
     fprintf(stderr, "Starting device.\n");
     retval = rte_eth_dev_start(port);
     if (retval < 0)
@@ -293,46 +572,231 @@ static inline int port_init(uint16_t port, struct rte_mempool *mbuf_pool)
     return 0;
 }
 
-static __rte_noreturn void lcore_agg(void)
+// Aggregation lcore: take windows from the ring (multi-consumer, in parallel with the other aggregators), build their
+// matrices and pass them on to the writer.  With no writer (aggregation on the main lcore), write them directly.
+// Returns once the RX lcores have stopped and the ring is empty.
+static int lcore_agg(void *arg)
 {
-    const uint16_t port = 0;
-    void *gb_args_p;
-    struct timespec ts_start, ts_end, tsdiff;
-    uint64_t npkts = 0;
+    struct agg_stats *st = (struct agg_stats *)arg;
+    struct graphblas_worker_args *gb_args_p;
     struct rte_eth_stats rstats;
-    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    const double hz = rte_get_tsc_hz();
 
-    fprintf(stderr, "Spinning up aggregation lcore %u\n", rte_lcore_id());
+    fprintf(stderr, "Spinning up aggregation lcore %u (aggregator %u)\n", rte_lcore_id(), st->id);
 
     while (1)
     {
-        while (rte_ring_dequeue(ring, &gb_args_p) != 0)
+        struct window_result *res;
+        uint64_t start, latency;
+
+        if (rte_ring_mc_dequeue(ring, (void **)&gb_args_p) != 0)
         {
-            ;
+            if (__atomic_load_n(&rx_running, __ATOMIC_ACQUIRE) == 0 && rte_ring_count(ring) == 0)
+                break;
+
+            usleep(100); // a window takes ~2^23 packets to fill: no need to spin
+            continue;
         }
-        rte_eth_stats_get(port, &rstats);
-        npkts += WINDOWSIZE;
-        graphblas_worker(gb_args_p);
-        fprintf(stderr, "AGG: Processed block.  Total Packets: %lu, Dropped: %lu, Queued: %u\n", npkts, rstats.imissed,
-                rte_ring_count(ring));
+
+        start = rte_get_tsc_cycles();
+        st->packets += gb_args_p->windowsize;
+        res = build_window(gb_args_p);
+        st->busy_cycles += rte_get_tsc_cycles() - start;
+        st->windows++;
+
+        latency = rte_get_tsc_cycles() - res->queued;
+        st->latency_cycles += latency;
+        st->max_latency_cycles = RTE_MAX(st->max_latency_cycles, latency);
+
+        rte_eth_stats_get(capture_port, &rstats);
+        fprintf(stderr,
+                "AGG %u: Processed block %lu in %.2f s.  Windows: %lu, Packets: %lu, Busy: %.1f%%, Dropped: %lu, "
+                "Queued: %u/%u\n",
+                st->id, res->seq, latency / hz, st->windows, st->packets,
+                100.0 * st->busy_cycles / (rte_get_tsc_cycles() - st->start_cycles), rstats.imissed,
+                rte_ring_count(ring), rte_ring_get_capacity(ring));
+
+        if (write_ring == NULL)
+        {
+            free_window(res);
+        }
+        else
+        {
+            // Hold a window that is too far ahead of the writer, which still waits on a slow earlier one.
+            while (res->seq >= __atomic_load_n(&write_next, __ATOMIC_ACQUIRE) + WRITE_REORDER)
+                usleep(100);
+            while (rte_ring_mp_enqueue(write_ring, res) != 0)
+                usleep(100);
+        }
+    }
+
+    fprintf(stderr, "AGG %u: %lu windows, %lu packets, busy %.1f%%, queued to built %.2f s mean, %.2f s max\n",
+            st->id, st->windows, st->packets, 100.0 * st->busy_cycles / (rte_get_tsc_cycles() - st->start_cycles),
+            st->windows ? st->latency_cycles / hz / st->windows : 0, st->max_latency_cycles / hz);
+
+    __atomic_sub_fetch(&agg_running, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Writer thread (-o), off the lcores: write the aggregators' windows in the order the RX lcores queued them.
+// Returns once the aggregation lcores have stopped and every window is written.
+static void *writer_thread(void *arg)
+{
+    struct window_result *pending[WRITE_REORDER] = { NULL };
+    const double hz                              = rte_get_tsc_hz();
+    uint64_t latency_cycles                      = 0; // queued to written
+    uint64_t max_latency_cycles                  = 0;
+
+    fprintf(stderr, "Writing windows to %s\n", output_path);
+
+    while (1)
+    {
+        struct window_result *res;
+
+        if (rte_ring_sc_dequeue(write_ring, (void **)&res) != 0)
+        {
+            if (__atomic_load_n(&agg_running, __ATOMIC_ACQUIRE) == 0 && rte_ring_count(write_ring) == 0)
+                break;
+
+            usleep(100);
+            continue;
+        }
+
+        // The aggregators hold back windows WRITE_REORDER or more ahead of write_next: the slot is free.
+        pending[res->seq % WRITE_REORDER] = res;
+
+        while ((res = pending[write_next % WRITE_REORDER]) != NULL)
+        {
+            uint64_t queued = res->queued, latency;
+
+            pending[write_next % WRITE_REORDER] = NULL;
+            write_window(res);
+            __atomic_store_n(&write_next, write_next + 1, __ATOMIC_RELEASE);
+
+            latency = rte_get_tsc_cycles() - queued;
+            latency_cycles += latency;
+            max_latency_cycles = RTE_MAX(max_latency_cycles, latency);
+        }
+    }
+
+    fprintf(stderr, "Writer: %lu windows, latency (queued to written) %.2f s mean, %.2f s max\n", write_next,
+            write_next ? latency_cycles / hz / write_next : 0, max_latency_cycles / hz);
+
+    return NULL;
+}
+
+// Hand a window (full, or partial when flushed by -L or at exit) to the aggregation lcores.
+static void enqueue_window(uint32_t *pktbuf, uint32_t npkts, const struct tm *t)
+{
+    struct graphblas_worker_args *gb_args_p = malloc(sizeof(*gb_args_p));
+    int ret;
+
+    gb_args_p->pktbuf     = pktbuf;
+    gb_args_p->t          = *t;
+    gb_args_p->subwinsize = SUBWINSIZE;
+    gb_args_p->windowsize = npkts;
+    gb_args_p->queued     = rte_get_tsc_cycles();
+
+    // Windows sit in the ring in sequence order, so the aggregators dequeue them in the order they are written.
+    rte_spinlock_lock(&window_lock);
+    gb_args_p->seq = window_seq;
+    if ((ret = rte_ring_mp_enqueue(ring, gb_args_p)) == 0)
+        window_seq++;
+    rte_spinlock_unlock(&window_lock);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "ERR: Failed to enqueue block.\n");
+        __atomic_add_fetch(&windows_dropped, 1, __ATOMIC_RELAXED);
+        rte_mempool_put(winbuf_pool, pktbuf);
+        free(gb_args_p);
+    }
+}
+
+// Next window buffer for an RX lcore.  With all of them queued or being built, wait for the aggregators: the
+// packets that costs are counted by the port (imissed).
+static uint32_t *get_window_buffer(struct lcore_worker_args *args)
+{
+    void *buf;
+
+    if (unlikely(rte_mempool_get(winbuf_pool, &buf) != 0))
+    {
+        args->buffer_waits++;
+        while (rte_mempool_get(winbuf_pool, &buf) != 0)
+            usleep(10);
+    }
+
+    return buf;
+}
+
+// Sleep until the queue has packets, or for SLEEP_MS.  With RX interrupts, the interrupt is only armed for the
+// wait: polling does not take them.
+static void sleep_rx(struct lcore_worker_args *args, int intr)
+{
+    struct rte_epoll_event event;
+
+    if (!intr)
+    {
+        usleep(10);
+        return;
     }
+
+    rte_eth_dev_rx_intr_enable(args->port_id, args->queue_id);
+    if (rte_epoll_wait(RTE_EPOLL_PER_THREAD, &event, 1, SLEEP_MS) > 0)
+        args->wakeups++;
+    rte_eth_dev_rx_intr_disable(args->port_id, args->queue_id);
 }
 
-static __rte_noreturn void lcore_main(void *arg)
+// Capture time of a packet, for the window it starts: its RX timestamp (nanoseconds since the epoch, as net_pcap
+// fills it from the pcap records), or the current time if the port gives none.  A NIC running a free counter rather
+// than a real-time clock gives values long before 2001: those fall back to the current time too.
+static void packet_time(const struct rte_mbuf *m, struct tm *t)
+{
+    struct timespec ts;
+    uint64_t ns = 0;
+
+    if (rx_timestamp_offset >= 0 && (m->ol_flags & rx_timestamp_flag))
+        ns = *RTE_MBUF_DYNFIELD(m, rx_timestamp_offset, rte_mbuf_timestamp_t *);
+
+    if (ns >= 1000000000000000000ULL) // 2001-09-09
+        ts.tv_sec = ns / 1000000000;
+    else
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+    localtime_r(&ts.tv_sec, t);
+}
+
+// RX lcore: fill windows with the address pairs of one queue until signaled, or idle for -I seconds.
+static int lcore_main(void *arg)
 {
     struct lcore_worker_args *args = (struct lcore_worker_args *) arg;
     const uint16_t port = args->port_id;
     uint16_t q          = args->queue_id;
-    uint64_t packets    = 0;
-    struct rte_ether_hdr *eth_hdr;
-    struct rte_ipv4_hdr *ip_hdr;
-    time_t dummytime;
-    struct tm *t;
+    struct tm t;
     uint32_t *pktbuf, *bufptr;
-    uint32_t npkts = 0;
+    uint32_t npkts        = 0;
+    uint64_t flush_cycles = max_latency * rte_get_tsc_hz(); // -L, in TSC cycles
+    uint64_t flush_at     = 0;
+    uint64_t idle_cycles  = idle_exit * rte_get_tsc_hz(); // -I, in TSC cycles
+    uint64_t last_rx      = rte_get_tsc_cycles();
+    const double hz       = rte_get_tsc_hz();
+    enum poll_state state = POLL_BUSY;
+    unsigned empty_polls  = 0;
+    unsigned pauses       = 1;
+    uint64_t polled       = rte_get_tsc_cycles();
+    uint64_t total_cycles = 0;
+    int intr              = rx_interrupts;
+    char states[128];
 
     fprintf(stderr, "Spinning up lcore %u for RSS queue %u\n", rte_lcore_id(), q);
 
+    if (intr && rte_eth_dev_rx_intr_ctl_q(port, q, RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL) != 0)
+    {
+        fprintf(stderr, "WARN: no RX interrupt for queue %u: sleeping with usleep().\n", q);
+        intr = 0;
+    }
+
     /*
     if ((q + 1) > rte_lcore_count())
     {
@@ -345,72 +809,295 @@ static __rte_noreturn void lcore_main(void *arg)
     */
 
 
-    if ((pktbuf = malloc(buffer_size)) == NULL) // WINDOWSIZE ip address pairs
-        rte_exit(EXIT_FAILURE, "Cannot allocate packet buffer\n");
-
+    pktbuf = get_window_buffer(args);
     bufptr = pktbuf;
 
-    while (1)
+    while (!force_quit)
     {
         struct rte_mbuf *bufs[BURST_SIZE];
-        const uint16_t nb_rx = rte_eth_rx_burst(port, q, bufs, BURST_SIZE);
+        uint64_t pairs[BURST_SIZE]; // the burst's address pairs, when it completes the window
+        uint64_t now = rte_get_tsc_cycles();
+        uint16_t nb_rx;
+
+        // Time since the last poll goes to what this lcore did after it.
+        args->poll_cycles[state] += now - polled;
+        polled = now;
+
+        nb_rx = rte_eth_rx_burst(port, q, bufs, BURST_SIZE);
+
+        // A quiet link must not hold a partial window longer than -L.
+        if (unlikely(flush_cycles != 0 && npkts != 0 && rte_get_tsc_cycles() >= flush_at))
+        {
+            enqueue_window(pktbuf, npkts, &t);
+
+            pktbuf = get_window_buffer(args);
+            bufptr = pktbuf;
+            fprintf(stderr, "[lcore %u] Flushed %u packets.\n", q, npkts);
+            npkts = 0;
+        }
 
         if (unlikely(nb_rx == 0))
         {
-            usleep(10);
+            if (idle_cycles != 0 && rte_get_tsc_cycles() - last_rx >= idle_cycles)
+                break;
+
+            empty_polls++;
+            if (empty_polls <= spin_polls)
+            {
+                state = POLL_SPIN;
+            }
+            else if (empty_polls <= spin_polls + pause_polls)
+            {
+                state = POLL_PAUSE;
+                for (unsigned i = 0; i < pauses; i++)
+                    rte_pause();
+                pauses = RTE_MIN(2 * pauses, MAX_PAUSES);
+            }
+            else
+            {
+                state = POLL_SLEEP;
+                sleep_rx(args, intr);
+            }
             continue;
         }
 
+        state       = POLL_BUSY;
+        empty_polls = 0;
+        pauses      = 1;
+
+        last_rx = rte_get_tsc_cycles();
+        if (unlikely(args->packets == 0))
+            args->first_cycles = last_rx;
+        args->last_cycles = last_rx;
+        args->packets += nb_rx;
+
+        // The window is named after the capture time of its first packet.
         if (unlikely(npkts == 0))
         {
-            time(&dummytime);
-            t = localtime(&dummytime);
+            packet_time(bufs[0], &t);
+            flush_at = rte_get_tsc_cycles() + flush_cycles;
         }
 
-        /* Process packets */
-        for (uint16_t i = 0; i < nb_rx; i++)
+        // Extract straight into the window, or through pairs[] when the burst completes it.
+        if (likely(WINDOWSIZE - npkts >= nb_rx))
         {
-            eth_hdr = rte_pktmbuf_mtod(bufs[i], struct rte_ether_hdr *);
-            if (likely(eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)))
-            {
-                ip_hdr    = rte_pktmbuf_mtod_offset(bufs[i], struct rte_ipv4_hdr *, sizeof(struct rte_ether_hdr));
-                *bufptr++ = ip_hdr->src_addr;
-                *bufptr++ = ip_hdr->dst_addr;
-                npkts++;
+            uint32_t n = extract_burst(bufs, nb_rx, (uint64_t *)bufptr);
 
-                if (npkts == WINDOWSIZE)
-                {
-                    struct graphblas_worker_args *gb_args_p = malloc(sizeof(*gb_args_p));
+            bufptr += 2 * n;
+            npkts += n;
+            args->pairs += n;
+        }
+        else
+        {
+            uint32_t n    = extract_burst(bufs, nb_rx, pairs);
+            uint32_t done = 0;
 
-                    gb_args_p->pktbuf     = pktbuf;
-                    gb_args_p->t          = t;
-                    gb_args_p->subwinsize = SUBWINSIZE;
-                    gb_args_p->windowsize = WINDOWSIZE;
+            args->pairs += n;
 
-                    if (rte_ring_enqueue(ring, gb_args_p) != 0)
-                    {
-                        fprintf(stderr, "ERR: Failed to enqueue block.\n");
-                    }
+            while (done < n)
+            {
+                uint32_t len = RTE_MIN(n - done, WINDOWSIZE - npkts);
 
-                    if ((pktbuf = malloc(buffer_size)) == NULL) // WINDOWSIZE ip address pairs
-                        rte_exit(EXIT_FAILURE, "Cannot allocate packet buffer\n");
+                memcpy(bufptr, &pairs[done], len * sizeof(uint64_t));
+                bufptr += 2 * len;
+                npkts += len;
+                done += len;
 
+                if (npkts == WINDOWSIZE)
+                {
+                    enqueue_window(pktbuf, npkts, &t);
+
+                    pktbuf = get_window_buffer(args);
                     bufptr = pktbuf;
                     fprintf(stderr, "[lcore %u] Got %u packets.\n", q, npkts);
                     npkts = 0;
+
+                    // The rest of the burst starts the next window (a burst spans microseconds: its last packet
+                    // stands in for the first of the rest).
+                    packet_time(bufs[nb_rx - 1], &t);
+                    flush_at = rte_get_tsc_cycles() + flush_cycles;
                 }
             }
-            rte_pktmbuf_free(bufs[i]);
         }
+
+        rte_pktmbuf_free_bulk(bufs, nb_rx);
+    }
+
+    // Nothing is left behind: the last, partial window goes out too.
+    if (npkts != 0)
+        enqueue_window(pktbuf, npkts, &t);
+    else
+        rte_mempool_put(winbuf_pool, pktbuf);
+
+    fprintf(stderr, "[lcore %u] Queue %u stopped: %lu packets (%lu IPv4) in %.2f s, %.0f pps, %lu buffer waits\n",
+            rte_lcore_id(), q, args->packets, args->pairs, (args->last_cycles - args->first_cycles) / hz,
+            args->last_cycles > args->first_cycles ? args->packets * hz / (args->last_cycles - args->first_cycles) : 0,
+            args->buffer_waits);
+
+    for (int i = 0; i < POLL_STATES; i++)
+        total_cycles += args->poll_cycles[i];
+    for (int i = 0, len = 0; i < POLL_STATES; i++)
+        len += snprintf(states + len, sizeof(states) - len, "%s%s %.1f%%", i ? ", " : "", poll_state_name[i],
+                        100.0 * args->poll_cycles[i] / total_cycles);
+    fprintf(stderr, "[lcore %u] Polling: %s (%lu RX interrupts)\n", rte_lcore_id(), states, args->wakeups);
+
+    __atomic_sub_fetch(&rx_running, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// -b: time extract_burst() on a synthetic BURST_SIZE burst (IPv4, with some 802.1Q, QinQ and IPv6 frames), with
+// and without packet types, for each gather kernel.  It needs no port: dpdk2grb --no-pci -l 0 -- -b 10000
+static void bench_extract(unsigned iterations)
+{
+    struct rte_mempool *pool;
+    struct rte_mbuf *bufs[BURST_SIZE];
+    uint64_t *pairs = malloc(sizeof(uint64_t) * BURST_SIZE);
+    uint64_t *ref   = malloc(sizeof(uint64_t) * BURST_SIZE);
+    uint32_t nref   = 0;
+
+    struct
+    {
+        const char *name;
+        uint32_t (*fn)(const uint8_t *const *, uint32_t, uint64_t *);
+    } kernels[] = {
+        {"scalar", gather_pairs_scalar},
+#ifdef HAVE_AVX2_GATHER
+        {"avx2",   gather_pairs_avx2  },
+#endif
+    };
+
+    pool = rte_pktmbuf_pool_create("BENCH_POOL", BURST_SIZE, 0, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+    if (pool == NULL || pairs == NULL || ref == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot allocate benchmark packets\n");
+
+    for (uint32_t i = 0; i < BURST_SIZE; i++)
+    {
+        uint8_t *frame;
+        uint16_t off = 12;
+
+        if ((bufs[i] = rte_pktmbuf_alloc(pool)) == NULL || (frame = (uint8_t *)rte_pktmbuf_append(bufs[i], 64)) == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot allocate benchmark packets\n");
+
+        memset(frame, 0, 64);
+        if (i % 8 == 6) // QinQ
+        {
+            *(uint16_t *)(frame + off) = rte_cpu_to_be_16(RTE_ETHER_TYPE_QINQ);
+            off += 4;
+        }
+        if (i % 8 == 5 || i % 8 == 6) // 802.1Q
+        {
+            *(uint16_t *)(frame + off) = rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN);
+            off += 4;
+        }
+        *(uint16_t *)(frame + off) = rte_cpu_to_be_16(i % 8 == 7 ? RTE_ETHER_TYPE_IPV6 : RTE_ETHER_TYPE_IPV4);
+
+        if (i % 8 != 7)
+        {
+            struct rte_ipv4_hdr *ip_hdr = (struct rte_ipv4_hdr *)(frame + off + 2);
+
+            ip_hdr->version_ihl = RTE_IPV4_VHL_DEF;
+            ip_hdr->src_addr    = rte_cpu_to_be_32(RTE_IPV4(10, 0, 0, 0) + i);
+            ip_hdr->dst_addr    = rte_cpu_to_be_32(RTE_IPV4(192, 168, 0, 0) + i);
+            ref[nref++]         = (uint64_t)ip_hdr->dst_addr << 32 | ip_hdr->src_addr;
+        }
+    }
+
+    printf("%u packets per burst, %u of them IPv4, %u iterations\n", BURST_SIZE, nref, iterations);
+
+    for (int ptypes = 0; ptypes < 2; ptypes++)
+    {
+        for (uint32_t i = 0; i < BURST_SIZE; i++)
+        {
+            static const uint32_t l2[8] = {RTE_PTYPE_L2_ETHER, RTE_PTYPE_L2_ETHER,      RTE_PTYPE_L2_ETHER,
+                                           RTE_PTYPE_L2_ETHER, RTE_PTYPE_L2_ETHER,      RTE_PTYPE_L2_ETHER_VLAN,
+                                           RTE_PTYPE_L2_ETHER_QINQ, RTE_PTYPE_L2_ETHER};
+
+            bufs[i]->packet_type = !ptypes ? RTE_PTYPE_UNKNOWN
+                                           : l2[i % 8] | (i % 8 == 7 ? RTE_PTYPE_L3_IPV6 : RTE_PTYPE_L3_IPV4);
+        }
+
+        for (unsigned k = 0; k < RTE_DIM(kernels); k++)
+        {
+            uint64_t start;
+            uint32_t n;
+
+            gather_pairs = kernels[k].fn;
+            n            = extract_burst(bufs, BURST_SIZE, pairs);
+
+            if (n != nref || memcmp(pairs, ref, n * sizeof(uint64_t)) != 0)
+                rte_exit(EXIT_FAILURE, "%s kernel: wrong address pairs\n", kernels[k].name);
+
+            start = rte_get_tsc_cycles();
+            for (unsigned it = 0; it < iterations; it++)
+                extract_burst(bufs, BURST_SIZE, pairs);
+
+            printf("%-6s gather, %-8s packet types: %6.2f cycles/packet\n", kernels[k].name,
+                   ptypes ? "with" : "without",
+                   (double)(rte_get_tsc_cycles() - start) / ((double)iterations * BURST_SIZE));
+        }
+    }
+
+    rte_pktmbuf_free_bulk(bufs, BURST_SIZE);
+    rte_mempool_free(pool);
+    free(pairs);
+    free(ref);
+}
+
+static void signal_handler(int signum)
+{
+    if (signum == SIGINT || signum == SIGTERM)
+    {
+        fprintf(stderr, "Signal %d received, stopping capture.\n", signum);
+        force_quit = true;
+    }
+}
+
+// Parse "queue:lcore[,queue:lcore...]" into queue_lcore[].
+static void parse_queue_map(const char *map, uint16_t nb_queues, unsigned *queue_lcore)
+{
+    const char *p = map;
+
+    while (*p != '\0')
+    {
+        unsigned queue, lcore;
+        int len;
+
+        if (sscanf(p, "%u:%u%n", &queue, &lcore, &len) != 2 || queue >= nb_queues || lcore >= RTE_MAX_LCORE)
+            rte_exit(EXIT_FAILURE, "Invalid queue map entry: %s\n", p);
+
+        queue_lcore[queue] = lcore;
+        p += len;
+        if (*p == ',')
+            p++;
     }
 }
 
 int main(int argc, char *argv[], char *envp[])
 {
     struct rte_mempool *mbuf_pool;
-    uint16_t portid, lcoreid;
-    int ret;
+    struct rte_eth_dev_info dev_info;
+    struct rte_eth_stats rstats;
+    uint16_t lcoreid;
+    int ret, opt;
     struct lcore_worker_args lcore_args[RTE_MAX_LCORE] = {0};
+    unsigned queue_lcore[RTE_MAX_LCORE];        // lcore polling each queue
+    uint8_t lcore_used[RTE_MAX_LCORE] = { 0 };
+    uint16_t nb_queues                = 0;    // -q
+    char *queue_map                   = NULL; // -m
+    char *agg_list                    = NULL; // -g
+    unsigned agg_lcore[RTE_MAX_LCORE];         // aggregation lcores
+    struct agg_stats agg[RTE_MAX_LCORE] = { 0 };
+    unsigned nb_aggs                    = 0;
+    unsigned nb_mbufs;
+    unsigned bench_iterations = 0; // -b
+    unsigned nb_winbufs       = 0; // -w
+    int writer_cpu            = -1; // -c
+    cpu_set_t writer_cpus;          // CPUs the process may run on, before the EAL pins the main thread
+    pthread_t writer;
+
+    if (sched_getaffinity(0, sizeof(writer_cpus), &writer_cpus) != 0)
+        CPU_ZERO(&writer_cpus);
 
     ret = rte_eal_init(argc, argv);
 
@@ -419,41 +1106,284 @@ int main(int argc, char *argv[], char *envp[])
 
     fprintf(stderr, "EAL initialized.\n");
 
-    mbuf_pool =
-        rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS, MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+#ifdef HAVE_AVX2_GATHER
+    if (__builtin_cpu_supports("avx2"))
+        gather_pairs = gather_pairs_avx2;
+#endif
+
+    // Application options follow the EAL ones (after "--").
+    argc -= ret;
+    argv += ret;
+
+    while ((opt = getopt(argc, argv, "b:c:g:im:o:p:q:w:A:I:L:")) != EOF)
+    {
+        switch (opt)
+        {
+            case 'b':
+                bench_iterations = atoi(optarg);
+                break;
+            case 'c':
+                writer_cpu = atoi(optarg);
+                break;
+            case 'g':
+                agg_list = optarg;
+                break;
+            case 'i':
+                rx_interrupts = 1;
+                break;
+            case 'm':
+                queue_map = optarg;
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'p':
+                capture_port = atoi(optarg);
+                break;
+            case 'q':
+                nb_queues = atoi(optarg);
+                break;
+            case 'w':
+                nb_winbufs = atoi(optarg);
+                break;
+            case 'A':
+                if (sscanf(optarg, "%u:%u", &spin_polls, &pause_polls) != 2)
+                    usage(argv[0]);
+                break;
+            case 'I':
+                idle_exit = atof(optarg);
+                break;
+            case 'L':
+                max_latency = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (bench_iterations != 0)
+    {
+        bench_extract(bench_iterations);
+        rte_eal_cleanup();
+        return 0;
+    }
+
+    if (!rte_eth_dev_is_valid_port(capture_port) || rte_eth_dev_info_get(capture_port, &dev_info) != 0)
+        rte_exit(EXIT_FAILURE, "Invalid port %u\n", capture_port);
+
+    // One RX queue per worker lcore by default; the main lcore aggregates.
+    if (nb_queues == 0)
+        nb_queues = RTE_MIN(rte_lcore_count() - 1, dev_info.max_rx_queues);
+    if (nb_queues == 0 || nb_queues > dev_info.max_rx_queues || nb_queues > RTE_MAX_LCORE)
+        rte_exit(EXIT_FAILURE, "Invalid number of queues %u (port %u: at most %u, with a worker lcore each)\n",
+                 nb_queues, capture_port, dev_info.max_rx_queues);
+
+    for (uint16_t q = 0; q < nb_queues; q++)
+        queue_lcore[q] = RTE_MAX_LCORE;
+
+    if (queue_map != NULL)
+    {
+        parse_queue_map(queue_map, nb_queues, queue_lcore);
+    }
+    else
+    {
+        uint16_t q = 0;
+
+        RTE_LCORE_FOREACH_WORKER(lcoreid)
+        {
+            if (q >= nb_queues)
+                break;
+
+            queue_lcore[q++] = lcoreid;
+        }
+    }
+
+    // Every queue needs its own enabled worker lcore.
+    for (uint16_t q = 0; q < nb_queues; q++)
+    {
+        unsigned lcore = queue_lcore[q];
+
+        if (lcore >= RTE_MAX_LCORE)
+            rte_exit(EXIT_FAILURE, "No lcore for queue %u: add lcores (-l) or map it (-m)\n", q);
+        if (!rte_lcore_is_enabled(lcore) || lcore == rte_get_main_lcore())
+            rte_exit(EXIT_FAILURE, "Queue %u: lcore %u is not an enabled worker lcore\n", q, lcore);
+        if (lcore_used[lcore]++)
+            rte_exit(EXIT_FAILURE, "Queue %u: lcore %u already polls another queue\n", q, lcore);
+        if (rte_lcore_to_socket_id(lcore) != rte_eth_dev_socket_id(capture_port))
+            fprintf(stderr, "WARN: queue %u is polled from lcore %u, on another socket than port %u.\n", q, lcore,
+                    capture_port);
+    }
+
+    // Aggregation lcores: those listed, or by default every worker lcore not polling a queue.
+    if (agg_list != NULL)
+    {
+        const char *p = agg_list;
+
+        while (*p != '\0')
+        {
+            unsigned lcore;
+            int len;
+
+            if (sscanf(p, "%u%n", &lcore, &len) != 1 || lcore >= RTE_MAX_LCORE)
+                rte_exit(EXIT_FAILURE, "Invalid aggregation lcore list: %s\n", agg_list);
+            if (!rte_lcore_is_enabled(lcore) || lcore == rte_get_main_lcore())
+                rte_exit(EXIT_FAILURE, "Aggregation lcore %u is not an enabled worker lcore\n", lcore);
+            if (lcore_used[lcore]++)
+                rte_exit(EXIT_FAILURE, "Aggregation lcore %u is already in use\n", lcore);
+
+            agg_lcore[nb_aggs++] = lcore;
+            p += len;
+            if (*p == ',')
+                p++;
+        }
+    }
+    else
+    {
+        RTE_LCORE_FOREACH_WORKER(lcoreid)
+        {
+            if (!lcore_used[lcoreid])
+            {
+                lcore_used[lcoreid]++;
+                agg_lcore[nb_aggs++] = lcoreid;
+            }
+        }
+    }
+
+    // Enough mbufs to fill every RX ring and have a full burst out on each lcore.
+    nb_mbufs = RTE_MAX(NUM_MBUFS, nb_queues * (RX_RING_SIZE + BURST_SIZE + MBUF_CACHE_SIZE));
+
+    mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", nb_mbufs, MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
+                                        rte_eth_dev_socket_id(capture_port));
 
-    fprintf(stderr, "MBUF pool created. (%.2f MB)\n", (mbuf_pool->size * mbuf_pool->elt_size) / (1024.0 * 1024.0) );
     if (mbuf_pool == NULL)
         rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
+    fprintf(stderr, "MBUF pool created. (%.2f MB)\n", (mbuf_pool->size * mbuf_pool->elt_size) / (1024.0 * 1024.0) );
 
-    if (port_init(0, mbuf_pool) != 0)
-        rte_exit(EXIT_FAILURE, "Cannot init port %" PRIu16 "\n", portid);
+    if (port_init(capture_port, mbuf_pool, nb_queues) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot init port %" PRIu16 "\n", capture_port);
 
     fprintf(stderr, "Port initialized.\n");
 
 #ifndef NO_GRAPHBLAS_DEBUG // msj
     GrB_init(GrB_NONBLOCKING);
+
+    // With matrices this small (2^17), NTHREADS == 1 yields best performance for serialization.  The aggregation
+    // lcores build windows in parallel instead.
+    GxB_set(GxB_NTHREADS, 1);
 #endif
 
     ring = rte_ring_create("RING", 1024, rte_socket_id(), 0);
     if (ring == NULL)
         rte_exit(EXIT_FAILURE, "Cannot create ring.\n");
 
-    uint16_t queue_id = 0;
-    uint16_t num_cores = 4;
-    RTE_LCORE_FOREACH_WORKER(lcoreid)
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    rx_running  = nb_queues;
+    agg_running = RTE_MAX(nb_aggs, 1U); // or the main lcore aggregates
+
+    // Window buffers live on the port's node, with the RX lcores filling them: one filling and one queued per queue,
+    // and one being built per aggregator, by default.  They are only read by the CPU: no need for contiguous IOVA.
+    if (nb_winbufs == 0)
+        nb_winbufs = 2 * nb_queues + RTE_MAX(nb_aggs, 1U);
+
+    winbuf_pool = rte_mempool_create("WINBUF_POOL", nb_winbufs, buffer_size, 0, 0, NULL, NULL, NULL, NULL,
+                                     rte_eth_dev_socket_id(capture_port), RTE_MEMPOOL_F_NO_IOVA_CONTIG);
+    if (winbuf_pool == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot create window buffer pool (%u x %d MB): %s\n", nb_winbufs,
+                 buffer_size >> 20, rte_strerror(rte_errno));
+    fprintf(stderr, "Window buffer pool created. (%u x %d MB)\n", nb_winbufs, buffer_size >> 20);
+
+    // The windows are written in order by a thread of their own, so the lcores never wait on the disk.
+    if (output_path != NULL)
+    {
+        write_ring = rte_ring_create("WRITE_RING", 1024, rte_socket_id(), RING_F_SC_DEQ);
+        if (write_ring == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create write ring.\n");
+
+        // A thread started here inherits the main lcore's affinity: move it off the lcores, so writes never take
+        // CPU time from the aggregation on the main lcore.
+        if (writer_cpu >= 0)
+        {
+            if (writer_cpu >= CPU_SETSIZE)
+                rte_exit(EXIT_FAILURE, "Invalid writer CPU %d\n", writer_cpu);
+            CPU_ZERO(&writer_cpus);
+            CPU_SET(writer_cpu, &writer_cpus);
+        }
+        else
+        {
+            RTE_LCORE_FOREACH(lcoreid)
+            {
+                rte_cpuset_t lcore_cpus = rte_lcore_cpuset(lcoreid);
+
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                {
+                    if (CPU_ISSET(cpu, &lcore_cpus))
+                        CPU_CLR(cpu, &writer_cpus);
+                }
+            }
+        }
+
+        if (CPU_COUNT(&writer_cpus) > 0)
+        {
+            pthread_attr_t attr;
+
+            pthread_attr_init(&attr);
+            pthread_attr_setaffinity_np(&attr, sizeof(writer_cpus), &writer_cpus);
+            if ((ret = pthread_create(&writer, &attr, writer_thread, NULL)) != 0)
+                rte_exit(EXIT_FAILURE, "Cannot start writer thread: %s\n", strerror(ret));
+            pthread_attr_destroy(&attr);
+
+            if (writer_cpu >= 0)
+                fprintf(stderr, "Writer thread on CPU %d.\n", writer_cpu);
+            else
+                fprintf(stderr, "Writer thread on %d CPU(s) no lcore runs on.\n", CPU_COUNT(&writer_cpus));
+        }
+        else
+        {
+            fprintf(stderr, "WARN: every CPU runs an EAL lcore: the writer thread shares the main lcore's (see -c).\n");
+            if (pthread_create(&writer, NULL, writer_thread, NULL) != 0)
+                rte_exit(EXIT_FAILURE, "Cannot start writer thread.\n");
+        }
+    }
+
+    for (uint16_t q = 0; q < nb_queues; q++)
     {
-        if( queue_id >= num_cores )
-            break;
+        unsigned lcore = queue_lcore[q];
+
+        lcore_args[lcore].port_id   = capture_port;
+        lcore_args[lcore].queue_id  = q;
+        lcore_args[lcore].mbuf_pool = mbuf_pool;
+        rte_eal_remote_launch(lcore_main, &lcore_args[lcore], lcore);
+    }
 
-        lcore_args[lcoreid].port_id = 0;
-        lcore_args[lcoreid].queue_id = queue_id;
-        rte_eal_remote_launch((lcore_function_t *)lcore_main, &lcore_args[queue_id], queue_id);
-        queue_id++;
+    for (unsigned a = 0; a < nb_aggs; a++)
+    {
+        agg[a].id           = a;
+        agg[a].start_cycles = rte_get_tsc_cycles();
+        rte_eal_remote_launch(lcore_agg, &agg[a], agg_lcore[a]);
     }
 
-    fprintf(stderr, "Starting aggregation lcore.\n");
-    lcore_agg();
+    if (nb_aggs == 0)
+    {
+        fprintf(stderr, "Starting aggregation on the main lcore.\n");
+        agg[0].start_cycles = rte_get_tsc_cycles();
+        lcore_agg(&agg[0]);
+    }
+
+    rte_eal_mp_wait_lcore();
+
+    if (write_ring != NULL)
+        pthread_join(writer, NULL);
+
+    rte_eth_stats_get(capture_port, &rstats);
+    fprintf(stderr, "Port %u: %lu packets, %lu missed, %lu without mbufs.  Windows: %lu built, %lu dropped\n",
+            capture_port, rstats.ipackets, rstats.imissed, rstats.rx_nombuf, window_seq, windows_dropped);
+
+    rte_eth_dev_stop(capture_port);
+    rte_eth_dev_close(capture_port);
+    rte_mempool_free(winbuf_pool);
+    rte_eal_cleanup();
 
     return 0;
 }
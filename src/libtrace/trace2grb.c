@@ -1,30 +1,75 @@
+#include "chunkpool.h"
 #include "common.h"
+#include "ip4cache.h"
+#include "ip4memo.h"
 #include "libtrace_parallel.h"
+#include "winpool.h"
 
-#define DEFAULT_OUTPUT_PATH "/scratch"
+#include <stdatomic.h>
 
-uint32_t *ip4cache           = NULL;
-const size_t cachesize       = sizeof(uint32_t) * (UINT_MAX - 1);
-const int packet_buffer_size = (sizeof(uint32_t) * WINDOWSIZE) * 2;
-const int thread_buffer_size = (sizeof(uint32_t) * PKTBUFSIZE) * 2;
-char *output_path            = NULL;
+#define DEFAULT_OUTPUT_PATH "/scratch"
+#define DEFAULT_WORKERS     4 // -g
+#define DEFAULT_QUEUE_DEPTH 2 // -Q
+#define WINDOW_SUBWINS      (WINDOWSIZE / SUBWINSIZE)
+#define SUBWIN_BUFSIZE      (1 << 20) // pooled buffer holding one serialized subwindow, after its header
+#define SUBWIN_HDRSIZE      128       // room for struct subwindow at the start of the buffer
+
+uint32_t *ip4cache             = NULL;
+size_t cachesize               = 0; // length of the ip4cache mapping
+struct ip4memo *ip4memo        = NULL; // CryptopANT (-a) results, shared by the processing threads
+char *output_path              = NULL;
+char *statsfile                = NULL; // -S
+struct winpool pool;                   // full windows waiting for, or being written by, a worker
+GrB_Descriptor desc            = NULL; // serialization settings, shared by the processing threads
+uint32_t subwin_credits        = 0;    // -C: subwindow buffers per processing thread
+double max_latency             = 0;    // -L: seconds a packet may wait for its window to be written, 0 for no limit
+struct chunkpool **chunkpools  = NULL; // subwindow buffers of each processing thread, indexed by perpkt thread id
+int nchunkpools                = 0;
+_Atomic uint64_t oversized     = 0; // serialized subwindows too large for a pooled buffer, left on the heap
 
 volatile int done    = 0;
 libtrace_t *inptrace = NULL;
 
+/* One processing thread's serialized subwindow matrix, at the start of a buffer from that thread's pool.  The blob
+   follows the header in the same buffer, unless it did not fit (heap). */
+struct subwindow
+{
+    void *blob;
+    GrB_Index blob_size;
+    void *heap; // blob as allocated by GraphBLAS, if too large for the buffer
+    int id;     // perpkt thread id: the pool the buffer goes back to
+    uint64_t npkts;
+    struct timeval first;    // timestamp of the first packet
+    struct timespec started; // when the first packet was captured (CLOCK_MONOTONIC)
+};
+_Static_assert(sizeof(struct subwindow) <= SUBWIN_HDRSIZE, "struct subwindow does not fit SUBWIN_HDRSIZE");
+
+/* A window: the processing threads' subwindows, in arrival order, by reference */
+struct window
+{
+    struct iovec iov[WINDOW_SUBWINS];
+    struct subwindow *sub[WINDOW_SUBWINS];
+    int nsubwins;
+    uint64_t npkts;
+    struct timeval first; // earliest packet: names the output file
+    struct timespec started;
+};
+
 /* Thread local storage for the reporting thread */
 struct reporting_args
 {
-    uint32_t *pktbuf, *bufptr;
-    int inbuffer;
-    struct tm *t;
+    struct window *win;
 };
 
 /* Thread local storage for each processing thread */
 struct packet_args
 {
-    uint32_t *pktbuf, *bufptr;
+    GrB_Index *R, *C; // addresses of the subwindow being captured
+    uint32_t *V;
     int inbuffer;
+    int id;
+    struct timeval first;
+    struct timespec started;
 };
 
 static void cleanup_signal(int sig)
@@ -35,204 +80,214 @@ static void cleanup_signal(int sig)
         trace_pstop(inptrace);
 }
 
-static void buffer_to_grb(uint32_t *pktbuf, size_t windowsize, size_t subwinsize, struct tm *t)
+/// @brief Seconds elapsed since a CLOCK_MONOTONIC time.
+static inline double seconds_since(const struct timespec *since)
 {
-#ifndef NO_GRAPHBLAS_DEBUG
-    char tmp_t[64], f_name[PATH_MAX];
-    GrB_Descriptor desc = NULL;
-    void *blob          = NULL;
-    GrB_Index blob_size = 0;
-    GrB_Matrix Gmat;
-    int i = 0;
+    struct timespec now;
 
-    // Row, Col, Val vectors.
-    GrB_Index *R = malloc(sizeof(GrB_Index) * subwinsize);
-    GrB_Index *C = malloc(sizeof(GrB_Index) * subwinsize);
-    uint32_t *V  = malloc(sizeof(uint32_t) * subwinsize);
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    struct _serialized_blob *blob_list = malloc(sizeof(struct _serialized_blob) * (windowsize / subwinsize));
-    uint32_t *bufptr                   = pktbuf;
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
 
-    // With matrices this small (2^17), NTHREADS == 1 yields best performance for serialization.
-    GxB_set(GxB_NTHREADS, 1);
+/// @brief Anonymize one address with the -c table or CryptopANT (-a), if either is configured.
+static inline uint32_t anonymize(uint32_t addr)
+{
+    if (ip4cache != NULL)
+        return ip4cache[addr];
 
-    // Configure compression.  ZSTD level 1 is best.
-    GrB_Descriptor_new(&desc);
-    GxB_Desc_set(desc, GxB_COMPRESSION, GxB_COMPRESSION_ZSTD + 1);
+    if (ip4memo != NULL)
+        return ip4memo_get(ip4memo, addr);
 
-    for (int subblock = 0; subblock < (windowsize / subwinsize); subblock++)
-    {
-        LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
+    return addr;
+}
 
-        for (i = 0; i < subwinsize; i++)
-        {
-            uint32_t srcip = (ip4cache == NULL ? *bufptr++ : ip4cache[*bufptr++]);
-            uint32_t dstip = (ip4cache == NULL ? *bufptr++ : ip4cache[*bufptr++]);
+// Runs in a pool worker thread for each window: write the subwindow matrices to a tar file, named after the window's
+// first packet and its number of packets (WINDOWSIZE unless flushed early by -L).
+static void window_to_tar(const struct iovec *iov, int iovcnt, const struct tm *t, uint64_t npkts)
+{
+    char tmp_t[64], f_name[PATH_MAX], entry_name[32];
+    struct tar_writer tw;
+    int fd;
 
-            R[i] = srcip;
-            C[i] = dstip;
-            V[i] = 1;
-        }
+    strftime(tmp_t, sizeof(tmp_t), "%Y%m%d-%H%M%S", t);
+    snprintf(f_name, sizeof(f_name), "%s/%s.%lu.tar", output_path, tmp_t, (unsigned long)npkts);
 
-        LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, R, C, V, subwinsize, GrB_PLUS_UINT32));
-        LAGRAPH_TRY_EXIT(GxB_Matrix_serialize(&blob, &blob_size, Gmat, desc));
+    // Windows shorter than a second (fast links, replays, -L) can share a name: number the later ones.
+    for (int n = 1; (fd = open(f_name, O_CREAT | O_EXCL | O_WRONLY, 0660)) == -1 && errno == EEXIST; n++)
+        snprintf(f_name, sizeof(f_name), "%s/%s.%lu.%d.tar", output_path, tmp_t, (unsigned long)npkts, n);
 
-        blob_list[subblock].blob_size = blob_size;
-        blob_list[subblock].blob_data = blob;
+    if (fd == -1)
+    {
+        perror("open");
+        return;
+    }
+    close(fd);
 
-        GrB_free(&Gmat);
+    // The name is ours now; a write error exits, like every other tool writing tar files.
+    tar_writer_init(&tw);
+    tar_writer_open(&tw, f_name);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        snprintf(entry_name, sizeof(entry_name), "%d.grb", i);
+        tar_writer_add(&tw, entry_name, iov[i].iov_base, iov[i].iov_len);
     }
-    free(R);
-    free(C);
-    free(V);
+    tar_writer_close(&tw, 1);
+}
 
-    strftime(tmp_t, sizeof(tmp_t), "%Y%m%d-%H%M%S", t);
-    snprintf(f_name, sizeof(f_name), "%s/%s.%ld.tar", output_path, tmp_t, windowsize);
+// Return a window's subwindow buffers to the pools of the processing threads that built them.
+static void window_release(void *owner)
+{
+    struct window *w = (struct window *)owner;
 
-    int fd;
-    if ((fd = open(f_name, O_CREAT | O_WRONLY | O_TRUNC, 0660)) != -1)
+    for (int i = 0; i < w->nsubwins; i++)
     {
-        size_t offset                     = 0;
-        const unsigned char padblock[512] = { 0 };
-
-        for (int i = 0; i < (windowsize / subwinsize); i++)
-        {
-            struct posix_tar_header th = { 0 }; // let's make a tar file, or close enough
-
-            const unsigned char *th_ptr = (const unsigned char *)&th;
-            size_t tmp_chksum           = 0;
-            size_t aligned;
-
-            sprintf(th.name, "%d.grb", i);
-            sprintf(th.uid, "%06o ", 0);
-            sprintf(th.gid, "%06o ", 0);
-            sprintf(th.size, "%011o", (unsigned int)blob_list[i].blob_size);
-            sprintf(th.mode, "%06o", 0644);
-            sprintf(th.magic, "%s", TMAGIC);
-            sprintf(th.mtime, "%011o", (unsigned int)time(NULL));
-            th.typeflag = '0';
-            memset(th.chksum, ' ', 8); // or checksum computed below will be wrong!
-
-            for (int b = 0; b < sizeof(struct posix_tar_header); b++)
-                tmp_chksum += th_ptr[b];
-
-            sprintf(th.chksum, "%06o ", (unsigned int)tmp_chksum);
-
-            write(fd, &th, sizeof(th));
-            write(fd, blob_list[i].blob_data, blob_list[i].blob_size);
-
-            offset += sizeof(th) + blob_list[i].blob_size;
-            aligned = offset % 512; // pad output file to 512 byte alignment
-            if (aligned != 0)
-            {
-                write(fd, padblock, 512 - aligned);
-                offset += 512 - aligned;
-            }
-        }
-        close(fd);
+        free(w->sub[i]->heap);
+        chunkpool_put(chunkpools[w->sub[i]->id], w->sub[i]);
     }
-    else
-        perror("open");
 
-    for (int i = 0; i < (windowsize / subwinsize); i++)
+    free(w);
+}
+
+static struct window *window_new(void)
+{
+    struct window *w = malloc(sizeof(struct window));
+
+    if (w == NULL)
     {
-        free(blob_list[i].blob_data);
+        perror("malloc failure");
+        exit(1);
     }
+    w->nsubwins = 0;
+    w->npkts    = 0;
 
-    free(blob_list);
-#endif
-    return;
+    return w;
 }
 
-static void *graphblas_worker(void *untyped_p)
+// Queue a window to the worker pool.  May wait (block), discard the oldest queued window (drop) or write this one to
+// disk (spill) if the workers are behind.
+static void window_submit(struct window *w)
 {
-    size_t windowsize = ((struct graphblas_worker_args *)untyped_p)->windowsize;
-    size_t subwinsize = ((struct graphblas_worker_args *)untyped_p)->subwinsize;
-    uint32_t *pktbuf  = ((struct graphblas_worker_args *)untyped_p)->pktbuf;
-    struct tm *t      = ((struct graphblas_worker_args *)untyped_p)->t;
+    time_t first = w->first.tv_sec;
+    struct tm t;
+
+    localtime_r(&first, &t);
+    winpool_submit(&pool, w->iov, w->nsubwins, w, window_release, &t, w->npkts);
+    winpool_print_stats(&pool, stderr);
+    if (statsfile != NULL)
+        winpool_write_stats(&pool, statsfile, "trace2grb");
+}
 
-    pthread_detach(pthread_self());
+// Build and serialize the subwindow captured by a processing thread into a buffer from its pool, and hand it to the
+// reporter.  With build == 0 (or nothing captured), only tell the reporter that the thread is alive (NULL).
+static void publish_subwindow(libtrace_t *trace, libtrace_thread_t *t, struct packet_args *ps, int build)
+{
+    struct subwindow *sub;
+    GrB_Matrix Gmat;
 
-    time_t dummytime;
-    time(&dummytime);
-    fprintf(stderr, "spawned graphblas_worker thread for full block @ %s", ctime(&dummytime));
-    fflush(stderr);
-    buffer_to_grb(pktbuf, windowsize, subwinsize, t);
+    if (!build || ps->inbuffer == 0)
+    {
+        trace_publish_result(trace, t, ps->id, (libtrace_generic_t){ .ptr = NULL }, RESULT_USER);
+        return;
+    }
 
-    free(pktbuf);
-    free(untyped_p);
+    // Bounds the subwindows waiting to be written: with the reporter blocked on a full queue, wait for the workers.
+    sub            = chunkpool_get(chunkpools[ps->id]);
+    sub->blob      = (char *)sub + SUBWIN_HDRSIZE;
+    sub->blob_size = 0;
+    sub->heap      = NULL;
+    sub->id        = ps->id;
+    sub->npkts     = ps->inbuffer;
+    sub->first     = ps->first;
+    sub->started   = ps->started;
 
-    return NULL; // not reached
+#ifndef NO_GRAPHBLAS_DEBUG
+    for (int i = 0; i < ps->inbuffer; i++)
+    {
+        ps->R[i] = anonymize(ps->R[i]);
+        ps->C[i] = anonymize(ps->C[i]);
+    }
+
+    LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
+    LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, ps->R, ps->C, ps->V, ps->inbuffer, GrB_PLUS_UINT32));
+    LAGRAPH_TRY_EXIT(GxB_Matrix_serialize(&sub->heap, &sub->blob_size, Gmat, desc));
+    GrB_free(&Gmat);
+
+    // Copied into the buffer, so the blob the writers read is on this thread's NUMA node and never freed by them.
+    if (sub->blob_size <= SUBWIN_BUFSIZE - SUBWIN_HDRSIZE)
+    {
+        memcpy(sub->blob, sub->heap, sub->blob_size);
+        free(sub->heap);
+        sub->heap = NULL;
+    }
+    else
+    {
+        sub->blob = sub->heap;
+        atomic_fetch_add_explicit(&oversized, 1, memory_order_relaxed);
+    }
+#endif
+
+    trace_publish_result(trace, t, ps->id, (libtrace_generic_t){ .ptr = sub }, RESULT_USER);
+    ps->inbuffer = 0;
 }
 
 static void *report_start(libtrace_t *trace, libtrace_thread_t *t, void *global)
 {
     struct reporting_args *rs = (struct reporting_args *)malloc(sizeof(struct reporting_args));
-    time_t dummytime;
 
-    if ((rs->pktbuf = malloc(packet_buffer_size)) == NULL)
-    {
-        perror("malloc failure");
-        exit(1);
-    }
-    rs->inbuffer = 0;
-    rs->bufptr   = rs->pktbuf;
-
-    time(&dummytime);
-    rs->t = localtime(&dummytime);
+    rs->win = window_new();
 
     return rs;
 }
 
-// Called every time thread_buffer_size is reached in a worker thread.  Append block and dispatch GrB thread if buffer
-// full.
+// Called every time a processing thread has built a subwindow (or ticked, with -L).  Append it to the window (by
+// reference) and queue the window to the worker pool if full, or if its oldest packet has waited -L seconds.
 static void report_cb(libtrace_t *trace, libtrace_thread_t *sender, void *global, void *tls, libtrace_result_t *res)
 {
     struct reporting_args *rs = (struct reporting_args *)tls;
-    time_t dummytime;
-    time(&dummytime);
+    struct window *w          = rs->win;
+    struct subwindow *sub;
 
     /* Process the result */
     if (res->type != RESULT_USER)
         return;
 
-    memcpy(rs->bufptr, res->value.ptr, thread_buffer_size);
-    free(res->value.ptr);
-    rs->inbuffer += thread_buffer_size;
-    rs->bufptr += (PKTBUFSIZE * 2);
-    fflush(stderr);
+    sub = (struct subwindow *)res->value.ptr;
 
-    if (rs->inbuffer >= packet_buffer_size)
+    if (sub != NULL)
     {
-        pthread_t thread;
-        struct graphblas_worker_args *gb_args_p = malloc(sizeof(*gb_args_p));
-
-        gb_args_p->pktbuf     = rs->pktbuf;
-        gb_args_p->t          = rs->t;
-        gb_args_p->subwinsize = SUBWINSIZE;
-        gb_args_p->windowsize = WINDOWSIZE;
-
-        pthread_create(&thread, NULL, graphblas_worker, gb_args_p);
-
-        time_t dummytime;
-        time(&dummytime);
-
-        if ((rs->pktbuf = malloc(packet_buffer_size)) == NULL)
-        {
-            perror("malloc failure");
-            exit(1);
-        }
+        // Threads publish in their own order: the window starts at its earliest subwindow.
+        if (w->nsubwins == 0 || timercmp(&sub->first, &w->first, <))
+            w->first = sub->first;
+        if (w->nsubwins == 0 || sub->started.tv_sec < w->started.tv_sec ||
+            (sub->started.tv_sec == w->started.tv_sec && sub->started.tv_nsec < w->started.tv_nsec))
+            w->started = sub->started;
+
+        w->iov[w->nsubwins].iov_base = sub->blob;
+        w->iov[w->nsubwins].iov_len  = sub->blob_size;
+        w->sub[w->nsubwins]          = sub;
+        w->npkts += sub->npkts;
+        w->nsubwins++;
+    }
 
-        rs->inbuffer = 0;
-        rs->bufptr   = rs->pktbuf;
-        rs->t        = localtime(&dummytime);
+    if (w->nsubwins == WINDOW_SUBWINS ||
+        (max_latency > 0 && w->nsubwins > 0 && seconds_since(&w->started) >= max_latency))
+    {
+        window_submit(w);
+        rs->win = window_new();
     }
 }
 
 static void report_end(libtrace_t *trace, libtrace_thread_t *t, void *global, void *tls)
 {
     /* Free the local storage and print any final results */
-    struct rstorage *rs = (struct rstorage *)tls;
+    struct reporting_args *rs = (struct reporting_args *)tls;
+
+    // Partial window: with -L, deliver it too.
+    if (max_latency > 0 && rs->win->nsubwins > 0)
+        window_submit(rs->win);
+    else
+        window_release(rs->win);
     free(rs);
 }
 
@@ -246,42 +301,68 @@ static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t, vo
     if (!ip)
         return packet;
 
-    *p_args_p->bufptr++ = ip->ip_src.s_addr;
-    *p_args_p->bufptr++ = ip->ip_dst.s_addr;
-    p_args_p->inbuffer++;
-
-    if (p_args_p->inbuffer == PKTBUFSIZE)
+    if (p_args_p->inbuffer == 0)
     {
-        trace_publish_result(trace, t, 0, (libtrace_generic_t){ .ptr = p_args_p->pktbuf }, RESULT_USER);
-        if ((p_args_p->pktbuf = malloc(thread_buffer_size)) == NULL)
-        {
-            perror("malloc failure");
-            exit(1);
-        }
-        p_args_p->inbuffer = 0;
-        p_args_p->bufptr   = p_args_p->pktbuf;
+        p_args_p->first = trace_get_timeval(packet);
+        clock_gettime(CLOCK_MONOTONIC, &p_args_p->started);
     }
 
+    p_args_p->R[p_args_p->inbuffer] = ip->ip_src.s_addr;
+    p_args_p->C[p_args_p->inbuffer] = ip->ip_dst.s_addr;
+    p_args_p->inbuffer++;
+
+    if (p_args_p->inbuffer == SUBWINSIZE)
+        publish_subwindow(trace, t, p_args_p, 1);
+
     return packet;
 }
 
-static void *start_processing(libtrace_t *trace, libtrace_thread_t *t UNUSED, void *global)
+// With -L, every tick: hand over a partial subwindow that has waited long enough, or just wake the reporter up so it
+// can flush its window on a quiet link.
+static void per_tick(libtrace_t *trace, libtrace_thread_t *t, void *global, void *tls, uint64_t tick)
+{
+    struct packet_args *ps = (struct packet_args *)tls;
+
+    publish_subwindow(trace, t, ps, ps->inbuffer > 0 && seconds_since(&ps->started) >= max_latency);
+}
+
+static void *start_processing(libtrace_t *trace, libtrace_thread_t *t, void *global)
 {
     /* Create any local storage required by the reporter thread and
      * return it. */
     struct packet_args *ps = (struct packet_args *)malloc(sizeof(struct packet_args));
 
-#ifndef NO_GRAPHBLAS_DEBUG // msj
-    GrB_init(GrB_NONBLOCKING);
-#endif
+    if ((ps->id = trace_get_perpkt_thread_id(t)) < 0 || ps->id >= nchunkpools)
+    {
+        fprintf(stderr, "unexpected processing thread id: %d\n", ps->id);
+        exit(1);
+    }
+
+    // Allocated here, by the thread that fills them, so the buffers are on its NUMA node.  Kept across input URIs.
+    if (chunkpools[ps->id] == NULL)
+    {
+        if ((chunkpools[ps->id] = malloc(sizeof(struct chunkpool))) == NULL)
+        {
+            perror("malloc failure");
+            exit(1);
+        }
+        chunkpool_init(chunkpools[ps->id], subwin_credits, SUBWIN_BUFSIZE);
+    }
 
-    if ((ps->pktbuf = malloc(thread_buffer_size)) == NULL)
+    // Row, Col, Val vectors, filled straight from the packets.
+    ps->R = malloc(sizeof(GrB_Index) * SUBWINSIZE);
+    ps->C = malloc(sizeof(GrB_Index) * SUBWINSIZE);
+    ps->V = malloc(sizeof(uint32_t) * SUBWINSIZE);
+
+    if (ps->R == NULL || ps->C == NULL || ps->V == NULL)
     {
         perror("malloc failure");
         exit(1);
     }
+
+    for (int i = 0; i < SUBWINSIZE; i++)
+        ps->V[i] = 1;
     ps->inbuffer = 0;
-    ps->bufptr   = ps->pktbuf;
 
     return ps;
 }
@@ -290,7 +371,13 @@ static void stop_processing(libtrace_t *trace, libtrace_thread_t *t, void *globa
 {
     struct packet_args *ps = (struct packet_args *)tls;
 
-    /* May want to do a final publish here... */
+    // With -L, deliver what is left; otherwise a partial subwindow is discarded.
+    if (max_latency > 0 && ps->inbuffer > 0)
+        publish_subwindow(trace, t, ps, 1);
+
+    free(ps->R);
+    free(ps->C);
+    free(ps->V);
     free(ps);
 }
 
@@ -301,8 +388,19 @@ static void usage(char *prog)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "\t-t threads Set the number of processing threads\n");
     fprintf(stderr, "\t-c file    Point to a precomputed IPv4 anonymization table\n");
+    fprintf(stderr, "\t-M mode    Map the -c table 'lazy' (default), 'populate' or from a hugetlbfs mount path\n");
+    fprintf(stderr, "\t-a key     Anonymize with CryptopANT (the key file is created if it does not exist); not with -c\n");
+    fprintf(stderr, "\t-m file    With -a, load the anonymization memo from file at startup, save it at exit\n");
     fprintf(stderr, "\t-o dir     Directory to place output files.  Default: %s\n", DEFAULT_OUTPUT_PATH);
     fprintf(stderr, "\t-f expr    Discard all packets that do not match the BPF expression\n");
+    fprintf(stderr, "\t-g workers Number of threads writing output files.  Default: %d\n", DEFAULT_WORKERS);
+    fprintf(stderr, "\t-Q depth   Full windows that may wait for a worker.  Default: %d\n", DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "\t-B policy  Full queue policy: 'block' (default), 'drop' (oldest window) or 'spill' (to disk)\n");
+    fprintf(stderr, "\t-D dir     Directory for spilled windows.  Default: the output directory\n");
+    fprintf(stderr, "\t-S file    Write worker pool counters to file (Prometheus text format) after every window\n");
+    fprintf(stderr, "\t-L seconds Write partial windows once their first packet has waited this long\n");
+    fprintf(stderr, "\t-C count   Subwindow buffers (%d KB each) preallocated per processing thread.  Minimum: %d\n",
+            SUBWIN_BUFSIZE / 1024, WINDOW_SUBWINS);
 
     exit(0);
 }
@@ -318,6 +416,14 @@ int main(int argc, char *argv[])
     struct sigaction sigact;
     int threads              = 8;
     char cachefile[PATH_MAX] = { 0 };
+    char *cachemode          = NULL;
+    char *anonkey            = NULL; // -a
+    char *memofile           = NULL; // -m
+    long memo_loaded;
+    int workers     = DEFAULT_WORKERS;     // -g
+    int queue_depth = DEFAULT_QUEUE_DEPTH; // -Q
+    int policy      = WINPOOL_BLOCK;       // -B
+    char *spilldir  = NULL;                // -D
 
     /* TODO replace this with whatever global data your threads are
      * likely to need. */
@@ -328,7 +434,7 @@ int main(int argc, char *argv[])
         usage(argv[0]);
     }
 
-    while ((opt = getopt(argc, argv, "o:c:f:t:")) != EOF)
+    while ((opt = getopt(argc, argv, "o:a:c:f:g:m:t:B:C:D:L:M:Q:S:")) != EOF)
     {
         switch (opt)
         {
@@ -336,9 +442,43 @@ int main(int argc, char *argv[])
                 snprintf(cachefile, sizeof(cachefile) - 1, "%s", optarg);
                 usecache = 1;
                 break;
+            case 'a':
+                anonkey = optarg;
+                break;
             case 'f':
                 filterstring = optarg;
                 break;
+            case 'g':
+                workers = atoi(optarg);
+                break;
+            case 'B':
+                if ((policy = winpool_policy(optarg)) < 0)
+                {
+                    fprintf(stderr, "invalid backpressure policy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                subwin_credits = atoi(optarg);
+                break;
+            case 'D':
+                spilldir = optarg;
+                break;
+            case 'L':
+                max_latency = atof(optarg);
+                break;
+            case 'Q':
+                queue_depth = atoi(optarg);
+                break;
+            case 'S':
+                statsfile = optarg;
+                break;
+            case 'm':
+                memofile = optarg;
+                break;
+            case 'M':
+                cachemode = optarg;
+                break;
             case 't':
                 threads = atoi(optarg);
                 break;
@@ -350,6 +490,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (usecache && anonkey != NULL)
+    {
+        fprintf(stderr, "-c and -a are mutually exclusive: use one anonymization method.\n");
+        exit(1);
+    }
+
     if (output_path == NULL)
         output_path = strdup(DEFAULT_OUTPUT_PATH);
 
@@ -364,31 +510,28 @@ int main(int argc, char *argv[])
 
     if (usecache)
     {
-        FILE *fp;
-        size_t filesize = 0, ret = 0;
-        struct timespec ts_start;
-
-        fprintf(stderr, "loading anonymization table: %s\n", cachefile);
-        ip4cache = malloc(cachesize);
-
-        if ((fp = fopen(cachefile, "rb")) == NULL)
+        fprintf(stderr, "mapping anonymization table: %s\n", cachefile);
+        ip4cache = ip4cache_map(cachefile, cachemode, &cachesize);
+    }
+    else if (anonkey != NULL)
+    {
+        fprintf(stderr, "anonymizing using scramble keyfile: %s\n", anonkey);
+        if (scramble_init_from_file(anonkey, SCRAMBLE_BLOWFISH, SCRAMBLE_BLOWFISH, NULL) < 0)
         {
-            perror("fopen");
-            return 1;
+            fprintf(stderr, "scramble_init_from_file(): nope\n");
+            exit(1);
         }
 
-        fseek(fp, 0L, SEEK_END);
-        filesize = ftell(fp);
-        fseek(fp, 0L, SEEK_SET);
-        fprintf(stderr, "table is %ld bytes\n", filesize);
-
-        if ((ret = fread(ip4cache, filesize, 1, fp)) < 1)
+        // CryptopANT is not thread safe and windows are built concurrently: every lookup goes through the memo.
+        if ((ip4memo = malloc(sizeof(struct ip4memo))) == NULL)
         {
-            perror("fread");
-            return 1;
+            perror("malloc failure");
+            exit(1);
         }
+        ip4memo_init(ip4memo, IP4MEMO_DEFAULT_BITS);
 
-        fclose(fp);
+        if (memofile != NULL && (memo_loaded = ip4memo_load(ip4memo, memofile)) > 0)
+            fprintf(stderr, "loaded %ld addresses from memo\n", memo_loaded);
     }
 
     if (optind + 1 > argc)
@@ -402,6 +545,44 @@ int main(int argc, char *argv[])
         filter = trace_create_filter(filterstring);
     }
 
+    if (workers < 1 || queue_depth < 1 || threads < 1)
+    {
+        fprintf(stderr, "-g, -Q and -t must be at least 1\n");
+        exit(1);
+    }
+
+    // A thread that sees all the traffic must be able to fill a whole window; beyond that, by default, the threads
+    // share enough buffers for every window that can be queued or being written.
+    if (subwin_credits == 0)
+        subwin_credits = (WINDOW_SUBWINS * (queue_depth + workers + 1) + threads - 1) / threads;
+    if (subwin_credits < WINDOW_SUBWINS)
+        subwin_credits = WINDOW_SUBWINS;
+
+    nchunkpools = threads;
+    if ((chunkpools = calloc(threads, sizeof(struct chunkpool *))) == NULL)
+    {
+        perror("malloc failure");
+        exit(1);
+    }
+    fprintf(stderr, "%u subwindow buffers (%u MB) per processing thread\n", subwin_credits,
+            (unsigned)((size_t)subwin_credits * SUBWIN_BUFSIZE >> 20));
+
+#ifndef NO_GRAPHBLAS_DEBUG // msj
+    GrB_init(GrB_NONBLOCKING);
+
+    // Each processing thread builds its own subwindows: with matrices this small (2^17), NTHREADS == 1 yields best
+    // performance.
+    GxB_set(GxB_NTHREADS, 1);
+
+    // Configure compression.  ZSTD level 1 is best.
+    GrB_Descriptor_new(&desc);
+    GxB_Desc_set(desc, GxB_COMPRESSION, GxB_COMPRESSION_ZSTD + 1);
+#endif
+
+    fprintf(stderr, "%d writer threads, up to %d queued windows (%s when full)\n", workers, queue_depth,
+            policy == WINPOOL_BLOCK ? "block" : policy == WINPOOL_DROP ? "drop oldest" : "spill");
+    winpool_start(&pool, workers, queue_depth, policy, spilldir != NULL ? spilldir : output_path, window_to_tar);
+
     sigact.sa_handler = cleanup_signal;
     sigemptyset(&sigact.sa_mask);
     sigact.sa_flags = SA_RESTART;
@@ -413,6 +594,8 @@ int main(int argc, char *argv[])
     trace_set_starting_cb(processing, start_processing);
     trace_set_stopping_cb(processing, stop_processing);
     trace_set_packet_cb(processing, per_packet);
+    if (max_latency > 0)
+        trace_set_tick_interval_cb(processing, per_tick);
 
     reporter = trace_create_callback_set();
     trace_set_starting_cb(reporter, report_start);
@@ -441,6 +624,13 @@ int main(int argc, char *argv[])
         trace_set_perpkt_threads(inptrace, threads);
         trace_set_reporter_thold(inptrace, 5);
 
+        // Tick a few times per -L interval (at most every second), and do not hold flushed results back.
+        if (max_latency > 0)
+        {
+            trace_set_tick_interval(inptrace, max_latency >= 4 ? 1000 : max_latency * 250 + 1);
+            trace_set_reporter_thold(inptrace, 1);
+        }
+
         if (trace_pstart(inptrace, &global, processing, reporter))
         {
             trace_perror(inptrace, "Starting trace");
@@ -467,5 +657,39 @@ int main(int argc, char *argv[])
     trace_destroy(inptrace);
     trace_destroy_callback_set(processing);
     trace_destroy_callback_set(reporter);
+
+    // Write every window still queued before exiting.
+    winpool_finish(&pool);
+    winpool_print_stats(&pool, stderr);
+    if (statsfile != NULL)
+        winpool_write_stats(&pool, statsfile, "trace2grb");
+
+    for (i = 0; i < nchunkpools; i++)
+    {
+        if (chunkpools[i] == NULL)
+            continue;
+
+        if (chunkpools[i]->waits > 0)
+            fprintf(stderr, "processing thread %d waited for the writers %lu times\n", i,
+                    (unsigned long)chunkpools[i]->waits);
+        chunkpool_free(chunkpools[i]);
+        free(chunkpools[i]);
+    }
+    free(chunkpools);
+    if (oversized > 0)
+        fprintf(stderr, "%lu subwindows did not fit a %d KB buffer\n", (unsigned long)oversized,
+                SUBWIN_BUFSIZE / 1024);
+
+#ifndef NO_GRAPHBLAS_DEBUG
+    GrB_free(&desc);
+#endif
+
+    if (ip4memo != NULL)
+    {
+        fprintf(stderr, "Anonymized %lu new addresses (%zu in memo).\n", ip4memo->misses, ip4memo_count(ip4memo));
+        if (memofile != NULL && (memo_loaded = ip4memo_save(ip4memo, memofile)) >= 0)
+            fprintf(stderr, "saved %ld addresses to memo: %s\n", memo_loaded, memofile);
+    }
+
     return retcode;
 }
@@ -513,6 +513,11 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
+                if (th.name[0] == '\0') // end-of-archive marker
+                {
+                    break;
+                }
+
                 if (strcmp(TMAGIC, th.magic) != 0)
                 {
                     perror("invalid tar file");
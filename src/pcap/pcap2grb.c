@@ -2,6 +2,7 @@
 
 #include <GraphBLAS.h>
 #include <arpa/inet.h>
+#include <byteswap.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -16,10 +17,12 @@
 #include <openssl/evp.h>
 #include <pcap.h>
 #include <pcap/pcap.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
@@ -30,17 +33,144 @@
 #include <zlib.h>
 
 #include "cryptopANT.h"
+#include "cryptopan.h"
+#include "ip4cache.h"
+#include "ip4memo.h"
+#include "tarwriter.h"
 
 // Default
 #define SUBWINSIZE (1 << 17) // 131072
 
 #define BSWAP(a)   (pstate->swapped ? ntohl(a) : (a))
 
+// pcap file magic numbers (microsecond and nanosecond timestamp resolution).
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+// LINKTYPE_* values as stored in the pcap file header (not always equal to DLT_*).
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW      101
+
+// Intra-file parallel mode (-P).
+#define SPLIT_MIN_RANGE    (1 << 20) // smallest byte range worth a thread
+#define SPLIT_RESYNC_DEPTH 4         // consecutive plausible record headers needed to accept a split point
+#define SPLIT_MAX_PKTLEN   262144    // largest original packet length accepted while resynchronizing
+
+// extract_tuple() results, in increasing order of usefulness.
+#define PKT_NOT_IP    0 // not IPv4
+#define PKT_INVALID   1 // truncated IP header or wrong IP version
+#define PKT_BROADCAST 2 // IPv4 global broadcast: can open a tar file, but adds no tuple
+#define PKT_ACCEPTED  3 // IPv4 tuple
+
+/// @brief pcap file header, as found at the beginning of the file.
+struct pcap_file_header_raw
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+/// @brief pcap per-record header, as found in the file (timestamps are 32 bit on disk).
+struct pcap_record_header_raw
+{
+    uint32_t ts_sec;
+    uint32_t ts_frac; // usec or nsec, depending on file magic
+    uint32_t caplen;
+    uint32_t len;
+};
+
+/// @brief Zero-copy reader for a pcap file mapped into memory.
+struct pcap_mmap
+{
+    int fd;
+    const uint8_t *base;
+    size_t size;
+    size_t pos;
+    unsigned int byteswap; // file was written on a host of the opposite byte order
+    unsigned int nsec;     // record timestamps are in nanoseconds
+    uint32_t snaplen;
+    int link_type; // DLT_* value
+};
+
+/// @brief One subwindow of tuples on its way from the reader, through a GraphBLAS worker, to the tar writer.
+struct subwindow
+{
+    uint64_t seq; // order in which the reader filled it
+    GrB_Index *R, *C;
+    uint32_t *V;
+    GrB_Index nrec;
+    char f_name[1024]; // tar file and entry number, fixed by the reader
+    uint32_t findex;
+    void *blob;
+    GrB_Index blob_size;
+    struct subwindow *next;
+};
+
+/// @brief Blocking FIFO of subwindows.
+struct subwindow_queue
+{
+    struct subwindow *head, *tail;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/// @brief Reader -> GraphBLAS workers -> tar writer pipeline (-T).
+struct pipeline
+{
+    uint32_t nworkers;
+    uint32_t nslots;
+    struct subwindow *slots;       // every subwindow buffer, allocated up front
+    struct subwindow *cur;         // subwindow the reader is filling
+    struct subwindow_queue free_q; // empty subwindows
+    struct subwindow_queue work_q; // filled subwindows waiting for a worker
+    struct subwindow **done;       // serialized subwindows waiting for the writer, indexed by seq % nslots
+    uint64_t next_seq;             // next sequence number handed out by the reader
+    int finished;                  // reader is done, next_seq is final
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    pthread_t *workers;
+    pthread_t writer;
+};
+
+/// @brief One byte range of the input file in intra-file parallel mode (-P).
+struct split_range
+{
+    int id;
+    size_t start, end;                   // byte offsets, on record boundaries
+    uint64_t packets, invalid, accepted; // phase 1 counters
+    int tail_valid;                      // an IPv4 broadcast follows the last accepted tuple of the range
+    struct timeval tail_ts;              // ... and this is its timestamp
+    int walk_error, truncated;
+    uint64_t base;           // global index of the first tuple in the range
+    uint64_t s_begin, s_end; // subwindows built by this range
+    uint64_t named;          // global index of the tuple opening the last tar file named by this range
+    char part_name[1024];    // entries for a tar file started by an earlier range
+    uint32_t part_entries;
+    struct tar_writer tw, part_tw;
+    GrB_Index *R, *C;
+    uint32_t *V;
+};
+
+/// @brief Shared state of intra-file parallel mode (-P).
+struct split_state
+{
+    struct pcap_mmap *pm;
+    struct split_range *ranges;
+    uint32_t nranges;
+    uint64_t total;      // accepted tuples in the whole file
+    char (*names)[1024]; // output tar file names, by tar file number
+};
+
 struct px3_state
 {
     struct tm *f_tm;
     unsigned int save_trailing_packets;
-    unsigned int anonymize;
+    enum anon_mode anonymize;
     unsigned int swapped;
     unsigned int rec;
     unsigned int create_new_file;
@@ -48,6 +178,7 @@ struct px3_state
     long usec;
     uint32_t files_per_window;
     uint32_t subwinsize;
+    uint32_t capacity; // allocated entries in R/C/V; less than subwinsize only in single file mode
     uint64_t total_packets, total_invalid;
     char *out_prefix;
     char f_name[1024];
@@ -55,36 +186,18 @@ struct px3_state
     GrB_Index *R, *C;
     uint32_t *V;
     uint32_t *ip4cache;
+    struct ip4memo memo; // anonymize == ANON_AFTER_AGG or ANON_MEMO
+    uint32_t anon_bcast; // anonymize == ANON_AFTER_AGG or ANON_CRYPTOPAN: raw address that anonymizes to the global
+                         // broadcast address
+    struct cryptopan *cpan; // anonymize == ANON_CRYPTOPAN
+    GrB_Descriptor desc;
+    uint32_t nworkers;
+    struct pipeline *pipe;
+    uint32_t nranges;
+    struct split_state *split;
+    struct tar_writer tw; // output tar file of the serial and pipelined modes
 };
 
-/// @brief 512-byte POSIX tar file header.
-struct posix_tar_header
-{                       /* byte offset */
-    char name[100];     /*   0 - filename */
-    char mode[8];       /* 100 - octal mode */
-    char uid[8];        /* 108 - user ID */
-    char gid[8];        /* 116 - group ID */
-    char size[12];      /* 124 - file size */
-    char mtime[12];     /* 136 - modification time */
-    char chksum[8];     /* 148 - checksum */
-    char typeflag;      /* 156 - type */
-    char linkname[100]; /* 157 - link name */
-    char magic[6];      /* 257 - tar magic, USTAR */
-    char version[2];    /* 263 - tar version */
-    char uname[32];     /* 265 - user name */
-    char gname[32];     /* 297 - group name */
-    char devmajor[8];   /* 329 - device major */
-    char devminor[8];   /* 337 - device minor */
-    char prefix[155];   /* 345 - prefix */
-                        /* 500 */
-    char padding1[12];  /* 512 - unused padding to fill 512 bytes */
-};
-
-#define TMAGIC   "ustar" /* ustar and a null */
-#define TMAGLEN  6
-#define TVERSION "00" /* 00 and no null */
-#define TVERSLEN 2
-
 struct px3_state *pstate; // global state
 
 // If at first you don't succeed, just abort.
@@ -109,191 +222,1250 @@ struct px3_state *pstate; // global state
         fprintf(stderr, "[%d] [%.2f] [%s] Section begin.\n", _mytid, t_ts, msg);                                       \
     }
 
-#define TOC(clocktype, msg)                                                                                            \
-    {                                                                                                                  \
-        struct timespec ts_end, tsdiff;                                                                                \
-        double t_ts;                                                                                                   \
-        pid_t _mytid = syscall(SYS_gettid);                                                                            \
-        clock_gettime(clocktype, &ts_end);                                                                             \
-        timespec_diff(&ts_end, &ts_start, &tsdiff);                                                                    \
-        t_ts      = ((ts_start.tv_sec * 1e9) + (ts_start.tv_nsec)) * 1e-9;                                             \
-        t_elapsed = ((tsdiff.tv_sec * 1e9) + (tsdiff.tv_nsec)) * 1e-9;                                                 \
-        fprintf(stderr, "[%d] [%.2f] [%s] elapsed %.2fs\n", _mytid, t_ts, msg, t_elapsed);                             \
+#define TOC(clocktype, msg)                                                                                            \
+    {                                                                                                                  \
+        struct timespec ts_end, tsdiff;                                                                                \
+        double t_ts;                                                                                                   \
+        pid_t _mytid = syscall(SYS_gettid);                                                                            \
+        clock_gettime(clocktype, &ts_end);                                                                             \
+        timespec_diff(&ts_end, &ts_start, &tsdiff);                                                                    \
+        t_ts      = ((ts_start.tv_sec * 1e9) + (ts_start.tv_nsec)) * 1e-9;                                             \
+        t_elapsed = ((tsdiff.tv_sec * 1e9) + (tsdiff.tv_nsec)) * 1e-9;                                                 \
+        fprintf(stderr, "[%d] [%.2f] [%s] elapsed %.2fs\n", _mytid, t_ts, msg, t_elapsed);                             \
+    }
+#else
+#define TIC(clocktype, msg)
+#define TOC(clocktype, msg)
+#endif
+
+/// @brief Calculate the delta time (as a struct timespec) between two struct timespec.
+/// @param a Time #1
+/// @param b Time #2
+/// @param result struct timespec containing the elapsed time between them.
+static inline void timespec_diff(struct timespec *a, struct timespec *b, struct timespec *result)
+{
+    result->tv_sec  = a->tv_sec - b->tv_sec;
+    result->tv_nsec = a->tv_nsec - b->tv_nsec;
+    if (result->tv_nsec < 0)
+    {
+        --result->tv_sec;
+        result->tv_nsec += 1000000000L;
+    }
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-a anonymize.key [-A] [-m MEMO_FILE]] [-k cryptopan.key] [-c ip4cache [-M MODE]] [-l] [-P THREADS] [-T THREADS] [-W FILES_PER_WINDOW] [-w SUBWINSIZE] [-O output_file_name] -i INPUT_FILE -o OUTPUT_DIRECTORY\n",
+            name);
+    fprintf(stderr, "    -a Anonymize using CryptopANT (https://ant.isi.edu/software/cryptopANT/index.html)\n");
+    fprintf(stderr,
+            "       If CryptoPAN anonymization keyfile does not exist, a random key will be generated and saved.\n");
+    fprintf(stderr, "    -A With -a, build each matrix on raw addresses, then anonymize each distinct address once.\n");
+    fprintf(stderr, "    -m With -a, memoize anonymized addresses (shared by all threads), loaded from and saved to\n");
+    fprintf(stderr, "       MEMO_FILE so a restart starts warm.  Made with another key, the file is ignored.\n");
+    fprintf(stderr, "    -k Anonymize using Crypto-PAn (AES-128), a batch per subwindow; the key file (32 bytes) is\n");
+    fprintf(stderr, "       created if it does not exist.  Not the same mapping as -a.\n");
+    fprintf(stderr, "    -c Path to precomputed IPv4 anonymization table (generated with makecache).\n");
+    fprintf(stderr, "    -M How to map the -c table: 'lazy' (default, read pages as they are looked up), 'populate'\n");
+    fprintf(stderr, "       (read it all at startup) or the path of a hugetlbfs mount to keep a shared copy in.\n");
+    fprintf(stderr, "    -P Parallel mode: split the input file into byte ranges converted on THREADS threads.\n");
+    fprintf(stderr, "       Needs the mmap reader (regular file, no -l); output matches a serial run.\n");
+    fprintf(stderr, "    -T Pipelined mode: build and serialize matrices on THREADS worker threads.\n");
+    fprintf(stderr, "       Output is written in the same order, with the same contents, as a serial run.\n");
+    fprintf(stderr, "    -W Number of GraphBLAS matrices to save in the output tar file.\n");
+    fprintf(stderr, "    -w Window size (number of entries) in the saved GraphBLAS matrices.\n");
+    fprintf(stderr, "    -O Single file mode - one tar file containing one GraphBLAS matrix (single pass, works on stdin).\n");
+    fprintf(stderr, "    -i Input file (pcap format).\n");
+    fprintf(stderr, "    -l Always read input through libpcap (default: mmap regular Ethernet/raw IP pcap files).\n");
+    fprintf(stderr, "    -o Output directory.\n");
+}
+
+/// @brief Find the IPv4 header in an Ethernet frame (look for ETHERTYPE_IP): untagged, 802.1Q or QinQ (two tags,
+///        802.1ad or 802.1Q outer), as dpdk2grb does.
+/// @param base Beginning of packet Ethernet header. (uint8_t)
+/// @param caplen Captured length of the packet.
+/// @return Pointer to the beginning of the IPv4 header, or NULL if not found.
+const uint8_t *find_iphdr(const uint8_t *base, uint32_t caplen)
+{
+    uint32_t off        = 12;
+    uint16_t ether_type = ntohs(*(uint16_t *)(base + off));
+
+    for (int tags = 0; tags < 2 && (ether_type == 0x8100 || ether_type == 0x88a8) && off + 6 <= caplen; tags++)
+    {
+        off += 4; // VLAN tag
+        ether_type = ntohs(*(uint16_t *)(base + off));
+    }
+
+    if (ether_type == ETHERTYPE_IP) // IP
+    {
+        return base + off + 2;
+    }
+
+    return NULL;
+}
+
+/// @brief Map a pcap file into memory for zero-copy reading.
+/// @param pm Reader state to initialize.
+/// @param path Path to the pcap file.
+/// @return 0 on success, -1 if the file can't be read this way (caller should fall back to libpcap).
+int pcap_mmap_open(struct pcap_mmap *pm, const char *path)
+{
+    struct pcap_file_header_raw fh;
+    struct stat st;
+    void *base;
+
+    memset(pm, 0, sizeof(*pm));
+
+    if ((pm->fd = open(path, O_RDONLY)) == -1)
+        return -1;
+
+    if (fstat(pm->fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < sizeof(fh))
+        goto errexit;
+
+    if ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, pm->fd, 0)) == MAP_FAILED)
+        goto errexit;
+
+    pm->base = base;
+    pm->size = st.st_size;
+    memcpy(&fh, pm->base, sizeof(fh));
+
+    if (fh.magic == PCAP_MAGIC_USEC || fh.magic == PCAP_MAGIC_NSEC)
+    {
+        pm->byteswap = 0;
+    }
+    else if (fh.magic == bswap_32(PCAP_MAGIC_USEC) || fh.magic == bswap_32(PCAP_MAGIC_NSEC))
+    {
+        pm->byteswap = 1;
+        fh.magic     = bswap_32(fh.magic);
+        fh.snaplen   = bswap_32(fh.snaplen);
+        fh.linktype  = bswap_32(fh.linktype);
+    }
+    else // pcapng or something else libpcap may understand.
+    {
+        goto errexit_unmap;
+    }
+
+    pm->nsec    = (fh.magic == PCAP_MAGIC_NSEC);
+    pm->snaplen = fh.snaplen;
+
+    // Upper 16 bits of the link type field may carry FCS information; only the link type is needed here.
+    switch (fh.linktype & 0xffff)
+    {
+        case LINKTYPE_ETHERNET:
+            pm->link_type = DLT_EN10MB;
+            break;
+        case LINKTYPE_RAW:
+            pm->link_type = DLT_RAW;
+            break;
+        default:
+            goto errexit_unmap;
+    }
+
+    madvise((void *)pm->base, pm->size, MADV_SEQUENTIAL);
+    pm->pos = sizeof(fh);
+
+    return 0;
+
+errexit_unmap:
+    munmap((void *)pm->base, pm->size);
+    pm->base = NULL;
+errexit:
+    close(pm->fd);
+    pm->fd = -1;
+    return -1;
+}
+
+/// @brief Return the next record from an mmap'd pcap file, without copying the packet data.
+/// @param pm Reader state.
+/// @param hdr Filled in with the record header (timestamp converted to microseconds, as libpcap does).
+/// @param data Set to the beginning of the packet data inside the mapping.
+/// @return 1 if a packet was returned, 0 at end of file, -1 on a truncated or corrupt record.
+static inline int pcap_mmap_next(struct pcap_mmap *pm, struct pcap_pkthdr *hdr, const uint8_t **data)
+{
+    struct pcap_record_header_raw rh;
+
+    if (pm->pos == pm->size)
+        return 0;
+
+    if (pm->size - pm->pos < sizeof(rh))
+        return -1;
+
+    memcpy(&rh, pm->base + pm->pos, sizeof(rh));
+
+    if (pm->byteswap)
+    {
+        rh.ts_sec  = bswap_32(rh.ts_sec);
+        rh.ts_frac = bswap_32(rh.ts_frac);
+        rh.caplen  = bswap_32(rh.caplen);
+        rh.len     = bswap_32(rh.len);
+    }
+
+    // Same sanity limit libpcap applies to record lengths.
+    if (rh.caplen > pm->snaplen && rh.caplen > 262144)
+        return -1;
+
+    if (pm->size - pm->pos - sizeof(rh) < rh.caplen)
+        return -1;
+
+    hdr->ts.tv_sec  = rh.ts_sec;
+    hdr->ts.tv_usec = pm->nsec ? rh.ts_frac / 1000 : rh.ts_frac;
+    hdr->caplen     = rh.caplen;
+    hdr->len        = rh.len;
+
+    *data = pm->base + pm->pos + sizeof(rh);
+    pm->pos += sizeof(rh) + rh.caplen;
+
+    return 1;
+}
+
+void pcap_mmap_close(struct pcap_mmap *pm)
+{
+    munmap((void *)pm->base, pm->size);
+    close(pm->fd);
+    pm->base = NULL;
+    pm->fd   = -1;
+}
+
+/// @brief Format the name of a new output tar file, named for the packet that opens it; exit if it already exists.
+/// @param f_name Output buffer.
+/// @param len Size of f_name.
+/// @param tm Local time of the first packet in the tar file.
+/// @param usec Microseconds of the first packet in the tar file.
+void format_output_filename(char *f_name, size_t len, const struct tm *tm, long usec)
+{
+    char timestr[128]   = { 0 };
+    uint32_t windowsize = pstate->subwinsize * pstate->files_per_window;
+
+    strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S", tm);
+    snprintf(f_name, len, "%s/%s-%ld.%u.tar", pstate->out_prefix,  timestr, usec, windowsize);
+
+    fprintf(stderr, "Setting output filename to %s.\n", f_name);
+
+    if (access(f_name, F_OK) == 0)
+    {
+        fprintf(stderr, "ERR: Output file already exists in set_output_filename: %s\n", f_name);
+        fprintf(stderr, "Not appending new data.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_output_filename(void)
+{
+    pstate->create_new_file = 0;
+    format_output_filename(pstate->f_name, sizeof(pstate->f_name), pstate->f_tm, pstate->usec);
+    pstate->findex = 0;
+}
+
+/// @brief Append one serialized matrix to a tar file, switching the writer to that file if needed.
+/// @param tw Tar writer (kept open between entries).
+/// @param f_name Tar file name.
+/// @param findex Entry number; the entry is named <findex>.grb.
+/// @param blob_data Serialized matrix.
+/// @param blob_size Size of the serialized matrix.
+void write_tar_entry(struct tar_writer *tw, const char *f_name, uint32_t findex, void *blob_data, GrB_Index blob_size)
+{
+    char entry_name[32];
+
+    if (!tar_writer_is_open(tw) || strcmp(tw->name, f_name) != 0)
+    {
+        tar_writer_close(tw, pstate->split == NULL); // -P output files are finished once the parts are appended
+        tar_writer_open(tw, f_name);
+    }
+
+    snprintf(entry_name, sizeof(entry_name), "%u.grb", findex);
+    tar_writer_add(tw, entry_name, blob_data, blob_size);
+}
+
+/// @brief Move to the next tar entry, starting a new tar file once the current one holds files_per_window matrices.
+void advance_tar_index(void)
+{
+    pstate->findex++;
+
+    if (pstate->findex >= pstate->files_per_window && !(pstate->findex > 0 && pstate->files_per_window == 1))
+        pstate->create_new_file = 1;
+}
+
+void add_blob_to_tar(void *blob_data, unsigned int blob_size)
+{
+    write_tar_entry(&pstate->tw, pstate->f_name, pstate->findex, blob_data, blob_size);
+    advance_tar_index();
+}
+
+/// @brief Build a GraphBLAS matrix from (src, dst, count) tuples and serialize it.
+/// @param R Row (source address) indices.
+/// @param C Column (destination address) indices.
+/// @param V Values (packet counts).
+/// @param nrec Number of tuples.
+/// @param blob Set to the serialized matrix, to be freed by the caller.
+/// @param blob_size Set to the size of the serialized matrix.
+void serialize_tuples(GrB_Index *R, GrB_Index *C, uint32_t *V, GrB_Index nrec, void **blob, GrB_Index *blob_size)
+{
+    GrB_Matrix Gmat;
+
+    if (pstate->anonymize == ANON_CRYPTOPAN) // Crypto-PAn: anonymize the whole subwindow in one batch
+    {
+        cryptopan_anonymize_index(pstate->cpan, R, nrec);
+        cryptopan_anonymize_index(pstate->cpan, C, nrec);
+    }
+
+    LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
+    LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, R, C, V, nrec, GrB_PLUS_UINT32));
+    if (pstate->anonymize == ANON_AFTER_AGG)
+    {
+        LAGRAPH_TRY_EXIT(ip4memo_anonymize_matrix(&pstate->memo, &Gmat));
+    }
+    LAGRAPH_TRY_EXIT(GxB_Matrix_serialize(blob, blob_size, Gmat, pstate->desc));
+
+    GrB_free(&Gmat);
+}
+
+/// @brief Build a GraphBLAS matrix from the first nrec buffered tuples, serialize it and add it to the tar file.
+/// @param nrec Number of buffered (src, dst, count) tuples.
+void build_and_store_matrix(GrB_Index nrec)
+{
+    void *blob          = NULL;
+    GrB_Index blob_size = 0;
+
+    serialize_tuples(pstate->R, pstate->C, pstate->V, nrec, &blob, &blob_size);
+
+    add_blob_to_tar(blob, blob_size);
+    free(blob);
+}
+
+/// @brief Blocking FIFO push.
+void swq_push(struct subwindow_queue *q, struct subwindow *sw)
+{
+    pthread_mutex_lock(&q->lock);
+    sw->next = NULL;
+    if (q->tail != NULL)
+        q->tail->next = sw;
+    else
+        q->head = sw;
+    q->tail = sw;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/// @brief Blocking FIFO pop.
+/// @return The oldest queued subwindow, or NULL once the queue is closed and empty.
+struct subwindow *swq_pop(struct subwindow_queue *q)
+{
+    struct subwindow *sw;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->head == NULL && !q->closed)
+        pthread_cond_wait(&q->cond, &q->lock);
+
+    if ((sw = q->head) != NULL)
+    {
+        q->head = sw->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return sw;
+}
+
+void swq_close(struct subwindow_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/// @brief GraphBLAS worker: build and serialize subwindows, then hand them to the tar writer.
+void *pipeline_worker(void *arg)
+{
+    struct pipeline *pl = (struct pipeline *)arg;
+    struct subwindow *sw;
+
+    while ((sw = swq_pop(&pl->work_q)) != NULL)
+    {
+        serialize_tuples(sw->R, sw->C, sw->V, sw->nrec, &sw->blob, &sw->blob_size);
+
+        pthread_mutex_lock(&pl->done_lock);
+        pl->done[sw->seq % pl->nslots] = sw;
+        pthread_cond_broadcast(&pl->done_cond);
+        pthread_mutex_unlock(&pl->done_lock);
+    }
+
+    return NULL;
+}
+
+/// @brief Sequencer: write serialized subwindows to their tar files in the order the reader produced them.
+void *pipeline_writer(void *arg)
+{
+    struct pipeline *pl = (struct pipeline *)arg;
+    uint64_t seq        = 0;
+
+    while (1)
+    {
+        struct subwindow *sw;
+
+        pthread_mutex_lock(&pl->done_lock);
+        while (pl->done[seq % pl->nslots] == NULL && !(pl->finished && seq == pl->next_seq))
+            pthread_cond_wait(&pl->done_cond, &pl->done_lock);
+
+        sw = pl->done[seq % pl->nslots];
+        pl->done[seq % pl->nslots] = NULL;
+        pthread_mutex_unlock(&pl->done_lock);
+
+        if (sw == NULL) // reader finished and everything has been written
+            break;
+
+        write_tar_entry(&pstate->tw, sw->f_name, sw->findex, sw->blob, sw->blob_size);
+        free(sw->blob);
+        sw->blob = NULL;
+        seq++;
+
+        swq_push(&pl->free_q, sw);
+    }
+
+    return NULL;
+}
+
+/// @brief Start the reader -> GraphBLAS workers -> tar writer pipeline.
+/// @param nworkers Number of GraphBLAS worker threads.
+void pipeline_start(uint32_t nworkers)
+{
+    struct pipeline *pl = calloc(1, sizeof(struct pipeline));
+
+    pl->nworkers = nworkers;
+    pl->nslots   = 2 * nworkers + 2; // enough for every worker to be busy while the reader fills the next one
+    pl->slots    = calloc(pl->nslots, sizeof(struct subwindow));
+    pl->done     = calloc(pl->nslots, sizeof(struct subwindow *));
+    pl->workers  = calloc(nworkers, sizeof(pthread_t));
+
+    pthread_mutex_init(&pl->free_q.lock, NULL);
+    pthread_cond_init(&pl->free_q.cond, NULL);
+    pthread_mutex_init(&pl->work_q.lock, NULL);
+    pthread_cond_init(&pl->work_q.cond, NULL);
+    pthread_mutex_init(&pl->done_lock, NULL);
+    pthread_cond_init(&pl->done_cond, NULL);
+
+    for (uint32_t i = 0; i < pl->nslots; i++)
+    {
+        struct subwindow *sw = &pl->slots[i];
+
+        sw->R = malloc(sizeof(GrB_Index) * pstate->subwinsize);
+        sw->C = malloc(sizeof(GrB_Index) * pstate->subwinsize);
+        sw->V = malloc(sizeof(uint32_t) * pstate->subwinsize);
+
+        if (sw->R == NULL || sw->C == NULL || sw->V == NULL)
+        {
+            perror("malloc failure");
+            exit(1);
+        }
+
+        swq_push(&pl->free_q, sw);
+    }
+
+    // Each worker builds its own small matrix; GraphBLAS threading inside a build only adds contention here.
+    GxB_set(GxB_NTHREADS, 1);
+
+    for (uint32_t i = 0; i < nworkers; i++)
+        pthread_create(&pl->workers[i], NULL, pipeline_worker, pl);
+    pthread_create(&pl->writer, NULL, pipeline_writer, pl);
+
+    pl->cur   = swq_pop(&pl->free_q);
+    pstate->R = pl->cur->R;
+    pstate->C = pl->cur->C;
+    pstate->V = pl->cur->V;
+
+    pstate->pipe = pl;
+    fprintf(stderr, "Pipelined mode: %u GraphBLAS worker threads, %u subwindows in flight.\n", nworkers, pl->nslots);
+}
+
+/// @brief Hand the subwindow the reader just filled to the workers and switch the reader to an empty one.
+/// @param nrec Number of tuples in the subwindow.
+void pipeline_dispatch(GrB_Index nrec)
+{
+    struct pipeline *pl  = pstate->pipe;
+    struct subwindow *sw = pl->cur;
+
+    sw->nrec   = nrec;
+    sw->seq    = pl->next_seq++;
+    sw->findex = pstate->findex;
+    snprintf(sw->f_name, sizeof(sw->f_name), "%s", pstate->f_name);
+    advance_tar_index();
+
+    swq_push(&pl->work_q, sw);
+
+    pl->cur   = swq_pop(&pl->free_q); // blocks while all subwindows are in flight
+    pstate->R = pl->cur->R;
+    pstate->C = pl->cur->C;
+    pstate->V = pl->cur->V;
+}
+
+/// @brief Drain the pipeline: wait for all dispatched subwindows to be written, then release its resources.
+void pipeline_finish(void)
+{
+    struct pipeline *pl = pstate->pipe;
+
+    swq_close(&pl->work_q);
+    for (uint32_t i = 0; i < pl->nworkers; i++)
+        pthread_join(pl->workers[i], NULL);
+
+    pthread_mutex_lock(&pl->done_lock);
+    pl->finished = 1;
+    pthread_cond_broadcast(&pl->done_cond);
+    pthread_mutex_unlock(&pl->done_lock);
+    pthread_join(pl->writer, NULL);
+
+    for (uint32_t i = 0; i < pl->nslots; i++)
+    {
+        free(pl->slots[i].R);
+        free(pl->slots[i].C);
+        free(pl->slots[i].V);
+    }
+    free(pl->slots);
+    free(pl->done);
+    free(pl->workers);
+    free(pl);
+
+    pstate->pipe = NULL;
+    pstate->R    = NULL;
+    pstate->C    = NULL;
+    pstate->V    = NULL;
+}
+
+/// @brief Emit the first nrec buffered tuples as one matrix, inline or through the pipeline.
+void flush_subwindow(GrB_Index nrec)
+{
+    if (pstate->pipe != NULL)
+        pipeline_dispatch(nrec);
+    else
+        build_and_store_matrix(nrec);
+}
+
+/// @brief Grow the R/C/V tuple buffers (single file mode, where the number of packets isn't known up front).
+void grow_buffers(void)
+{
+    uint64_t capacity = (uint64_t)pstate->capacity * 2;
+
+    if (capacity > pstate->subwinsize)
+        capacity = pstate->subwinsize;
+
+    pstate->R = realloc(pstate->R, sizeof(GrB_Index) * capacity);
+    pstate->C = realloc(pstate->C, sizeof(GrB_Index) * capacity);
+    pstate->V = realloc(pstate->V, sizeof(uint32_t) * capacity);
+
+    if (pstate->R == NULL || pstate->C == NULL || pstate->V == NULL)
+    {
+        fprintf(stderr, "ERR: Unable to grow tuple buffers to %lu entries.\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+
+    pstate->capacity = capacity;
+}
+
+/// @brief Find the IPv4 source/destination of one captured packet, anonymized as configured.
+/// @param hdr_p Capture header (captured length).
+/// @param buf_p Beginning of the captured packet data.
+/// @param srcip Set to the source address when PKT_ACCEPTED is returned.
+/// @param dstip Set to the destination address when PKT_ACCEPTED is returned.
+/// @return PKT_NOT_IP, PKT_INVALID, PKT_BROADCAST or PKT_ACCEPTED.
+static inline int extract_tuple(const struct pcap_pkthdr *hdr_p, const uint8_t *buf_p, uint32_t *srcip,
+                                uint32_t *dstip)
+{
+    struct ip *ip_hdr = NULL;
+
+    if (pstate->link_type == DLT_EN10MB)
+    {
+        if (hdr_p->caplen >= ETHER_HDR_LEN + 4) // room for a VLAN tag
+            ip_hdr = (struct ip *)find_iphdr(buf_p, hdr_p->caplen);
+    }
+    else if (pstate->link_type == DLT_RAW)
+    {
+        ip_hdr = (struct ip *)buf_p;
+    }
+
+    if (ip_hdr == NULL) // Not ETHERTYPE_IP.
+    {
+        return PKT_NOT_IP;
+    }
+
+    if ((const uint8_t *)ip_hdr + sizeof(struct ip) > buf_p + hdr_p->caplen) // Truncated IP header.
+    {
+        return PKT_INVALID;
+    }
+
+    if (ip_hdr->ip_v != IPVERSION)
+    {
+        return PKT_INVALID;
+    }
+
+    if (pstate->anonymize == ANON_CRYPTOPANT) // CryptopANT
+    {
+        *srcip = scramble_ip4(BSWAP(ip_hdr->ip_src.s_addr), 16);
+        *dstip = scramble_ip4(BSWAP(ip_hdr->ip_dst.s_addr), 16);
+    }
+    else if (pstate->anonymize == ANON_MEMO) // CryptopANT through the memo
+    {
+        *srcip = ip4memo_get(&pstate->memo, BSWAP(ip_hdr->ip_src.s_addr));
+        *dstip = ip4memo_get(&pstate->memo, BSWAP(ip_hdr->ip_dst.s_addr));
+    }
+    else if (pstate->anonymize == ANON_TABLE) // precomputed anonymization table
+    {
+        *srcip = pstate->ip4cache[BSWAP(ip_hdr->ip_src.s_addr)];
+        *dstip = pstate->ip4cache[BSWAP(ip_hdr->ip_dst.s_addr)];
+    }
+    else // no anonymization, or anonymization of the whole subwindow (CryptopANT after aggregation, Crypto-PAn)
+    {
+        *srcip = BSWAP(ip_hdr->ip_src.s_addr);
+        *dstip = BSWAP(ip_hdr->ip_dst.s_addr);
+
+        // the broadcast check applies to anonymized addresses
+        if (pstate->anonymize == ANON_AFTER_AGG || pstate->anonymize == ANON_CRYPTOPAN)
+        {
+            return (*srcip == pstate->anon_bcast || *dstip == pstate->anon_bcast) ? PKT_BROADCAST : PKT_ACCEPTED;
+        }
+    }
+
+    if (*srcip > UINT_MAX - 1 || *dstip > UINT_MAX - 1) // Global broadcasts.
+    {
+        return PKT_BROADCAST;
+    }
+
+    return PKT_ACCEPTED;
+}
+
+/// @brief Extract the IPv4 source/destination of one captured packet into the current subwindow.
+/// @param hdr_p Capture header (timestamp, captured length).
+/// @param buf_p Beginning of the captured packet data.
+void process_packet(const struct pcap_pkthdr *hdr_p, const uint8_t *buf_p)
+{
+    uint32_t srcip, dstip;
+    int res;
+
+    pstate->total_packets++;
+
+    res = extract_tuple(hdr_p, buf_p, &srcip, &dstip);
+
+    if (res == PKT_INVALID)
+    {
+        pstate->total_invalid++;
+        return;
+    }
+
+    if (res == PKT_NOT_IP)
+    {
+        return;
+    }
+
+    // Any IPv4 packet, broadcast or not, can open a new output file.
+    if (pstate->findex == 0 && pstate->rec == 0)
+    {
+        if (pstate->f_tm == NULL)
+        {
+            pstate->f_tm = localtime(&hdr_p->ts.tv_sec);
+            pstate->usec = hdr_p->ts.tv_usec;
+            if (pstate->f_name[0] == '\0')
+            {
+                set_output_filename();
+            }
+        }
+        else
+        {
+            pstate->f_tm = localtime(&hdr_p->ts.tv_sec);
+            pstate->usec = hdr_p->ts.tv_usec;
+        }
+    }
+
+    if (pstate->create_new_file == 1)
+    {
+        pstate->f_tm = localtime(&hdr_p->ts.tv_sec);
+        pstate->usec = hdr_p->ts.tv_usec;
+        set_output_filename();
+    }
+
+    if (res == PKT_BROADCAST)
+    {
+        return;
+    }
+
+    if (pstate->rec == pstate->capacity)
+    {
+        grow_buffers();
+    }
+
+    pstate->R[pstate->rec] = srcip;
+    pstate->C[pstate->rec] = dstip;
+    pstate->V[pstate->rec] = 1;
+
+    pstate->rec++;
+
+    if (pstate->rec == pstate->subwinsize)
+    {
+        flush_subwindow(pstate->subwinsize);
+        pstate->rec = 0;
+    }
+}
+
+/// @brief Read the whole input on this thread (inline or pipelined matrix construction).
+/// @param pm mmap reader, or NULL to read through libpcap.
+/// @param pcap libpcap handle, used when pm is NULL.
+/// @return Last reader status: negative on a read error.
+int convert_serial(struct pcap_mmap *pm, pcap_t *pcap)
+{
+    const uint8_t *buf_p;
+    int ret;
+
+    if (pstate->nworkers > 0)
+    {
+        pipeline_start(pstate->nworkers);
+    }
+    else
+    {
+        pstate->R = malloc(sizeof(GrB_Index) * pstate->capacity);
+        pstate->C = malloc(sizeof(GrB_Index) * pstate->capacity);
+        pstate->V = malloc(sizeof(uint32_t) * pstate->capacity);
+    }
+
+    if (pm != NULL)
+    {
+        struct pcap_pkthdr hdr;
+
+        while ((ret = pcap_mmap_next(pm, &hdr, &buf_p)) > 0)
+            process_packet(&hdr, buf_p);
+    }
+    else
+    {
+        struct pcap_pkthdr *hdr_p;
+
+        while ((ret = pcap_next_ex(pcap, &hdr_p, &buf_p)) >= 0)
+            process_packet(hdr_p, buf_p);
+
+        if (ret == -2) // 0 = packet retrieved, -1 = read error, -2 = successful EOF
+            ret = 0;
+    }
+
+    if (pstate->rec > 0)
+    {
+        if (pstate->save_trailing_packets != 0)
+        {
+            fprintf(stderr, "Adding trailing %u packets to tar file.\n", pstate->rec);
+            flush_subwindow(pstate->rec);
+        }
+        else
+        {
+            fprintf(stderr, "INFO: Not processing %u remaining packets (less than matrix size of %u).\n", pstate->rec,
+                    pstate->subwinsize);
+        }
+    }
+
+    if (pstate->pipe != NULL)
+        pipeline_finish();
+
+    tar_writer_close(&pstate->tw, 1);
+
+    free(pstate->R);
+    free(pstate->C);
+    free(pstate->V);
+
+    return ret;
+}
+
+/// @brief Check for a plausible pcap record header at pos.
+/// @param pm mmap reader (only the mapping and file parameters are used).
+/// @param pos Candidate record offset.
+/// @param ts_sec Set to the record's timestamp (seconds).
+/// @return Offset of the following record, or 0 if there's no plausible record at pos.
+static size_t pcap_mmap_check_record(const struct pcap_mmap *pm, size_t pos, uint32_t *ts_sec)
+{
+    struct pcap_record_header_raw rh;
+
+    if (pm->size - pos < sizeof(rh))
+        return 0;
+
+    memcpy(&rh, pm->base + pos, sizeof(rh));
+
+    if (pm->byteswap)
+    {
+        rh.ts_sec  = bswap_32(rh.ts_sec);
+        rh.ts_frac = bswap_32(rh.ts_frac);
+        rh.caplen  = bswap_32(rh.caplen);
+        rh.len     = bswap_32(rh.len);
+    }
+
+    if (rh.ts_frac >= (pm->nsec ? 1000000000 : 1000000))
+        return 0;
+
+    if (rh.caplen == 0 || rh.caplen > rh.len || rh.len > SPLIT_MAX_PKTLEN)
+        return 0;
+
+    if (rh.caplen > pm->snaplen && rh.caplen > 262144)
+        return 0;
+
+    if (pm->size - pos - sizeof(rh) < rh.caplen)
+        return 0;
+
+    *ts_sec = rh.ts_sec;
+
+    return pos + sizeof(rh) + rh.caplen;
+}
+
+/// @brief Find the first record boundary at or after pos: a plausible header followed by SPLIT_RESYNC_DEPTH - 1
+///        more plausible headers (or the end of the file), with timestamps no more than a day apart.
+/// @return Offset of the record boundary, or 0 if none was found before limit.
+size_t pcap_mmap_resync(const struct pcap_mmap *pm, size_t pos, size_t limit)
+{
+    for (; pos < limit; pos++)
+    {
+        size_t next     = pos;
+        uint32_t ts_sec = 0, prev_ts_sec = 0;
+        int depth;
+
+        for (depth = 0; depth < SPLIT_RESYNC_DEPTH && next < pm->size; depth++)
+        {
+            if ((next = pcap_mmap_check_record(pm, next, &ts_sec)) == 0)
+                break;
+
+            if (depth > 0 && (ts_sec > prev_ts_sec + 86400 || prev_ts_sec > ts_sec + 86400))
+                break;
+
+            prev_ts_sec = ts_sec;
+        }
+
+        if (depth == SPLIT_RESYNC_DEPTH || (depth > 0 && next == pm->size))
+            return pos;
+    }
+
+    return 0;
+}
+
+/// @brief True if the tuple with global index g is the first one in a tar file.
+static inline int split_is_file_start(uint64_t g)
+{
+    if (pstate->files_per_window == 1) // the tar file never rotates
+        return g == 0;
+
+    return g % ((uint64_t)pstate->subwinsize * pstate->files_per_window) == 0;
+}
+
+/// @brief Tar file number of subwindow s.
+static inline uint64_t split_file_of(uint64_t s)
+{
+    return pstate->files_per_window == 1 ? 0 : s / pstate->files_per_window;
+}
+
+/// @brief Entry number of subwindow s in its tar file.
+static inline uint32_t split_index_of(uint64_t s)
+{
+    return pstate->files_per_window == 1 ? s : s % pstate->files_per_window;
+}
+
+/// @brief Phase 1 of -P: count the tuples produced by the records in one byte range.
+void *split_count(void *arg)
+{
+    struct split_range *r = (struct split_range *)arg;
+    struct pcap_mmap pm   = *pstate->split->pm; // private cursor over the shared mapping
+    struct pcap_pkthdr hdr;
+    const uint8_t *buf_p;
+    uint32_t srcip, dstip;
+    int ret = 0;
+
+    pm.pos = r->start;
+
+    while (pm.pos < r->end && (ret = pcap_mmap_next(&pm, &hdr, &buf_p)) > 0)
+    {
+        int res = extract_tuple(&hdr, buf_p, &srcip, &dstip);
+
+        r->packets++;
+
+        if (res == PKT_INVALID)
+        {
+            r->invalid++;
+        }
+        else if (res == PKT_ACCEPTED)
+        {
+            r->accepted++;
+            r->tail_valid = 0;
+        }
+        else if (res == PKT_BROADCAST && r->tail_valid == 0)
+        {
+            r->tail_valid = 1;
+            r->tail_ts    = hdr.ts;
+        }
+    }
+
+    if (ret < 0 && r->end == pm.size) // truncated last record: stop there, as a serial run would
+    {
+        r->truncated = 1;
+        r->end       = pm.pos;
+    }
+    else if (pm.pos != r->end) // the next range did not begin on a record boundary
+    {
+        r->walk_error = 1;
     }
-#else
-#define TIC(clocktype, msg)
-#define TOC(clocktype, msg)
-#endif
 
-/// @brief Calculate the delta time (as a struct timespec) between two struct timespec.
-/// @param a Time #1
-/// @param b Time #2
-/// @param result struct timespec containing the elapsed time between them.
-static inline void timespec_diff(struct timespec *a, struct timespec *b, struct timespec *result)
+    return NULL;
+}
+
+/// @brief Serialize one subwindow of a -P range and append it to its tar file, or to the range's part file when
+///        the tar file was started by an earlier range.
+void split_emit(struct split_range *r, uint64_t s, GrB_Index nrec)
 {
-    result->tv_sec  = a->tv_sec - b->tv_sec;
-    result->tv_nsec = a->tv_nsec - b->tv_nsec;
-    if (result->tv_nsec < 0)
+    struct split_state *sp = pstate->split;
+    uint64_t f             = split_file_of(s);
+    uint64_t s0            = (f * pstate->files_per_window);
+    void *blob             = NULL;
+    GrB_Index blob_size    = 0;
+
+    serialize_tuples(r->R, r->C, r->V, nrec, &blob, &blob_size);
+
+    if (pstate->files_per_window == 1)
+        s0 = 0;
+
+    if (s0 >= r->s_begin)
     {
-        --result->tv_sec;
-        result->tv_nsec += 1000000000L;
+        write_tar_entry(&r->tw, sp->names[f], split_index_of(s), blob, blob_size);
+    }
+    else
+    {
+        write_tar_entry(&r->part_tw, r->part_name, split_index_of(s), blob, blob_size);
+        r->part_entries++;
     }
+
+    free(blob);
 }
 
-void usage(const char *name)
+/// @brief Name tar file f after the packet that opens it.
+static void split_name_file(uint64_t f, const struct timeval *ts)
 {
-    fprintf(stderr,
-            "usage: %s [-a anonymize.key] [-W FILES_PER_WINDOW] [-w SUBWINSIZE] [-O output_file_name] -i INPUT_FILE -o OUTPUT_DIRECTORY\n",
-            name);
-    fprintf(stderr, "    -a Anonymize using CryptopANT (https://ant.isi.edu/software/cryptopANT/index.html)\n");
-    fprintf(stderr,
-            "       If CryptoPAN anonymization keyfile does not exist, a random key will be generated and saved.\n");
-    fprintf(stderr, "    -c Path to precomputed IPv4 anonymization table (generated with makecache).\n");
-    fprintf(stderr, "    -W Number of GraphBLAS matrices to save in the output tar file.\n");
-    fprintf(stderr, "    -w Window size (number of entries) in the saved GraphBLAS matrices.\n");
-    fprintf(stderr, "    -O Single file mode - one tar file containing one GraphBLAS matrix..\n");
-    fprintf(stderr, "    -i Input file (pcap format).\n");
-    fprintf(stderr, "    -o Output directory.\n");
+    struct tm tm;
+
+    localtime_r(&ts->tv_sec, &tm);
+    format_output_filename(pstate->split->names[f], sizeof(pstate->split->names[f]), &tm, ts->tv_usec);
 }
 
-/// @brief Find the IPv4 header in a packet (look for ETHERTYPE_IP).
-/// @param base Beginning of packet Ethernet header. (uint8_t)
-/// @return Pointer to the beginning of the IPv4 header, or NULL if not found.
-const uint8_t *find_iphdr(const uint8_t *base)
+/// @brief Phase 2 of -P: build the subwindows that start in one byte range (finishing the last one past the end of
+///        the range if needed) and write them out.
+void *split_convert(void *arg)
 {
-    uint16_t ether_type = ntohs(*(uint16_t *)(base + 12));
+    struct split_range *r  = (struct split_range *)arg;
+    struct split_state *sp = pstate->split;
+    struct pcap_mmap pm    = *sp->pm;
+    struct pcap_pkthdr hdr;
+    const uint8_t *buf_p;
+    uint32_t srcip, dstip;
+    uint64_t g     = r->base;                         // global index of the next tuple
+    uint64_t first = r->s_begin * pstate->subwinsize; // first tuple this range keeps
+    uint64_t limit = r->s_end * pstate->subwinsize;   // one past the last tuple this range keeps
+    uint64_t s     = r->s_begin;
+    GrB_Index rec  = 0;
 
-    if (ether_type == ETHERTYPE_IP) // IP
+    if (r->s_begin == r->s_end)
+        return NULL;
+
+    if (limit > sp->total)
+        limit = sp->total;
+
+    r->R = malloc(sizeof(GrB_Index) * pstate->subwinsize);
+    r->C = malloc(sizeof(GrB_Index) * pstate->subwinsize);
+    r->V = malloc(sizeof(uint32_t) * pstate->subwinsize);
+
+    if (r->R == NULL || r->C == NULL || r->V == NULL)
     {
-        return base + 14;
+        perror("malloc failure");
+        exit(1);
     }
-    else if (ether_type == 0x8100) // VLAN
+
+    tar_writer_init(&r->tw);
+    tar_writer_init(&r->part_tw);
+
+    // If a tar file starts exactly at this range's first tuple, an IPv4 broadcast trailing an earlier range may
+    // have opened it.
+    if (split_is_file_start(g) && g == first)
     {
-        ether_type = ntohs(*(uint16_t *)(base + 16));
+        int cand = -1;
+
+        for (int j = r->id - 1; j >= 0; j--)
+        {
+            if (sp->ranges[j].tail_valid)
+                cand = j;
+            if (sp->ranges[j].accepted > 0)
+                break;
+        }
 
-        if (ether_type == ETHERTYPE_IP)
+        if (cand >= 0)
         {
-            return base + 18;
+            split_name_file(split_file_of(s), &sp->ranges[cand].tail_ts);
+            r->named = g;
         }
     }
 
-    return NULL;
-}
+    pm.pos = r->start;
 
-void set_output_filename(void)
-{
-    char timestr[128]   = { 0 };
-    uint32_t windowsize = pstate->subwinsize * pstate->files_per_window;
+    while (g < limit && (pm.pos < r->end || rec > 0) && pcap_mmap_next(&pm, &hdr, &buf_p) > 0)
+    {
+        int res = extract_tuple(&hdr, buf_p, &srcip, &dstip);
 
-    pstate->create_new_file = 0;
-    strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S", pstate->f_tm);
-    snprintf(pstate->f_name, sizeof(pstate->f_name), "%s/%s-%ld.%u.tar", pstate->out_prefix,  timestr, pstate->usec, windowsize);
+        if (res < PKT_BROADCAST)
+            continue;
+
+        if (g >= first && split_is_file_start(g) && r->named != g)
+        {
+            split_name_file(split_file_of(g / pstate->subwinsize), &hdr.ts);
+            r->named = g;
+        }
+
+        if (res == PKT_BROADCAST)
+            continue;
 
-    fprintf(stderr, "Setting output filename to %s.\n", pstate->f_name);
+        if (g++ < first)
+            continue;
+
+        r->R[rec] = srcip;
+        r->C[rec] = dstip;
+        r->V[rec] = 1;
+
+        if (++rec == pstate->subwinsize)
+        {
+            split_emit(r, s++, rec);
+            rec = 0;
+        }
+    }
 
-    if (access(pstate->f_name, F_OK) == 0)
+    if (rec > 0) // only the last range, with -O style trailing packets
     {
-        fprintf(stderr, "ERR: Output file already exists in set_output_filename: %s\n", pstate->f_name);
-        fprintf(stderr, "Not appending new data.\n");
-        exit(EXIT_FAILURE);
+        split_emit(r, s++, rec);
     }
 
-    pstate->findex = 0;
+    tar_writer_close(&r->tw, 0);
+    tar_writer_close(&r->part_tw, 0);
+
+    free(r->R);
+    free(r->C);
+    free(r->V);
+
+    return NULL;
 }
 
-void add_blob_to_tar(void *blob_data, unsigned int blob_size)
+/// @brief Append a part file to the end of a tar file and remove it.
+static void split_append_part(const char *part_name, struct tar_writer *tw)
 {
-    int tarfd;
-    struct posix_tar_header th  = { 0 }; // let's make a tar file, or close enough
-    const unsigned char *th_ptr = (const unsigned char *)&th;
-    size_t tmp_chksum           = 0;
-    size_t aligned;
+    char buf[1 << 16];
+    ssize_t n;
+    int in_fd;
 
-    if ((tarfd = open(pstate->f_name, O_CREAT | O_WRONLY | O_APPEND, 0660)) == -1)
+    if ((in_fd = open(part_name, O_RDONLY)) == -1)
     {
         perror("open tar");
         exit(1);
     }
 
-    sprintf(th.name, "%d.grb", pstate->findex);
-    sprintf(th.uid, "%06o ", 0);
-    sprintf(th.gid, "%06o ", 0);
-    sprintf(th.size, "%011o", blob_size);
-    sprintf(th.mode, "%06o", 0644);
-    sprintf(th.magic, "%s", TMAGIC);
-    sprintf(th.mtime, "%011o", (unsigned int)time(NULL));
-    th.typeflag = '0';
-    memset(th.chksum, ' ', 8); // or checksum computed below will be wrong!
+    while ((n = read(in_fd, buf, sizeof(buf))) > 0)
+        tar_writer_add_raw(tw, buf, n);
+
+    close(in_fd);
+    unlink(part_name);
+}
+
+/// @brief Intra-file parallel conversion (-P): split the mapped input into byte ranges at record boundaries,
+///        count each range's tuples in parallel, then build each range's subwindows in parallel.  Window numbering,
+///        tar file names and contents match a serial run.
+/// @param pm mmap reader over the whole input.
+/// @param nranges Requested number of ranges (threads).
+/// @return 0 on success, -1 if the input could not be split (nothing has been written; process it serially).
+int split_run(struct pcap_mmap *pm, uint32_t nranges)
+{
+    struct split_state *sp = calloc(1, sizeof(struct split_state));
+    size_t data            = pm->size - sizeof(struct pcap_file_header_raw);
+    pthread_t *threads;
+    uint64_t base = 0, nsub;
+    uint32_t k, n = 0;
 
-    for (int b = 0; b < sizeof(struct posix_tar_header); b++)
-        tmp_chksum += th_ptr[b];
+    if (nranges > data / SPLIT_MIN_RANGE)
+        nranges = data / SPLIT_MIN_RANGE;
 
-    sprintf(th.chksum, "%06o ", (unsigned int)tmp_chksum);
+    if (nranges < 2)
+    {
+        free(sp);
+        return -1;
+    }
 
-    if (write(tarfd, &th, sizeof(th)) != sizeof(th))
+    // extract_tuple() runs on every range's thread: per-record CryptopANT (scramble_ip4()) is not thread safe.
+    if (pstate->anonymize == ANON_CRYPTOPANT)
     {
-        perror("write tar error");
-        exit(4);
+        fprintf(stderr, "WARN: -a without -A or -m is not thread safe, falling back to serial mode.\n");
+        free(sp);
+        return -1;
     }
 
-    if (write(tarfd, blob_data, blob_size) != blob_size)
+    sp->pm        = pm;
+    sp->ranges    = calloc(nranges, sizeof(struct split_range));
+    threads       = calloc(nranges, sizeof(pthread_t));
+    pstate->split = sp;
+
+    // Range boundaries: resynchronize each nominal split point on the next record header.
+    sp->ranges[n++].start = pm->pos;
+    for (k = 1; k < nranges; k++)
     {
-        perror("write tar error");
-        exit(4);
+        size_t nominal = sizeof(struct pcap_file_header_raw) + data / nranges * k;
+        size_t start   = pcap_mmap_resync(pm, nominal, pm->size);
+
+        if (start > sp->ranges[n - 1].start)
+            sp->ranges[n++].start = start;
     }
 
-    aligned = (sizeof(th) + blob_size) % 512; // pad output file to 512 byte alignment
-    if (aligned != 0)
+    for (k = 0; k < n; k++)
     {
-        const unsigned char padblock[512] = { 0 };
+        sp->ranges[k].id  = k;
+        sp->ranges[k].end = (k + 1 < n) ? sp->ranges[k + 1].start : pm->size;
+    }
+    sp->nranges = n;
+
+    fprintf(stderr, "Split mode: %u byte ranges.\n", n);
+
+    for (k = 0; k < n; k++)
+        pthread_create(&threads[k], NULL, split_count, &sp->ranges[k]);
+    for (k = 0; k < n; k++)
+        pthread_join(threads[k], NULL);
 
-        if (write(tarfd, padblock, 512 - aligned) != 512 - aligned)
+    // Every range must walk cleanly before any count is kept: on fallback, the serial pass counts them all again.
+    for (k = 0; k < n; k++)
+    {
+        if (sp->ranges[k].walk_error)
         {
-            perror("write tar error");
-            exit(4);
+            fprintf(stderr, "WARN: byte range %u did not end on a record boundary, falling back to serial mode.\n", k);
+            free(sp->ranges);
+            free(threads);
+            free(sp);
+            pstate->split = NULL;
+            return -1;
         }
     }
 
-    close(tarfd);
+    for (k = 0; k < n; k++)
+    {
+        sp->ranges[k].base = base;
+        base += sp->ranges[k].accepted;
+        pstate->total_packets += sp->ranges[k].packets;
+        pstate->total_invalid += sp->ranges[k].invalid;
+    }
+    sp->total = base;
 
-    pstate->findex++;
+    // Subwindow s belongs to the range holding its first tuple.
+    nsub = sp->total / pstate->subwinsize;
+    if (pstate->save_trailing_packets && sp->total % pstate->subwinsize)
+        nsub++;
 
-    if (pstate->findex >= pstate->files_per_window && !(pstate->findex > 0 && pstate->files_per_window == 1))
-        pstate->create_new_file = 1;
+    for (k = 0; k < n; k++)
+    {
+        struct split_range *r = &sp->ranges[k];
+        uint64_t s_begin      = (r->base + pstate->subwinsize - 1) / pstate->subwinsize;
+
+        r->s_begin = s_begin < nsub ? s_begin : nsub;
+        r->named   = UINT64_MAX;
+        snprintf(r->part_name, sizeof(r->part_name), "%s/.pcap2grb.%d.%u.part", pstate->out_prefix, getpid(), k);
+        unlink(r->part_name); // stale
+        if (k > 0)
+            sp->ranges[k - 1].s_end = r->s_begin;
+    }
+    sp->ranges[n - 1].s_end = nsub;
+
+    sp->names = calloc(split_file_of(nsub) + 1, sizeof(*sp->names));
+
+    // Each worker builds its own small matrices.
+    GxB_set(GxB_NTHREADS, 1);
+
+    for (k = 0; k < n; k++)
+        pthread_create(&threads[k], NULL, split_convert, &sp->ranges[k]);
+    for (k = 0; k < n; k++)
+        pthread_join(threads[k], NULL);
+
+    // Stitch: entries a range wrote for a tar file started by an earlier range go after that range's entries.
+    for (uint64_t f = 0; nsub > 0 && f <= split_file_of(nsub - 1); f++)
+    {
+        struct tar_writer tw;
+
+        tar_writer_init(&tw);
+        tar_writer_open(&tw, sp->names[f]);
+
+        for (k = 0; k < n; k++)
+        {
+            struct split_range *r = &sp->ranges[k];
+
+            if (r->part_entries > 0 && split_file_of(r->s_begin) == f)
+                split_append_part(r->part_name, &tw);
+        }
+
+        tar_writer_close(&tw, 1);
+    }
+
+    if (sp->total % pstate->subwinsize && !pstate->save_trailing_packets)
+    {
+        fprintf(stderr, "INFO: Not processing %lu remaining packets (less than matrix size of %u).\n",
+                sp->total % pstate->subwinsize, pstate->subwinsize);
+    }
+
+    if (sp->ranges[n - 1].truncated)
+    {
+        pm->pos = sp->ranges[n - 1].end;
+        fprintf(stderr, "pcap mmap reader: truncated or corrupt record at offset %zu\n", pm->pos);
+    }
+
+    free(sp->names);
+    free(sp->ranges);
+    free(threads);
+    free(sp);
+    pstate->split = NULL;
+
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
     FILE *in;
     char in_f[PATH_MAX] = {0}, anonkey[PATH_MAX] = {0}, cachefile[PATH_MAX] = {0};
+    char *cachemode = NULL; // -M
+    char *memofile = NULL;  // -m
+    long memo_loaded;
+    size_t cachelen = 0;
     pcap_t *pcap;
     char errbuf[PCAP_ERRBUF_SIZE] = {0};
     char *value = NULL;      // for getopt
     int c, ret, reqargs = 0; // for getopt
-    size_t filesize, filepos;
+    size_t filesize;
     struct timespec ts_start;
     double t_elapsed = 0;
 
-    const uint8_t *buf_p;
-    struct pcap_pkthdr *hdr_p;
+    struct pcap_mmap pm;
+    int use_mmap = 0, use_libpcap = 0, defer_anon = 0;
+    int anon_opts = 0; // -a, -c and -k given
 
     pstate                   = calloc(1, sizeof(struct px3_state));
     pstate->f_tm             = NULL;
     pstate->subwinsize       = SUBWINSIZE; // 131072
     pstate->files_per_window = 64;         // 64 x 131072 = 8388608 (default)
+    tar_writer_init(&pstate->tw);
 
-    while ((c = getopt(argc, argv, "SO:va:c:i:o:w:W:")) != -1)
+    while ((c = getopt(argc, argv, "ASO:va:c:i:k:lm:M:o:P:T:w:W:")) != -1)
     {
         switch (c)
         {
+            case 'A':
+                defer_anon = 1;
+                break;
             case 'a':
                 value             = optarg;
-                pstate->anonymize = 1;
+                anon_opts++;
+                pstate->anonymize = ANON_CRYPTOPANT;
                 snprintf(anonkey, sizeof(anonkey), "%s", value);
                 break;
             case 'c':
                 snprintf(cachefile, sizeof(cachefile) - 1, "%s", optarg);
-                pstate->anonymize = 2;
+                anon_opts++;
+                pstate->anonymize = ANON_TABLE;
+                break;
+            case 'k':
+                snprintf(anonkey, sizeof(anonkey), "%s", optarg);
+                anon_opts++;
+                pstate->anonymize = ANON_CRYPTOPAN;
                 break;
             case 'i':
                 // input
@@ -301,6 +1473,15 @@ int main(int argc, char *argv[])
                 reqargs++;
                 snprintf(in_f, sizeof(in_f), "%s", value);
                 break;
+            case 'l':
+                use_libpcap = 1;
+                break;
+            case 'm':
+                memofile = optarg;
+                break;
+            case 'M':
+                cachemode = optarg;
+                break;
             case 'S':
                 pstate->swapped = 1;
                 break;
@@ -320,6 +1501,22 @@ int main(int argc, char *argv[])
                     strncpy(pstate->f_name, optarg, sizeof(pstate->f_name) - 1);
                 }
                 break;
+            case 'P':
+                // byte ranges converted in parallel
+                if (sscanf(optarg, "%u", &pstate->nranges) != 1)
+                {
+                    fprintf(stderr, "Invalid argument to option -%c.\n", optopt);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                // GraphBLAS worker threads
+                if (sscanf(optarg, "%u", &pstate->nworkers) != 1)
+                {
+                    fprintf(stderr, "Invalid argument to option -%c.\n", optopt);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'W':
                 // files per window
                 if (sscanf(optarg, "%u", &pstate->files_per_window) != 1)
@@ -348,7 +1545,7 @@ int main(int argc, char *argv[])
                 break;
             case '?':
                 if (optopt == 'i' || optopt == 'o' || optopt == 'a' || optopt == 'c' || optopt == 'w' ||
-                    optopt == 'W' || optopt == 'O')
+                    optopt == 'W' || optopt == 'O' || optopt == 'T' || optopt == 'P' || optopt == 'M')
                 {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 }
@@ -367,6 +1564,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (anon_opts > 1)
+    {
+        fprintf(stderr, "-a, -c and -k are mutually exclusive: use one anonymization method.\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (reqargs < 2 || in_f[0] == 0 )
     {
         fprintf(stderr, "Invalid or insufficient arguments.\n");
@@ -374,7 +1577,7 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    if (pstate->anonymize == 1)
+    if (pstate->anonymize == ANON_CRYPTOPANT)
     {
         fprintf(stderr, "anonymizing using scramble keyfile: %s\n", anonkey);
         if (scramble_init_from_file(anonkey, SCRAMBLE_BLOWFISH, SCRAMBLE_BLOWFISH, NULL) < 0)
@@ -382,33 +1585,62 @@ int main(int argc, char *argv[])
             fprintf(stderr, "scramble_init_from_file(): nope\n");
             return 1;
         }
-    }
-    else if (pstate->anonymize == 2)
-    {
-        FILE *fp;
-        size_t filesize = 0, ret = 0;
 
-        fprintf(stderr, "loading anonymization table: %s\n", cachefile);
-        pstate->ip4cache = malloc(sizeof(uint32_t) * (UINT_MAX - 1));
-
-        if ((fp = fopen(cachefile, "rb")) == NULL)
+        // CryptopANT is not thread safe: -P workers go through the (locked) memo.
+        if (defer_anon == 0 && memofile == NULL && pstate->nranges > 1)
         {
-            perror("fopen");
-            return 1;
+            fprintf(stderr, "INFO: -P anonymizes after aggregation (-A).\n");
+            defer_anon = 1;
         }
 
-        fseek(fp, 0L, SEEK_END);
-        filesize = ftell(fp);
-        fseek(fp, 0L, SEEK_SET);
-        fprintf(stderr, "table is %ld bytes\n", filesize);
+        if (defer_anon)
+        {
+            fprintf(stderr, "anonymizing after aggregation\n");
+            pstate->anonymize  = ANON_AFTER_AGG;
+            pstate->anon_bcast = unscramble_ip4(UINT_MAX, 16);
+        }
+        else if (memofile != NULL)
+        {
+            fprintf(stderr, "anonymizing through memo: %s\n", memofile);
+            pstate->anonymize = ANON_MEMO;
+        }
 
-        if ((ret = fread(pstate->ip4cache, filesize, 1, fp)) < 1)
+        if (pstate->anonymize != ANON_CRYPTOPANT)
+        {
+            ip4memo_init(&pstate->memo, IP4MEMO_DEFAULT_BITS);
+            if (memofile != NULL && (memo_loaded = ip4memo_load(&pstate->memo, memofile)) > 0)
+                fprintf(stderr, "loaded %ld addresses from memo\n", memo_loaded);
+        }
+    }
+    else if (pstate->anonymize == ANON_TABLE)
+    {
+        fprintf(stderr, "mapping anonymization table: %s\n", cachefile);
+        pstate->ip4cache = ip4cache_map(cachefile, cachemode, &cachelen);
+    }
+    else if (pstate->anonymize == ANON_CRYPTOPAN)
+    {
+        fprintf(stderr, "anonymizing using Crypto-PAn keyfile: %s\n", anonkey);
+        if ((pstate->cpan = malloc(sizeof(struct cryptopan))) == NULL)
+        {
+            perror("malloc failure");
+            exit(1);
+        }
+        if (cryptopan_init_from_file(pstate->cpan, anonkey, 16) < 0) // preserve 16 upper bits, like -a
         {
-            perror("fread");
             return 1;
         }
+        pstate->anon_bcast = cryptopan_deanonymize(pstate->cpan, UINT_MAX);
+    }
+
+    if (defer_anon && pstate->anonymize != ANON_AFTER_AGG)
+    {
+        fprintf(stderr, "INFO: -A only applies to CryptopANT anonymization (-a), ignoring -A.\n");
+    }
 
-        fclose(fp);
+    if (memofile != NULL && pstate->anonymize != ANON_AFTER_AGG && pstate->anonymize != ANON_MEMO)
+    {
+        fprintf(stderr, "INFO: -m only applies to CryptopANT anonymization (-a), ignoring -m.\n");
+        memofile = NULL;
     }
 
     if (!strcmp(in_f, "-"))
@@ -428,184 +1660,102 @@ int main(int argc, char *argv[])
         fseek(in, 0L, SEEK_SET);
         fprintf(stderr, "input pcap file is %ld bytes\n", filesize);
         fflush(stderr);
+
+        // Zero-copy path: walk the records in place.  Anything it doesn't understand goes through libpcap.
+        if (use_libpcap == 0 && pcap_mmap_open(&pm, in_f) == 0)
+        {
+            use_mmap = 1;
+        }
     }
 
-    if ((pcap = pcap_fopen_offline(in, errbuf)) == NULL)
+    if (use_mmap)
     {
-        fprintf(stderr, "Error in opening pipefd for reading: %s\n", errbuf);
-        fflush(stderr);
-        return 1;
+        pstate->link_type = pm.link_type;
+        fprintf(stderr, "input pcap file is of type %s (mmap reader, %s timestamps%s)\n",
+                pcap_datalink_val_to_name(pstate->link_type), pm.nsec ? "nsec" : "usec",
+                pm.byteswap ? ", byte-swapped" : "");
+    }
+    else
+    {
+        if ((pcap = pcap_fopen_offline(in, errbuf)) == NULL)
+        {
+            fprintf(stderr, "Error in opening pipefd for reading: %s\n", errbuf);
+            fflush(stderr);
+            return 1;
+        }
+
+        pstate->link_type = pcap_datalink(pcap);
+        fprintf(stderr, "input pcap file is of type %s\n", pcap_datalink_val_to_name(pstate->link_type));
     }
 
     if( pstate->out_prefix == NULL )
         pstate->out_prefix = strdup(".");
 
-    pstate->link_type = pcap_datalink(pcap);
-    fprintf(stderr, "input pcap file is of type %s\n", pcap_datalink_val_to_name(pstate->link_type));
     GrB_init(GrB_NONBLOCKING);
 
-    GrB_Matrix Gmat;
-    GrB_Descriptor desc = NULL;
-
-    if( pstate->subwinsize == UINT_MAX )
+    if (pstate->subwinsize == UINT_MAX)
     {
-        int packets_in_file = 0;
-        long pos = ftell(pcap_file(pcap));
-
-        while( (ret = pcap_next_ex(pcap, &hdr_p, &buf_p)) >= 0 )
-            packets_in_file++;
-
-        fseek(pcap_file(pcap), pos, SEEK_SET);
-        pstate->subwinsize = packets_in_file;
-        fprintf(stderr, "Single file mode, %d packets in pcap file.\n", pstate->subwinsize);
+        // Single file mode: one pass over the input, tuple buffers grow as packets arrive.
+        pstate->capacity = SUBWINSIZE;
+        fprintf(stderr, "Generating one tar file with one matrix of all packets in the input.\n");
+    }
+    else
+    {
+        pstate->capacity = pstate->subwinsize;
+        fprintf(stderr, "Generating tar files with %u matrices of size: %u\n", pstate->files_per_window,
+                pstate->subwinsize);
     }
 
-    fprintf(stderr, "Generating tar files with %u matrices of size: %u\n", pstate->files_per_window,
-            pstate->subwinsize);
+    GrB_Descriptor_new(&pstate->desc);
+    GxB_Desc_set(pstate->desc, GxB_COMPRESSION, GxB_COMPRESSION_ZSTD + 1);
 
-    pstate->R = malloc(sizeof(GrB_Index) * pstate->subwinsize);
-    pstate->C = malloc(sizeof(GrB_Index) * pstate->subwinsize);
-    pstate->V = malloc(sizeof(uint32_t) * pstate->subwinsize);
+    if (pstate->nworkers > 0 && pstate->subwinsize == UINT_MAX)
+    {
+        fprintf(stderr, "INFO: Single file mode builds one matrix, ignoring -T.\n");
+        pstate->nworkers = 0;
+    }
 
-    GrB_Descriptor_new(&desc);
-    GxB_Desc_set(desc, GxB_COMPRESSION, GxB_COMPRESSION_ZSTD + 1);
+    if (pstate->nranges > 1 && (use_mmap == 0 || pstate->subwinsize == UINT_MAX))
+    {
+        fprintf(stderr, "INFO: -P needs an mmap'd input file and is not used in single file mode, ignoring -P.\n");
+        pstate->nranges = 0;
+    }
 
     TIC(CLOCK_REALTIME, "pcap begin");
 
-    while ((ret = pcap_next_ex(pcap, &hdr_p, &buf_p)) >= 0)
+    if (pstate->nranges > 1 && split_run(&pm, pstate->nranges) == 0)
     {
-        pstate->total_packets++;
-        struct ip *ip_hdr = NULL;
-
-        if (pstate->link_type == DLT_EN10MB)
-        {
-            const struct ether_header *eth_hdr = (struct ether_header *)buf_p;
-            ip_hdr                             = (struct ip *)find_iphdr(buf_p);
-        }
-        else if (pstate->link_type == DLT_RAW)
-        {
-            ip_hdr = (struct ip *)buf_p;
-        }
-
-        if (ip_hdr == NULL) // Not ETHERTYPE_IP.
-        {
-            continue;
-        }
+        ret = 0;
+    }
+    else
+    {
+        ret = convert_serial(use_mmap ? &pm : NULL, pcap);
 
-        if (ip_hdr->ip_v == IPVERSION)
+        if (use_mmap && ret == -1)
         {
-            uint32_t srcip, dstip;
-
-            if (pstate->findex == 0 && pstate->rec == 0)
-            {
-                if (pstate->f_tm == NULL)
-                {
-                    pstate->f_tm = localtime(&hdr_p->ts.tv_sec);
-                    pstate->usec = hdr_p->ts.tv_usec;
-                    if (pstate->f_name[0] == '\0')
-                    {
-                        set_output_filename();
-                    }
-                }
-                else
-                {
-                    pstate->f_tm = localtime(&hdr_p->ts.tv_sec);
-                    pstate->usec = hdr_p->ts.tv_usec;
-                }
-            }
-            
-            if( pstate->create_new_file == 1 )
-            {
-                pstate->f_tm = localtime(&hdr_p->ts.tv_sec);
-                pstate->usec = hdr_p->ts.tv_usec;
-                set_output_filename();
-            }
-
-            if (pstate->anonymize == 1) // CryptopANT
-            {
-                srcip = scramble_ip4(BSWAP(ip_hdr->ip_src.s_addr), 16);
-                dstip = scramble_ip4(BSWAP(ip_hdr->ip_dst.s_addr), 16);
-            }
-            else if (pstate->anonymize == 2) // precomputed anonymization table
-            {
-                srcip = pstate->ip4cache[BSWAP(ip_hdr->ip_src.s_addr)];
-                dstip = pstate->ip4cache[BSWAP(ip_hdr->ip_dst.s_addr)];
-            }
-            else // no anonymization
-            {
-                srcip = BSWAP(ip_hdr->ip_src.s_addr);
-                dstip = BSWAP(ip_hdr->ip_dst.s_addr);
-            }
-
-            if (srcip > UINT_MAX - 1 || dstip > UINT_MAX - 1) // Global broadcasts.
-            {
-                continue;
-            }
-
-            pstate->R[pstate->rec] = srcip;
-            pstate->C[pstate->rec] = dstip;
-            pstate->V[pstate->rec] = 1;
-
-            pstate->rec++;
+            fprintf(stderr, "pcap mmap reader: truncated or corrupt record at offset %zu\n", pm.pos);
         }
-        else
-            pstate->total_invalid++;
-
-        if (pstate->rec == pstate->subwinsize)
+        else if (!use_mmap && ret == -1)
         {
-            void *blob          = NULL;
-            GrB_Index blob_size = 0;
-
-            LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
-            LAGRAPH_TRY_EXIT(
-                GrB_Matrix_build(Gmat, pstate->R, pstate->C, pstate->V, pstate->subwinsize, GrB_PLUS_UINT32));
-            LAGRAPH_TRY_EXIT(GxB_Matrix_serialize(&blob, &blob_size, Gmat, desc));
-
-            add_blob_to_tar(blob, blob_size);
-            free(blob);
-
-            GrB_free(&Gmat);
-            pstate->rec = 0;
+            fprintf(stderr, "pcap_next_ex error: %s\n", pcap_geterr(pcap));
         }
     }
 
     TOC(CLOCK_REALTIME, "pcap process");
 
-    if (ret == -1) // 0 = packet retrieved, -1 = read error, -2 = successful EOF
-    {
-        fprintf(stderr, "pcap_next_ex error: %s\n", pcap_geterr(pcap));
-    }
-
-    if (pstate->rec > 0)
+    fprintf(stderr, "Done: %ld packets.  (%.2f pps)\n", pstate->total_packets, pstate->total_packets / t_elapsed);
+    if (pstate->anonymize == ANON_AFTER_AGG || pstate->anonymize == ANON_MEMO)
     {
-        if (pstate->save_trailing_packets != 0)
-        {
-            void *blob          = NULL;
-            GrB_Index blob_size = 0;
-
-            LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
-            LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, pstate->R, pstate->C, pstate->V, pstate->rec, GrB_PLUS_UINT32));
-            LAGRAPH_TRY_EXIT(GxB_Matrix_serialize(&blob, &blob_size, Gmat, desc));
-
-            fprintf(stderr, "Adding trailing %u packets to tar file.\n", pstate->rec);
-
-            add_blob_to_tar(blob, blob_size);
-            free(blob);
-
-            GrB_free(&Gmat);
-        }
-        else
-        {
-            fprintf(stderr, "INFO: Not processing %u remaining packets (less than matrix size of %u).\n", pstate->rec,
-                    pstate->subwinsize);
-        }
+        fprintf(stderr, "Anonymized %lu new addresses (%zu in memo).\n", pstate->memo.misses,
+                ip4memo_count(&pstate->memo));
+        if (memofile != NULL && (memo_loaded = ip4memo_save(&pstate->memo, memofile)) >= 0)
+            fprintf(stderr, "saved %ld addresses to memo: %s\n", memo_loaded, memofile);
+        ip4memo_free(&pstate->memo);
     }
-
-    filepos = ftell(in);
-    fprintf(stderr, "Done: %ld packets.  (%.2f pps)\n", pstate->total_packets, pstate->total_packets / t_elapsed);
+    if (use_mmap)
+        pcap_mmap_close(&pm);
     fclose(in);
-    free(pstate->R);
-    free(pstate->C);
-    free(pstate->V);
+    ip4cache_unmap(pstate->ip4cache, cachelen);
+    free(pstate->cpan);
     exit(0);
 }
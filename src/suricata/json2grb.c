@@ -8,7 +8,11 @@
 #include <unistd.h>
 // #include <limits.h>
 // #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 // #include <sys/wait.h>
@@ -30,6 +34,10 @@
 #include <GraphBLAS.h>
 // #include "cJSON.h"
 #include "cryptopANT.h"
+#include "cryptopan.h"
+#include "eveflow.h"
+#include "ip4memo.h"
+#include "tarwriter.h"
 #include "yyjson.h"
 // #include "common.h"
 #include <signal.h>
@@ -38,6 +46,11 @@
 #define WINDOWSIZE (1 << 23)   // Packets per output tar file
 #define SUBWINSIZE (1 << 17)   // Packets per GraphBLAS matrix file (.grb)
 #define BUFFERSIZE 1024 * 1024 // 1MB input buffer size when processing files of json flow records
+#define MAXLINE    (BUFFERSIZE - 3) // longest record kept: room for its newline, a newline a datagram lacks and the NUL
+#define CHUNKSIZE  (16 << 20)  // -P: bytes of input (whole lines) parsed by a thread at a time
+#define READ_FLAGS YYJSON_READ_STOP_WHEN_DONE
+#define ARENABATCH (256 * 1024) // yyjson arena bytes filled before it is reset, so it stays in cache
+#define MAXEVENTS  64           // socket events handled per epoll_wait()
 
 #define BSWAP(a)   (pstate->swapped ? ntohl(a) : (a))
 
@@ -90,38 +103,25 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b, struct
     }
 }
 
-// Support for minimal output tar file creation
-struct posix_tar_header
-{                       /* byte offset */
-    char name[100];     /*   0 */
-    char mode[8];       /* 100 */
-    char uid[8];        /* 108 */
-    char gid[8];        /* 116 */
-    char size[12];      /* 124 */
-    char mtime[12];     /* 136 */
-    char chksum[8];     /* 148 */
-    char typeflag;      /* 156 */
-    char linkname[100]; /* 157 */
-    char magic[6];      /* 257 */
-    char version[2];    /* 263 */
-    char uname[32];     /* 265 */
-    char gname[32];     /* 297 */
-    char devmajor[8];   /* 329 */
-    char devminor[8];   /* 337 */
-    char prefix[155];   /* 345 */
-                        /* 500 */
-    char padding1[12];  /* 512 */
+/// @brief Bump allocator for yyjson documents, one per parsing thread.  Records are parsed into it one after the
+///        other and nothing is freed: it is reset once ARENABATCH bytes are used, or when the next record might
+///        not fit.
+struct yyjson_arena
+{
+    yyjson_alc alc;
+    char *buf;
+    size_t size;
+    size_t used;
+    size_t last;      // offset of the latest allocation, which realloc() grows in place
+    uint64_t docs;    // records parsed in the arena
+    uint64_t resets;  // times it was emptied
+    uint64_t on_heap; // records too large for the arena, parsed with malloc()
 };
 
-#define TMAGIC   "ustar" /* ustar and a null */
-#define TMAGLEN  6
-#define TVERSION "00" /* 00 and no null */
-#define TVERSLEN 2
-
 // Global state structure
 struct px3_state
 {
-    unsigned int anonymize;
+    enum anon_mode anonymize;
     unsigned int binary;
     unsigned int swapped;
     unsigned int rec;
@@ -130,6 +130,7 @@ struct px3_state
     char *out_prefix;
     char f_name[PATH_MAX];
     int findex;
+    struct tar_writer tw; // open output tar file
     bool wait;
     GrB_Index *R, *C;
     uint32_t *V;
@@ -138,24 +139,72 @@ struct px3_state
     uint32_t subwinsize;
     double t_grb;
     double t_json;
+    unsigned int yyjson_only; // -Y: no flow scanner
+    uint64_t scan_fallbacks;  // records the flow scanner left to yyjson
+    struct yyjson_arena arena; // main thread's; -P workers have their own
+    struct ip4memo memo; // anonymize == ANON_AFTER_AGG or ANON_MEMO
+    struct cryptopan *cpan; // anonymize == ANON_CRYPTOPAN
 };
 
 struct px3_state *pstate; // global state
 
+/// @brief Addresses and packet counts of one flow record, in the order add_packets() takes them.
+struct flow_tuple
+{
+    in_addr_t src_saddr, dst_saddr;
+    uint32_t pkts_toserver, pkts_toclient;
+};
+
+/// @brief One chunk of the input in parallel mode (-P): whole lines, parsed by a worker into flow tuples.
+struct json_chunk
+{
+    uint64_t seq; // position of the chunk in the input
+    const char *start, *end;
+    struct flow_tuple *tuples;
+    size_t ntuples, size;
+    uint64_t records;
+    double t_json;
+    int ready; // parsed, waiting to be merged
+};
+
+/// @brief Shared state of parallel mode (-P).
+struct json_split
+{
+    const char *base; // mapped input file
+    size_t size;
+    size_t pos;        // start of the next chunk to hand out
+    uint64_t next_seq; // next chunk to hand out
+    uint64_t merged;   // chunks merged so far; a chunk's slot is reused once it is merged
+    uint32_t nthreads;
+    uint32_t nslots;
+    struct json_chunk *slots; // indexed by seq % nslots
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+};
+
 void usage(const char *name)
 {
 //                   12345678901234567890123456789012345678901234567890123456789012345678901234567890
-    fprintf(stderr, "usage: %s [-a anonymize.key] [-b[i][o]] [-O] [-o OUTPUT_DIRECTORY] [-S] [-s] [-t TMPDIR] [-W FILES_PER_WINDOW] [-w SUBWINSIZE] -i INPUT_FILE\n", name);
+    fprintf(stderr, "usage: %s [-a anonymize.key [-A] [-m MEMO_FILE] | -k cryptopan.key] [-B ITERS] [-b[i][o]] [-O] [-o OUTPUT_DIRECTORY] [-P THREADS] [-S] [-s[TYPE]] [-t TMPDIR] [-W FILES_PER_WINDOW] [-w SUBWINSIZE] [-Y] -i INPUT_FILE\n", name);
     fprintf(stderr, "\n");
     fprintf(stderr, "    -a Anonymize using CryptopANT (https://ant.isi.edu/software/cryptopANT/index.html)\n");
     fprintf(stderr, "       If CryptoPAN anonymization keyfile does not exist, a random key will be generated and saved.\n");
+    fprintf(stderr, "    -A With -a, build each matrix on raw addresses, then anonymize each distinct address once.\n");
+    fprintf(stderr, "    -m With -a, memoize anonymized addresses, loaded from and saved to MEMO_FILE (warm restarts).\n");
+    fprintf(stderr, "    -k Anonymize using Crypto-PAn (AES-128), a batch per matrix; the key file (32 bytes) is created if\n");
+    fprintf(stderr, "       it does not exist.  Not the same mapping as -a.\n");
+    fprintf(stderr, "    -B Benchmark record parsing over the input file, ITERS times: yyjson, then the flow scanner.\n");
     fprintf(stderr, "    -b Binary (raw) input/output");
     fprintf(stderr, "    -i Input file (json formatted flow records).\n");
+    fprintf(stderr, "    -P Parse the input file on THREADS threads (chunks of lines); output matches a serial run.\n");
     fprintf(stderr, "    -O Single file mode - one tar file containing one GraphBLAS matrix.\n");
     fprintf(stderr, "    -o Output directory (where filled tar files are moved).\n");
     fprintf(stderr, "    -S Swap byte order of IPv4 addresses.\n");
-    fprintf(stderr, "    -s Select socket input mode.\n");
+    fprintf(stderr, "    -s Select socket input mode: -i is a UNIX socket path, served to many clients at once.\n");
+    fprintf(stderr, "       TYPE is stream (default), seqpacket or dgram (each message holds whole records).\n");
     fprintf(stderr, "    -t Temporary directory for building unfilled tar files.\n");
+    fprintf(stderr, "    -Y Parse every record with yyjson (no flow scanner).\n");
     fprintf(stderr, "    -W Number of GraphBLAS matrices to save in the output tar file.\n");
     fprintf(stderr, "    -w Window size (number of entries) in the saved GraphBLAS matrices.\n");
 }
@@ -200,6 +249,17 @@ void dump_binary(void)
         exit(errno);
     }
 
+    if (pstate->anonymize == ANON_AFTER_AGG) // binary output is anonymized too
+    {
+        ip4memo_map(&pstate->memo, pstate->R, pstate->rec);
+        ip4memo_map(&pstate->memo, pstate->C, pstate->rec);
+    }
+    else if (pstate->anonymize == ANON_CRYPTOPAN)
+    {
+        cryptopan_anonymize_index(pstate->cpan, pstate->R, pstate->rec);
+        cryptopan_anonymize_index(pstate->cpan, pstate->C, pstate->rec);
+    }
+
     if (write(fd, pstate->R, sizeof(GrB_Index) * pstate->rec) != sizeof(GrB_Index) * pstate->rec)
     {
         perror("write dat error [R]");
@@ -250,11 +310,16 @@ int load_binary(FILE *in)
     pstate->total_packets -= pstate->npkts;
     for (i = 0; i < pstate->rec; i++)
     {
-        if (pstate->anonymize != 0)
+        if (pstate->anonymize == ANON_CRYPTOPANT)
         {
             pstate->R[i] = scramble_ip4(pstate->R[i], 16);
             pstate->C[i] = scramble_ip4(pstate->C[i], 16);
         }
+        else if (pstate->anonymize == ANON_MEMO)
+        {
+            pstate->R[i] = ip4memo_get(&pstate->memo, pstate->R[i]);
+            pstate->C[i] = ip4memo_get(&pstate->memo, pstate->C[i]);
+        }
 
         pstate->npkts += pstate->V[i];
     }
@@ -273,66 +338,24 @@ void move_file_to_dir(const char *src, const char *dst_dir)
 
 void add_to_tar(void *blob_data, unsigned int blob_size)
 {
-    int tarfd;
-    struct posix_tar_header th  = { 0 }; // let's make a tar file, or close enough
-    const unsigned char *th_ptr = (const unsigned char *)&th;
-    size_t tmp_chksum           = 0;
-    size_t aligned;
+    char entry_name[32];
 
     if (pstate->f_name[0] == '\0')
     {
         set_output_filename(NULL);
     }
 
-    if ((tarfd = open(pstate->f_name, O_CREAT | O_WRONLY | O_APPEND, 0660)) == -1)
-    {
-        perror("open tar");
-        exit(1);
-    }
-
-    sprintf(th.name, "%d.grb", pstate->findex++);
-    sprintf(th.uid, "%06o ", 0);
-    sprintf(th.gid, "%06o ", 0);
-    sprintf(th.size, "%011o", blob_size);
-    sprintf(th.mode, "%06o", 0644);
-    sprintf(th.magic, "%s", TMAGIC);
-    sprintf(th.mtime, "%011o", (unsigned int)time(NULL));
-    th.typeflag = '0';
-    memset(th.chksum, ' ', 8); // or checksum computed below will be wrong!
-
-    for (int b = 0; b < sizeof(struct posix_tar_header); b++)
-        tmp_chksum += th_ptr[b];
-
-    sprintf(th.chksum, "%06o ", (unsigned int)tmp_chksum);
-
-    if (write(tarfd, &th, sizeof(th)) != sizeof(th))
-    {
-        perror("write tar error");
-        exit(4);
-    }
-
-    if (write(tarfd, blob_data, blob_size) != blob_size)
-    {
-        perror("write tar error");
-        exit(4);
-    }
-
-    aligned = (sizeof(th) + blob_size) % 512; // pad output file to 512 byte alignment
-    if (aligned != 0)
+    if (!tar_writer_is_open(&pstate->tw))
     {
-        const unsigned char padblock[512] = { 0 };
-
-        if (write(tarfd, padblock, 512 - aligned) != 512 - aligned)
-        {
-            perror("write tar error");
-            exit(4);
-        }
+        tar_writer_open(&pstate->tw, pstate->f_name);
     }
 
-    close(tarfd);
+    snprintf(entry_name, sizeof(entry_name), "%d.grb", pstate->findex++);
+    tar_writer_add(&pstate->tw, entry_name, blob_data, blob_size);
 
     if (pstate->findex >= pstate->windowsize)
     {
+        tar_writer_close(&pstate->tw, 1);
         if (pstate->out_prefix != NULL)
         {
             move_file_to_dir(pstate->f_name, pstate->out_prefix);
@@ -352,8 +375,17 @@ void build_and_store_matrix(void)
     double t_elapsed = 0;     // for TIC() and TOC()
 
     TIC(CLOCK_REALTIME, "");
+    if (pstate->anonymize == ANON_CRYPTOPAN)
+    {
+        cryptopan_anonymize_index(pstate->cpan, pstate->R, pstate->rec);
+        cryptopan_anonymize_index(pstate->cpan, pstate->C, pstate->rec);
+    }
     LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
     LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, pstate->R, pstate->C, pstate->V, pstate->rec, GrB_PLUS_UINT32));
+    if (pstate->anonymize == ANON_AFTER_AGG)
+    {
+        LAGRAPH_TRY_EXIT(ip4memo_anonymize_matrix(&pstate->memo, &Gmat));
+    }
 
     GrB_Descriptor_new(&desc);
     GxB_Desc_set(desc, GxB_COMPRESSION, GxB_COMPRESSION_ZSTD + 1);
@@ -423,20 +455,104 @@ void add_packets(in_addr_t src_saddr, in_addr_t dst_saddr, uint32_t npkts)
     }
 }
 
-#define process_suricata_flow_json_line process_suricata_flow_yyjson_line
+static void *arena_malloc(void *ctx, size_t size)
+{
+    struct yyjson_arena *a = (struct yyjson_arena *)ctx;
+    size_t off             = (a->used + 15) & ~(size_t)15; // yyjson values are 16 bytes
+
+    if (off + size > a->size)
+        return NULL;
+    a->last = off;
+    a->used = off + size;
+    return a->buf + off;
+}
 
-void process_suricata_flow_yyjson_line(char *str, size_t len)
+static void *arena_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
 {
-    struct timespec ts_start; // for TIC() and TOC()
-    double t_elapsed = 0;     // for TIC() and TOC()
+    struct yyjson_arena *a = (struct yyjson_arena *)ctx;
+    void *p;
 
-    TIC(CLOCK_REALTIME, "");
+    if ((char *)ptr == a->buf + a->last)
+    {
+        if (a->last + size > a->size)
+            return NULL;
+        a->used = a->last + size;
+        return ptr;
+    }
+    if ((p = arena_malloc(ctx, size)) != NULL)
+        memcpy(p, ptr, old_size);
+    return p;
+}
+
+static void arena_free(void *ctx, void *ptr)
+{
+    // Released all at once, by the next reset.
+}
+
+/// @brief Set up an arena large enough for the largest record read through the line buffer.
+void arena_init(struct yyjson_arena *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->size        = yyjson_read_max_memory_usage(BUFFERSIZE, READ_FLAGS);
+    a->alc.malloc  = arena_malloc;
+    a->alc.realloc = arena_realloc;
+    a->alc.free    = arena_free;
+    a->alc.ctx     = a;
+    if ((a->buf = malloc(a->size)) == NULL)
+    {
+        perror("malloc arena");
+        exit(1);
+    }
+}
+
+void arena_destroy(struct yyjson_arena *a)
+{
+    free(a->buf);
+    a->buf = NULL;
+}
+
+/// @brief Allocator for the next record: the arena, emptied first if it is past ARENABATCH or the record might not
+///        fit in what is left.
+/// @param a Arena, or NULL for malloc().
+/// @param len Length of the record.
+/// @return The arena's allocator, or NULL (malloc()) for a record larger than the whole arena.
+static inline const yyjson_alc *arena_get(struct yyjson_arena *a, size_t len)
+{
+    size_t need;
+
+    if (a == NULL)
+        return (NULL);
+
+    need = yyjson_read_max_memory_usage(len, READ_FLAGS) + 64; // and alignment of the allocations
+    if (need <= 64 || need > a->size)
+    {
+        a->on_heap++;
+        return (NULL);
+    }
+    if (a->used >= ARENABATCH || a->size - a->used < need)
+    {
+        a->used = 0;
+        a->resets++;
+    }
+    a->docs++;
+    return (&a->alc);
+}
 
+#define process_suricata_flow_json_line process_suricata_flow_yyjson_line
+
+/// @brief Parse one EVE flow record with yyjson.
+/// @param str Record (need not be NUL terminated).
+/// @param len Length of the record.
+/// @param tuple Addresses (byte swapped with -S, not anonymized) and packet counts of the flow.
+/// @param arena The calling thread's arena for the document, or NULL for malloc().
+/// @return 1 if the record is a flow with IPv4 addresses, 0 (with a message) if not.
+int parse_flow_yyjson(const char *str, size_t len, struct flow_tuple *tuple, struct yyjson_arena *arena)
+{
     yyjson_read_err err;
-    yyjson_doc *doc = yyjson_read_opts(str, len, YYJSON_READ_STOP_WHEN_DONE, NULL, &err);
+    yyjson_doc *doc = yyjson_read_opts((char *)str, len, READ_FLAGS, arena_get(arena, len), &err);
+    int ret         = 0;
 
     struct in_addr tmp_inaddr;
-    in_addr_t src_saddr, dst_saddr;
 
     if (doc == NULL)
     {
@@ -465,7 +581,7 @@ void process_suricata_flow_yyjson_line(char *str, size_t len)
         goto errexit_yyjson;
     }
     else
-        src_saddr = BSWAP(tmp_inaddr.s_addr);
+        tuple->src_saddr = BSWAP(tmp_inaddr.s_addr);
 
     if (dest_ip == NULL || inet_aton(dest_ip, &tmp_inaddr) == 0)
     {
@@ -473,31 +589,82 @@ void process_suricata_flow_yyjson_line(char *str, size_t len)
         goto errexit_yyjson;
     }
     else
-        dst_saddr = BSWAP(tmp_inaddr.s_addr);
-
-    if (pstate->anonymize != 0)
-    {
-        src_saddr = scramble_ip4(src_saddr, 16);
-        dst_saddr = scramble_ip4(dst_saddr, 16);
-    }
+        tuple->dst_saddr = BSWAP(tmp_inaddr.s_addr);
 
     yyjson_val *pkts_toclient_val = yyjson_obj_get(flow_val, "pkts_toclient");
     yyjson_val *pkts_toserver_val = yyjson_obj_get(flow_val, "pkts_toserver");
 
-    uint64_t pkts_toclient = yyjson_get_uint(pkts_toclient_val);
-    uint64_t pkts_toserver = yyjson_get_uint(pkts_toserver_val);
-
-    add_packets(src_saddr, dst_saddr, pkts_toserver);
-    add_packets(dst_saddr, src_saddr, pkts_toclient);
+    tuple->pkts_toclient = yyjson_get_uint(pkts_toclient_val);
+    tuple->pkts_toserver = yyjson_get_uint(pkts_toserver_val);
+    ret                  = 1;
 
 errexit_yyjson:
     if (doc != NULL)
     {
         yyjson_doc_free(doc);
     }
+    return (ret);
+}
+
+/// @brief Parse one EVE flow record: with the flow scanner (eveflow.h), or with yyjson when the scanner cannot
+///        read it (or with -Y).  Same parameters and results as parse_flow_yyjson().
+int parse_flow_record(const char *str, size_t len, struct flow_tuple *tuple, struct yyjson_arena *arena)
+{
+    struct eveflow flow;
+
+    if (pstate->yyjson_only)
+        return (parse_flow_yyjson(str, len, tuple, arena));
+
+    if (eveflow_scan(str, len, &flow))
+    {
+        tuple->src_saddr     = BSWAP(flow.src_saddr);
+        tuple->dst_saddr     = BSWAP(flow.dst_saddr);
+        tuple->pkts_toserver = flow.pkts_toserver;
+        tuple->pkts_toclient = flow.pkts_toclient;
+        return (1);
+    }
+
+    __atomic_add_fetch(&pstate->scan_fallbacks, 1, __ATOMIC_RELAXED);
+    return (parse_flow_yyjson(str, len, tuple, arena));
+}
+
+/// @brief Anonymize a flow's addresses (per record modes, -a and -m), then add its packets to the subwindow.
+void add_flow(struct flow_tuple *tuple)
+{
+    in_addr_t src_saddr = tuple->src_saddr;
+    in_addr_t dst_saddr = tuple->dst_saddr;
+
+    if (pstate->anonymize == ANON_CRYPTOPANT)
+    {
+        src_saddr = scramble_ip4(src_saddr, 16);
+        dst_saddr = scramble_ip4(dst_saddr, 16);
+    }
+    else if (pstate->anonymize == ANON_MEMO)
+    {
+        src_saddr = ip4memo_get(&pstate->memo, src_saddr);
+        dst_saddr = ip4memo_get(&pstate->memo, dst_saddr);
+    }
+
+    add_packets(src_saddr, dst_saddr, tuple->pkts_toserver);
+    add_packets(dst_saddr, src_saddr, tuple->pkts_toclient);
+}
+
+void process_suricata_flow_yyjson_line(char *str, size_t len)
+{
+    struct timespec ts_start; // for TIC() and TOC()
+    double t_elapsed = 0;     // for TIC() and TOC()
+    struct flow_tuple tuple;
+    int ok;
+
+    TIC(CLOCK_REALTIME, "");
+    ok = parse_flow_record(str, len, &tuple, &pstate->arena);
     TOC(CLOCK_REALTIME, "");
     pstate->t_json += t_elapsed;
-    return;
+
+    if (ok)
+    {
+        add_flow(&tuple);
+    }
 }
 
 int process_buffer(char *buffer, size_t *offset)
@@ -525,15 +692,307 @@ int process_buffer(char *buffer, size_t *offset)
     return (records);
 }
 
-int setup_socket(const char *socket_path)
+/// @brief Parse the complete lines of a stream's reassembly buffer (input file or stream socket), once new data has
+///        been added up to *offset.  A line that cannot fit the buffer with its newline (MAXLINE) is dropped, up to
+///        its newline, as parse_chunk() drops it with -P.
+/// @param discard Set while the rest of a dropped line is being skipped.
+/// @return Records parsed.
+int process_stream(char *buffer, size_t *offset, int *discard)
+{
+    int records;
+
+    if (*discard)
+    {
+        char *nl = memchr(buffer, '\n', *offset);
+
+        if (nl == NULL)
+        {
+            *offset = 0;
+            return (0);
+        }
+        *discard = 0;
+        *offset -= nl + 1 - buffer;
+        memmove(buffer, nl + 1, *offset);
+    }
+
+    records = process_buffer(buffer, offset);
+    if (*offset > MAXLINE) // a line that does not fit: drop it, up to the next newline
+    {
+        fprintf(stderr, "WARN: dropping a record longer than the input buffer.\n");
+        *discard = 1;
+        *offset  = 0;
+    }
+    return (records);
+}
+
+/// @brief Parse the lines of a chunk into its flow tuples, in input order.
+/// @param arena The calling thread's yyjson arena.
+void parse_chunk(struct json_chunk *ck, struct yyjson_arena *arena)
+{
+    struct timespec ts_start; // for TIC() and TOC()
+    double t_elapsed = 0;     // for TIC() and TOC()
+    const char *start = ck->start;
+    const char *end;
+
+    TIC(CLOCK_REALTIME, "");
+    ck->ntuples = 0;
+    ck->records = 0;
+    while (start < ck->end)
+    {
+        if ((end = memchr(start, '\n', ck->end - start)) == NULL)
+            end = ck->end; // last line of the file, without a newline
+
+        if (end - start > MAXLINE) // as a serial run, which reads lines through a BUFFERSIZE buffer
+        {
+            fprintf(stderr, "WARN: dropping a record longer than the input buffer.\n");
+            start = end + 1;
+            continue;
+        }
+
+        if (ck->ntuples == ck->size)
+        {
+            ck->size   = ck->size ? 2 * ck->size : 65536;
+            ck->tuples = realloc(ck->tuples, ck->size * sizeof(struct flow_tuple));
+            if (ck->tuples == NULL)
+            {
+                perror("realloc tuples");
+                exit(1);
+            }
+        }
+
+        ck->records++;
+        if (parse_flow_record(start, end - start, &ck->tuples[ck->ntuples], arena))
+            ck->ntuples++;
+        start = end + 1;
+    }
+    TOC(CLOCK_REALTIME, "");
+    ck->t_json = t_elapsed;
+}
+
+/// @brief Parallel mode worker: take the next chunk of the input, parse it, and leave it to be merged.
+void *split_worker(void *arg)
+{
+    struct json_split *sp = (struct json_split *)arg;
+    struct yyjson_arena arena;
+
+    arena_init(&arena);
+    while (1)
+    {
+        struct json_chunk *ck;
+        const char *nl;
+
+        pthread_mutex_lock(&sp->lock);
+        while (sp->pos < sp->size && sp->next_seq - sp->merged >= sp->nslots)
+            pthread_cond_wait(&sp->cond, &sp->lock);
+        if (sp->pos >= sp->size)
+        {
+            pthread_mutex_unlock(&sp->lock);
+            break;
+        }
+
+        // Chunks end after a newline, so no line is split between two of them.
+        ck        = &sp->slots[sp->next_seq % sp->nslots];
+        ck->seq   = sp->next_seq++;
+        ck->start = sp->base + sp->pos;
+        if (sp->size - sp->pos <= CHUNKSIZE ||
+            (nl = memchr(ck->start + CHUNKSIZE, '\n', sp->size - sp->pos - CHUNKSIZE)) == NULL)
+            ck->end = sp->base + sp->size;
+        else
+            ck->end = nl + 1;
+        sp->pos = ck->end - sp->base;
+        pthread_mutex_unlock(&sp->lock);
+
+        parse_chunk(ck, &arena);
+
+        pthread_mutex_lock(&sp->lock);
+        ck->ready = 1;
+        pthread_cond_broadcast(&sp->cond);
+        pthread_mutex_unlock(&sp->lock);
+    }
+
+    __atomic_add_fetch(&pstate->arena.docs, arena.docs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pstate->arena.resets, arena.resets, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pstate->arena.on_heap, arena.on_heap, __ATOMIC_RELAXED);
+    arena_destroy(&arena);
+
+    return NULL;
+}
+
+/// @brief Intra-file parallel mode (-P): parse a memory-mapped input file on several threads, and add the flows
+///        to the subwindows in input order, so packet-count windowing (and the output) matches a serial run.
+/// @param in Input file, a regular file.
+/// @param filesize Size of the input file.
+/// @param nthreads Number of parsing threads.
+/// @return Number of records (lines) read.
+uint64_t process_file_parallel(FILE *in, size_t filesize, uint32_t nthreads)
+{
+    struct json_split sp = { 0 };
+    void *base;
+    uint64_t records = 0;
+
+    if (filesize == 0)
+        return (0);
+
+    if ((base = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(in), 0)) == MAP_FAILED)
+    {
+        perror("mmap input");
+        exit(1);
+    }
+    madvise(base, filesize, MADV_SEQUENTIAL);
+
+    sp.base     = base;
+    sp.size     = filesize;
+    sp.nthreads = nthreads;
+    sp.nslots   = 2 * nthreads; // every thread can parse a chunk while the previous ones wait to be merged
+    sp.slots    = calloc(sp.nslots, sizeof(struct json_chunk));
+    sp.threads  = calloc(nthreads, sizeof(pthread_t));
+    pthread_mutex_init(&sp.lock, NULL);
+    pthread_cond_init(&sp.cond, NULL);
+
+    fprintf(stderr, "Parallel mode: %u parsing threads, %d MB chunks.\n", nthreads, CHUNKSIZE >> 20);
+
+    for (uint32_t i = 0; i < nthreads; i++)
+        pthread_create(&sp.threads[i], NULL, split_worker, &sp);
+
+    // Merge the chunks in input order, on this thread: add_packets() sees the flows as in a serial run.
+    for (uint64_t seq = 0;; seq++)
+    {
+        struct json_chunk *ck = &sp.slots[seq % sp.nslots];
+
+        pthread_mutex_lock(&sp.lock);
+        while (!(ck->ready && ck->seq == seq) && !(sp.pos >= sp.size && seq == sp.next_seq))
+            pthread_cond_wait(&sp.cond, &sp.lock);
+        pthread_mutex_unlock(&sp.lock);
+
+        if (!(ck->ready && ck->seq == seq)) // every chunk has been merged
+            break;
+
+        for (size_t i = 0; i < ck->ntuples; i++)
+            add_flow(&ck->tuples[i]);
+        records += ck->records;
+        pstate->t_json += ck->t_json;
+
+        pthread_mutex_lock(&sp.lock);
+        ck->ready = 0;
+        sp.merged++;
+        pthread_cond_broadcast(&sp.cond);
+        pthread_mutex_unlock(&sp.lock);
+    }
+
+    for (uint32_t i = 0; i < nthreads; i++)
+        pthread_join(sp.threads[i], NULL);
+
+    for (uint32_t i = 0; i < sp.nslots; i++)
+        free(sp.slots[i].tuples);
+    free(sp.slots);
+    free(sp.threads);
+    pthread_mutex_destroy(&sp.lock);
+    pthread_cond_destroy(&sp.cond);
+    munmap(base, filesize);
+
+    return (records);
+}
+
+/// @brief Benchmark (-B): parse the records of a JSON input file with yyjson alone, then with the flow scanner
+///        (and yyjson for what it leaves), check that both give the same flows, and report their rates.
+/// @param in Input file, a regular file.
+/// @param filesize Size of the input file.
+/// @param iters Passes over the records timed for each parser.
+void bench_parse(FILE *in, size_t filesize, int iters)
+{
+    struct timespec ts_start; // for TIC() and TOC()
+    double t_elapsed = 0;     // for TIC() and TOC()
+    const char *base, *start, *end;
+    const char **lines = NULL;
+    size_t *lens       = NULL;
+    size_t nlines = 0, size = 0, nbytes = 0, bad = 0, mismatches = 0;
+    struct flow_tuple t1, t2;
+    uint64_t sink = 0;
+    double t_yyjson, t_arena, t_scan;
+
+    if (filesize == 0 || (base = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(in), 0)) == MAP_FAILED)
+    {
+        perror("mmap input");
+        exit(1);
+    }
+
+    // Keep the records yyjson reads, so the timed passes print no errors.
+    for (start = base; start < base + filesize; start = end + 1)
+    {
+        if ((end = memchr(start, '\n', base + filesize - start)) == NULL)
+            end = base + filesize;
+        if (!parse_flow_yyjson(start, end - start, &t1, NULL))
+        {
+            struct eveflow flow;
+
+            mismatches += eveflow_scan(start, end - start, &flow); // the scanner must not take it either
+            bad++;
+            continue;
+        }
+        if (nlines == size)
+        {
+            size  = size ? 2 * size : 65536;
+            lines = realloc(lines, size * sizeof(*lines));
+            lens  = realloc(lens, size * sizeof(*lens));
+            if (lines == NULL || lens == NULL)
+            {
+                perror("realloc lines");
+                exit(1);
+            }
+        }
+        lines[nlines] = start;
+        lens[nlines]  = end - start;
+        nbytes += end - start + 1;
+        nlines++;
+
+        if (!parse_flow_record(start, end - start, &t2, &pstate->arena) || memcmp(&t1, &t2, sizeof(t1)) != 0)
+            mismatches++;
+    }
+    fprintf(stderr, "Benchmark: %zu records (%zu not flows), %zu left to yyjson by the flow scanner, %zu mismatches.\n",
+            nlines, bad, (size_t)pstate->scan_fallbacks, mismatches);
+
+    TIC(CLOCK_MONOTONIC, "");
+    for (int i = 0; i < iters; i++)
+        for (size_t j = 0; j < nlines; j++)
+            sink += parse_flow_yyjson(lines[j], lens[j], &t1, NULL) + t1.pkts_toserver;
+    TOC(CLOCK_MONOTONIC, "");
+    t_yyjson = t_elapsed;
+
+    TIC(CLOCK_MONOTONIC, "");
+    for (int i = 0; i < iters; i++)
+        for (size_t j = 0; j < nlines; j++)
+            sink += parse_flow_yyjson(lines[j], lens[j], &t1, &pstate->arena) + t1.pkts_toserver;
+    TOC(CLOCK_MONOTONIC, "");
+    t_arena = t_elapsed;
+
+    TIC(CLOCK_MONOTONIC, "");
+    for (int i = 0; i < iters; i++)
+        for (size_t j = 0; j < nlines; j++)
+            sink += parse_flow_record(lines[j], lens[j], &t1, &pstate->arena) + t1.pkts_toserver;
+    TOC(CLOCK_MONOTONIC, "");
+    t_scan = t_elapsed;
+
+    fprintf(stderr, "yyjson, malloc: %.0f records/sec (%.1f MB/s)\n", iters * nlines / t_yyjson,
+            iters * nbytes / t_yyjson / 1e6);
+    fprintf(stderr, "yyjson, arena:  %.0f records/sec (%.1f MB/s), %.2fx (allocation %.0f ns/record)\n",
+            iters * nlines / t_arena, iters * nbytes / t_arena / 1e6, t_yyjson / t_arena,
+            (t_yyjson - t_arena) * 1e9 / (iters * nlines));
+    fprintf(stderr, "flow scanner:   %.0f records/sec (%.1f MB/s), %.2fx [%lu]\n", iters * nlines / t_scan,
+            iters * nbytes / t_scan / 1e6, t_yyjson / t_scan, sink % 10);
+
+    free(lines);
+    free(lens);
+    munmap((void *)base, filesize);
+}
+
+int setup_socket(const char *socket_path, int type)
 {
     int s;
-    struct sockaddr_un local, remote;
-    int len = 0;
+    struct sockaddr_un local;
 
     fprintf(stderr, "Setting up socket to receive data...\n");
 
-    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    s = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (s == -1)
     {
         perror("Error on socket() call");
@@ -549,7 +1008,7 @@ int setup_socket(const char *socket_path)
         exit(1);
     }
 
-    if (listen(s, 1) != 0)
+    if (type != SOCK_DGRAM && listen(s, SOMAXCONN) != 0)
     {
         perror("Error on listen() call");
         exit(1);
@@ -562,17 +1021,202 @@ int setup_socket(const char *socket_path)
 
 void stop(int dummy)
 {
-    fprintf(stderr, "Signal recieved: will exit when current conection is closed.\n");
+    fprintf(stderr, "Signal received: will exit when the open connections are closed.\n");
 
     pstate->wait = false;
 }
 
+/// @brief A client connection (or, for datagram input, the bound socket) and its line reassembly buffer.
+struct eve_conn
+{
+    int fd;
+    int discard;   // dropping the rest of a line longer than the buffer
+    size_t offset; // bytes of a partial line in buf
+    char buf[BUFFERSIZE];
+};
+
+struct eve_conn *conn_open(int epfd, int fd)
+{
+    struct eve_conn *conn;
+    struct epoll_event ev;
+
+    if ((conn = malloc(sizeof(*conn))) == NULL)
+    {
+        perror("malloc conn");
+        exit(1);
+    }
+    conn->fd      = fd;
+    conn->discard = 0;
+    conn->offset  = 0;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        perror("Error on epoll_ctl() call");
+        exit(1);
+    }
+    return (conn);
+}
+
+/// @brief Parse the last record of a connection, if it did not end with a newline, and close it.
+/// @return Records parsed.
+int conn_close(int epfd, struct eve_conn *conn)
+{
+    int records = 0;
+
+    if (conn->offset > 0 && !conn->discard)
+    {
+        conn->buf[conn->offset] = '\0';
+        process_suricata_flow_json_line(conn->buf, conn->offset);
+        records++;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn);
+    return (records);
+}
+
+/// @brief Receive what a connection has sent, and parse its complete lines.
+/// @param type SOCK_STREAM, or SOCK_SEQPACKET or SOCK_DGRAM: then every message holds whole records, and the last
+///             one need not end with a newline.
+/// @return Records parsed, or -1 if the connection was closed or failed (with SOCK_DGRAM, only on a recv() error).
+int conn_read(struct eve_conn *conn, int type)
+{
+    size_t space = BUFFERSIZE - conn->offset - 2; // room for a newline the message lacks, and the NUL
+    ssize_t len;
+
+    len = recv(conn->fd, conn->buf + conn->offset, space, type == SOCK_STREAM ? 0 : MSG_TRUNC);
+    if (len < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return (0);
+        perror("Error on recv() call");
+        return (-1);
+    }
+    if (len == 0)
+        return (type == SOCK_DGRAM ? 0 : -1); // an empty datagram, or the client closed the connection
+
+    if (type != SOCK_STREAM)
+    {
+        if ((size_t)len > space) // MSG_TRUNC gives the length of the whole message
+        {
+            fprintf(stderr, "WARN: dropped a %zd byte message, longer than the input buffer.\n", len);
+            return (0);
+        }
+        conn->offset += len;
+        if (conn->buf[conn->offset - 1] != '\n')
+            conn->buf[conn->offset++] = '\n';
+        return (process_buffer(conn->buf, &conn->offset));
+    }
+
+    conn->offset += len;
+    return (process_stream(conn->buf, &conn->offset, &conn->discard));
+}
+
+/// @brief Serve EVE clients on a bound socket until SIGINT, then until the open connections are closed.
+///
+/// Every client has its own line reassembly buffer, and the records of all of them are added to the same matrices
+/// as they arrive, so several Suricata workers (or instances) can log to one json2grb.
+/// @param type SOCK_STREAM or SOCK_SEQPACKET (connections are accepted), or SOCK_DGRAM (datagrams are read from
+///             the socket itself).
+/// @return Records parsed.
+uint64_t serve_socket(int listener, int type)
+{
+    struct epoll_event ev, events[MAXEVENTS];
+    struct eve_conn *dgram = NULL;
+    uint64_t records       = 0;
+    int nconns             = 0;
+    int listening          = 0;
+    int epfd;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        perror("Error on epoll_create1() call");
+        exit(1);
+    }
+
+    if (type == SOCK_DGRAM)
+    {
+        dgram = conn_open(epfd, listener);
+    }
+    else
+    {
+        ev.events   = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev) != 0)
+        {
+            perror("Error on epoll_ctl() call");
+            exit(1);
+        }
+        listening = 1;
+    }
+
+    pstate->wait = true;
+    signal(SIGINT, stop);
+    while (pstate->wait || nconns > 0)
+    {
+        int n;
+
+        if (!pstate->wait && listening) // stop accepting; serve the open connections until they close
+        {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listener, NULL);
+            listening = 0;
+        }
+
+        if ((n = epoll_wait(epfd, events, MAXEVENTS, 1000)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error on epoll_wait() call");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct eve_conn *conn = events[i].data.ptr;
+            int ret;
+
+            if (conn == NULL)
+            {
+                int s = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                if (s == -1)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    perror("Error on accept() call");
+                    exit(1);
+                }
+                conn_open(epfd, s);
+                fprintf(stderr, "Connection received (%d open).\n", ++nconns);
+            }
+            else if ((ret = conn_read(conn, type)) < 0)
+            {
+                if (conn == dgram) // the bound socket itself: recv() reports its error once, and it stays open
+                    continue;
+                records += conn_close(epfd, conn);
+                fprintf(stderr, "Connection closed (%d open).\n", --nconns);
+            }
+            else
+            {
+                records += ret;
+            }
+        }
+    }
+
+    free(dgram); // the socket itself is closed by the caller
+    close(epfd);
+    return (records);
+}
+
 int main(int argc, char *argv[])
 {
     int c, ret, reqargs = 0; // for getopt
     FILE *in;
     char in_f[PATH_MAX] = "";
     int socket                 = 0;
+    int socktype               = SOCK_STREAM; // -s[TYPE]
     char anonkey[PATH_MAX];
     size_t filesize;
     size_t offset;
@@ -580,10 +1224,17 @@ int main(int argc, char *argv[])
     double t_elapsed       = 0; // for TIC() and TOC()
     uint64_t total_records = 0;
     char buf[BUFFERSIZE];
+    int discard = 0; // skipping the rest of a record longer than buf
     int partial = 0;
+    int defer_anon = 0;     // -A
+    int anon_opts  = 0;     // -a and -k given
+    char *memofile = NULL;  // -m
+    uint32_t nthreads = 0;  // -P
+    int bench_iters   = 0;  // -B
+    long memo_loaded;
 
     pstate                = calloc(1, sizeof(struct px3_state));
-    pstate->anonymize     = 0;
+    pstate->anonymize     = ANON_NONE;
     pstate->binary        = 0;
     pstate->swapped       = 0;
     pstate->npkts         = 0;
@@ -593,15 +1244,31 @@ int main(int argc, char *argv[])
     pstate->subwinsize    = 1 << 17; // SUBWINSIZE;
     pstate->t_grb         = 0;
     pstate->t_json        = 0;
+    tar_writer_init(&pstate->tw);
 
-    while ((c = getopt(argc, argv, "Sa:b:i:O::o:pst:W:w:")) != -1)
+    while ((c = getopt(argc, argv, "AB:Sa:b:i:k:m:O::o:P:ps::t:W:w:Y")) != -1)
     {
         switch (c)
         {
+            case 'A':
+                defer_anon = 1;
+                break;
+            case 'B':
+                bench_iters = atoi(optarg);
+                break;
             case 'a':
-                pstate->anonymize = 1;
+                anon_opts++;
+                pstate->anonymize = ANON_CRYPTOPANT;
                 snprintf(anonkey, sizeof(anonkey), "%s", optarg);
                 break;
+            case 'k':
+                anon_opts++;
+                pstate->anonymize = ANON_CRYPTOPAN;
+                snprintf(anonkey, sizeof(anonkey), "%s", optarg);
+                break;
+            case 'm':
+                memofile = optarg;
+                break;
             case 'b':
                 // binary input
                 if (*optarg == 'i')
@@ -630,6 +1297,10 @@ int main(int argc, char *argv[])
                 // output dir
                 pstate->out_prefix = strdup(optarg);
                 break;
+            case 'P':
+                // parallel parsing threads
+                nthreads = strtoul(optarg, NULL, 10);
+                break;
             case 'p':
                 // output partial matricies
                 partial = 1;
@@ -637,10 +1308,25 @@ int main(int argc, char *argv[])
             case 's':
                 // unix socket input
                 socket = 1;
+                if (optarg == NULL || !strcmp(optarg, "stream"))
+                    socktype = SOCK_STREAM;
+                else if (!strcmp(optarg, "seqpacket"))
+                    socktype = SOCK_SEQPACKET;
+                else if (!strcmp(optarg, "dgram"))
+                    socktype = SOCK_DGRAM;
+                else
+                {
+                    fprintf(stderr, "Unknown socket type: %s.\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
                 break;
             case 't':
                 pstate->tmpdir = strdup(optarg);
                 break;
+            case 'Y':
+                pstate->yyjson_only = 1;
+                break;
             case 'W':
                 // windowsize
                 pstate->windowsize = strtoul(optarg, NULL, 10);
@@ -650,7 +1336,7 @@ int main(int argc, char *argv[])
                 pstate->subwinsize = strtoul(optarg, NULL, 10);
                 break;
             case '?':
-                if (optopt == 'i' || optopt == 'o' || optopt == 'a' || optopt == 'b' || optopt == 's' || optopt == 't' || optopt == 'W' || optopt == 'w')
+                if (optopt == 'i' || optopt == 'o' || optopt == 'a' || optopt == 'b' || optopt == 'B' || optopt == 'P' || optopt == 's' || optopt == 't' || optopt == 'W' || optopt == 'w')
                 {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 }
@@ -669,6 +1355,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (anon_opts > 1)
+    {
+        fprintf(stderr, "-a and -k are mutually exclusive: use one anonymization method.\n");
+        exit(1);
+    }
+
     if (reqargs < 1)
     {
         fprintf(stderr, "Invalid or insufficient arguments.\n");
@@ -676,7 +1368,16 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    if (pstate->anonymize != 0)
+    if (pstate->anonymize == ANON_CRYPTOPAN)
+    {
+        fprintf(stderr, "anonymizing using Crypto-PAn keyfile: %s\n", anonkey);
+        if ((pstate->cpan = malloc(sizeof(struct cryptopan))) == NULL ||
+            cryptopan_init_from_file(pstate->cpan, anonkey, 16) < 0) // preserve 16 upper bits, like -a
+        {
+            return 1;
+        }
+    }
+    else if (pstate->anonymize != ANON_NONE)
     {
         fprintf(stderr, "anonymizing using scramble keyfile: %s\n", anonkey);
         if (scramble_init_from_file(anonkey, SCRAMBLE_BLOWFISH, SCRAMBLE_BLOWFISH, NULL) < 0)
@@ -684,11 +1385,29 @@ int main(int argc, char *argv[])
             fprintf(stderr, "scramble_init_from_file(): nope\n");
             return 1;
         }
+
+        if (defer_anon)
+        {
+            fprintf(stderr, "anonymizing after aggregation\n");
+            pstate->anonymize = ANON_AFTER_AGG;
+        }
+        else if (memofile != NULL)
+        {
+            fprintf(stderr, "anonymizing through memo: %s\n", memofile);
+            pstate->anonymize = ANON_MEMO;
+        }
+
+        if (pstate->anonymize != ANON_CRYPTOPANT)
+        {
+            ip4memo_init(&pstate->memo, IP4MEMO_DEFAULT_BITS);
+            if (memofile != NULL && (memo_loaded = ip4memo_load(&pstate->memo, memofile)) > 0)
+                fprintf(stderr, "loaded %ld addresses from memo\n", memo_loaded);
+        }
     }
 
     if (socket == 1)
     {
-        socket = setup_socket(in_f);
+        socket = setup_socket(in_f, socktype);
     }
     else
     {
@@ -711,6 +1430,28 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (nthreads > 0 && (socket != 0 || in == stdin || (pstate->binary & 1)))
+    {
+        fprintf(stderr, "WARN: -P needs a JSON input file: parsing serially.\n");
+        nthreads = 0;
+    }
+
+    if (!(pstate->binary & 1))
+    {
+        arena_init(&pstate->arena);
+    }
+
+    if (bench_iters > 0)
+    {
+        if (socket != 0 || in == stdin || (pstate->binary & 1))
+        {
+            fprintf(stderr, "-B needs a JSON input file.\n");
+            exit(1);
+        }
+        bench_parse(in, filesize, bench_iters);
+        exit(0);
+    }
+
     pstate->R = malloc(sizeof(GrB_Index) * pstate->subwinsize);
     pstate->C = malloc(sizeof(GrB_Index) * pstate->subwinsize);
     pstate->V = malloc(sizeof(uint32_t) * pstate->subwinsize);
@@ -721,27 +1462,34 @@ int main(int argc, char *argv[])
     if (socket == 0)
     {
         TIC(CLOCK_REALTIME, "json begin");
-        while (!feof(in) && (ftell(in) < filesize))
+        if (nthreads > 0)
         {
-            if (pstate->binary & 1)
+            total_records = process_file_parallel(in, filesize, nthreads);
+        }
+        else
+        {
+            while (!feof(in) && (ftell(in) < filesize))
             {
-                pstate->rec = (filesize - ftell(in)) / (2 * sizeof(GrB_Index) + sizeof(uint32_t));
-                total_records += load_binary(in);
-                if (pstate->binary & 2)
+                if (pstate->binary & 1)
                 {
-                    dump_binary();
+                    pstate->rec = (filesize - ftell(in)) / (2 * sizeof(GrB_Index) + sizeof(uint32_t));
+                    total_records += load_binary(in);
+                    if (pstate->binary & 2)
+                    {
+                        dump_binary();
+                    }
+                    else
+                    {
+                        build_and_store_matrix();
+                    }
                 }
                 else
                 {
-                    build_and_store_matrix();
-                }
-            }
-            else
-            {
-                size_t bytes_read = fread(buf + offset, 1, sizeof(buf) - offset - 1, in);
+                    size_t bytes_read = fread(buf + offset, 1, sizeof(buf) - offset - 2, in);
 
-                offset += bytes_read;
-                total_records += process_buffer(buf, &offset);
+                    offset += bytes_read;
+                    total_records += process_stream(buf, &offset, &discard);
+                }
             }
         }
         TOC(CLOCK_REALTIME, "json end");
@@ -749,62 +1497,20 @@ int main(int argc, char *argv[])
     }
     else
     {
-        pstate->wait = true;
-        signal(SIGINT, stop);
-        while (pstate->wait)
-        {
-            int s;
-            struct sockaddr_un remote;
-            unsigned int s_len;
-            int recv_len;
-
-            struct timeval tv;
-            fd_set fds;
-
-            tv.tv_sec  = 1;
-            tv.tv_usec = 0;
-
-            FD_ZERO(&fds);
-            FD_SET(socket, &fds);
-
-            if (select(socket + 1, &fds, NULL, NULL, &tv) > 0)
-            {
-                if ((s = accept(socket, (struct sockaddr *)&remote, &s_len)) == -1)
-                {
-                    perror("Error on accept() call");
-                    exit(1);
-                }
-                fprintf(stderr, "Connection received.\n");
-
-                TIC(CLOCK_REALTIME, "json begin");
-                do
-                {
-                    recv_len = recv(s, buf + offset, sizeof(buf) - offset - 1, 0);
-                    if (recv_len > 0)
-                    {
-                        offset += recv_len;
-                        total_records += process_buffer(buf, &offset);
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Error on recv() call\n");
-                    }
-                } while (recv_len > 0);
-                TOC(CLOCK_REALTIME, "json end");
-
-                close(s);
-            }
-        }
+        TIC(CLOCK_REALTIME, "json begin");
+        total_records = serve_socket(socket, socktype);
+        TOC(CLOCK_REALTIME, "json end");
 
         close(socket);
 
         unlink(in_f); // remove socket file
     }
 
-    if (offset > 0) // handle any trailing JSON
+    if (offset > 0) // handle any trailing JSON (a last line without a newline), counted as -P counts it
     {
         buf[offset] = '\0';
         process_suricata_flow_json_line(buf, offset);
+        total_records++;
     }
 
     if (pstate->binary & 2)
@@ -825,6 +1531,7 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "INFO: Not processing %u remaining packets (less than matrix size of %u).\n", pstate->rec, pstate->subwinsize);
             }
         }
+        tar_writer_close(&pstate->tw, 1);
         if (pstate->findex > 0)
         {
             if (partial == 1)
@@ -842,12 +1549,26 @@ int main(int argc, char *argv[])
     free(pstate->R);
     free(pstate->C);
     free(pstate->V);
+    arena_destroy(&pstate->arena);
 
     fprintf(stderr, "Done: %ld records.  (%.2f / sec)\n", total_records, total_records / t_elapsed);
     fprintf(stderr, "Done: %ld packets.  (%.2f pps)\n", pstate->total_packets, pstate->total_packets / t_elapsed);
 
     fprintf(stderr, "GrB: elapsed %.2fs\n", pstate->t_grb);
     fprintf(stderr, "yyjson: elapsed %.2fs\n", pstate->t_json);
+    if (!(pstate->binary & 1))
+        fprintf(stderr, "yyjson arena: %lu documents, %lu resets (%zu MB per thread), %lu records on the heap.\n",
+                pstate->arena.docs, pstate->arena.resets, pstate->arena.size >> 20, pstate->arena.on_heap);
+    if (!pstate->yyjson_only)
+        fprintf(stderr, "Flow scanner: %lu records left to yyjson.\n", pstate->scan_fallbacks);
+    if (pstate->anonymize == ANON_AFTER_AGG || pstate->anonymize == ANON_MEMO)
+    {
+        fprintf(stderr, "Anonymized %lu new addresses (%zu in memo).\n", pstate->memo.misses,
+                ip4memo_count(&pstate->memo));
+        if (memofile != NULL && (memo_loaded = ip4memo_save(&pstate->memo, memofile)) >= 0)
+            fprintf(stderr, "saved %ld addresses to memo: %s\n", memo_loaded, memofile);
+        ip4memo_free(&pstate->memo);
+    }
 
     exit(0);
 }
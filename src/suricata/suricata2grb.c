@@ -0,0 +1,551 @@
+// suricata2grb - Suricata 6 output plugin that builds GraphBLAS network traffic matrices from flows in process.
+//
+// json2grb's pipeline, without EVE: each flow's IPv4 addresses and packet counts are taken from the Flow itself
+// when Suricata logs it, and added to the logging thread's subwindow.  A full subwindow is built into a matrix and
+// serialized by that thread; the tar files (shared by every thread) are named as json2grb names them, and moved
+// to the output directory without a shell, outside the lock.  No JSON is encoded or decoded.
+
+#include "suricata-common.h"
+#include "suricata-plugin.h"
+
+#include "conf.h"
+#include "flow.h"
+#include "output-flow.h"
+#include "output.h"
+#include "threadvars.h"
+#include "tm-modules.h"
+#include "util-debug.h"
+
+// After the Suricata headers: GraphBLAS.h brings in <complex.h>, which defines 'I'.
+#include <GraphBLAS.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include "cryptopANT.h"
+#include "cryptopan.h"
+#include "ip4memo.h"
+#include "tarwriter.h"
+
+#define WINDOWSIZE  64        // GraphBLAS matrices per output tar file
+#define SUBWINSIZE  (1 << 17) // Packets per GraphBLAS matrix file (.grb)
+#define MODULE_NAME "GraphBLASLog"
+#define CONF_NAME   "graphblas" // section of 'outputs' in suricata.yaml
+
+#define BSWAP(a)    (out->swapped ? ntohl(a) : (a))
+
+// Simple error handler wrapper for GraphBLAS calls
+#define LAGRAPH_TRY_EXIT(method)                                                                                       \
+    {                                                                                                                  \
+        GrB_Info info = (method);                                                                                      \
+        if (!(info == GrB_SUCCESS))                                                                                    \
+        {                                                                                                              \
+            FatalError(SC_ERR_FATAL, "LAGraph error: [%d] File: %s Line: %d", info, __FILE__, __LINE__);              \
+        }                                                                                                              \
+    }
+
+/// @brief Output state, shared by every logging thread.
+struct grb_output
+{
+    enum anon_mode anonymize; // ANON_AFTER_AGG, ANON_MEMO or ANON_CRYPTOPAN
+    unsigned int swapped;
+    unsigned int partial;
+    uint32_t windowsize;
+    uint32_t subwinsize;
+    const char *tmpdir;
+    const char *out_prefix;
+    const char *memofile;
+    char f_name[PATH_MAX];
+    time_t f_time; // second in the name of the latest tar file
+    int findex;
+    struct tar_writer tw; // open output tar file
+    pthread_mutex_t lock; // f_name, findex and tw, and the totals below
+    uint64_t flows;
+    uint64_t total_packets;
+    uint64_t matrices;
+    double t_grb;
+    struct ip4memo memo;    // anonymize == ANON_AFTER_AGG or ANON_MEMO
+    struct cryptopan *cpan; // anonymize == ANON_CRYPTOPAN
+};
+
+/// @brief One logging thread: the tuples of the matrix it is filling.
+struct grb_thread
+{
+    struct grb_output *out;
+    GrB_Index *R, *C;
+    uint32_t *V;
+    uint32_t rec;
+    uint32_t npkts;
+    uint64_t flows;
+    uint64_t packets;
+    uint64_t matrices;
+};
+
+/// @brief Name the next tar file after the current second, as json2grb does, but never the second of the previous
+///        file: windows fill faster in process, and the file moved out before would be overwritten.
+static void set_output_filename(struct grb_output *out)
+{
+    time_t tm;
+    char timestr[16];
+
+    tm = time(0);
+    if (tm <= out->f_time)
+        tm = out->f_time + 1;
+    out->f_time = tm;
+    strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S", localtime(&tm));
+    snprintf(out->f_name, sizeof(out->f_name), "%s/%s.%d.tar", out->tmpdir, timestr, out->windowsize);
+    SCLogInfo("Output tar file is '%s'.", out->f_name);
+
+    out->findex = 0;
+}
+
+/// @brief Move a finished tar file to the output directory: rename() it, or, across file systems, copy it under a
+///        hidden name there, rename the copy into place and remove the original, so the output directory never
+///        shows a partial file.  Called without out->lock: a copy only holds up the calling thread.
+static void move_file_to_dir(const char *src, const char *dst_dir)
+{
+    char dst[PATH_MAX * 2] = "";
+    char tmp[PATH_MAX * 2] = "";
+    const char *base       = strrchr(src, '/');
+    struct stat st;
+    off_t copied = 0;
+    int in = -1, outfd = -1;
+
+    base = base != NULL ? base + 1 : src;
+    SCLogInfo("Moving output tar file, '%s', to output directory.", src);
+    snprintf(dst, sizeof(dst), "%s/%s", dst_dir, base);
+    if (rename(src, dst) == 0)
+    {
+        return;
+    }
+    if (errno != EXDEV)
+    {
+        SCLogError(SC_ERR_FOPEN, "Could not move '%s' to '%s': %s", src, dst_dir, strerror(errno));
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s/.%s.part", dst_dir, base);
+    if ((in = open(src, O_RDONLY)) == -1 || fstat(in, &st) == -1 ||
+        (outfd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0660)) == -1)
+    {
+        goto copy_failed;
+    }
+    while (copied < st.st_size)
+    {
+        if (sendfile(outfd, in, &copied, st.st_size - copied) <= 0 && errno != EINTR)
+        {
+            goto copy_failed;
+        }
+    }
+    if (close(outfd) == -1)
+    {
+        outfd = -1;
+        goto copy_failed;
+    }
+    outfd = -1;
+    if (rename(tmp, dst) == -1)
+    {
+        goto copy_failed;
+    }
+    close(in);
+    unlink(src);
+    return;
+
+copy_failed:
+    SCLogError(SC_ERR_FOPEN, "Could not copy '%s' to '%s': %s", src, dst_dir, strerror(errno));
+    if (outfd != -1)
+    {
+        close(outfd);
+    }
+    if (in != -1)
+    {
+        close(in);
+    }
+    unlink(tmp);
+}
+
+/// @brief Append a serialized matrix to the open tar file, and close the file once it holds windowsize matrices.
+///        Caller holds out->lock.
+/// @param done_name Set to the name of the file closed, for the caller to move once it has released the lock.
+/// @return 1 if the file was closed, 0 otherwise.
+static int add_to_tar(struct grb_output *out, void *blob_data, unsigned int blob_size, char *done_name)
+{
+    char entry_name[32];
+
+    if (!tar_writer_is_open(&out->tw))
+    {
+        set_output_filename(out);
+        tar_writer_open(&out->tw, out->f_name);
+    }
+
+    snprintf(entry_name, sizeof(entry_name), "%d.grb", out->findex++);
+    tar_writer_add(&out->tw, entry_name, blob_data, blob_size);
+
+    if (out->findex >= out->windowsize)
+    {
+        tar_writer_close(&out->tw, 1);
+        snprintf(done_name, PATH_MAX, "%s", out->f_name);
+        out->findex = 0;
+        return (1);
+    }
+    return (0);
+}
+
+/// @brief Build and serialize the thread's subwindow (outside the lock), then add it to the shared tar file.
+static void build_and_store_matrix(struct grb_thread *td)
+{
+    struct grb_output *out = td->out;
+    GrB_Matrix Gmat;
+    void *blob          = NULL;
+    GrB_Index blob_size = 0;
+    GrB_Descriptor desc = NULL;
+    struct timespec ts_start, ts_end;
+    char done_name[PATH_MAX];
+    int done;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    if (out->anonymize == ANON_CRYPTOPAN)
+    {
+        cryptopan_anonymize_index(out->cpan, td->R, td->rec);
+        cryptopan_anonymize_index(out->cpan, td->C, td->rec);
+    }
+    LAGRAPH_TRY_EXIT(GrB_Matrix_new(&Gmat, GrB_UINT32, 4294967296, 4294967296));
+    LAGRAPH_TRY_EXIT(GrB_Matrix_build(Gmat, td->R, td->C, td->V, td->rec, GrB_PLUS_UINT32));
+    if (out->anonymize == ANON_AFTER_AGG)
+    {
+        LAGRAPH_TRY_EXIT(ip4memo_anonymize_matrix(&out->memo, &Gmat));
+    }
+
+    GrB_Descriptor_new(&desc);
+    GxB_Desc_set(desc, GxB_COMPRESSION, GxB_COMPRESSION_ZSTD + 1);
+    LAGRAPH_TRY_EXIT(GxB_Matrix_serialize(&blob, &blob_size, Gmat, desc));
+    GrB_free(&desc);
+    GrB_free(&Gmat);
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+    pthread_mutex_lock(&out->lock);
+    done = add_to_tar(out, blob, blob_size, done_name);
+    out->t_grb += (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) * 1e-9;
+    pthread_mutex_unlock(&out->lock);
+
+    free(blob);
+
+    // The next file never reuses this one's name (set_output_filename), so other threads can go on writing.
+    if (done && out->out_prefix != NULL)
+    {
+        move_file_to_dir(done_name, out->out_prefix);
+    }
+
+    td->matrices++;
+    td->npkts = 0;
+    td->rec   = 0;
+}
+
+/// @brief Add packets to the thread's subwindow, as json2grb's add_packets() does: a subwindow holds exactly
+///        subwinsize packets, and the overage of the flow that fills it starts the next one.
+static void add_packets(struct grb_thread *td, in_addr_t src_saddr, in_addr_t dst_saddr, uint32_t npkts)
+{
+    if (npkts == 0)
+        return;
+
+    td->packets += npkts;
+
+    td->R[td->rec] = src_saddr;
+    td->C[td->rec] = dst_saddr;
+    td->V[td->rec] = npkts;
+    td->npkts += npkts;
+    td->rec++;
+
+    if (td->npkts >= td->out->subwinsize)
+    {
+        npkts     = td->npkts - td->out->subwinsize;
+        td->npkts = 0;
+        if (npkts > 0)
+        {
+            td->V[td->rec - 1] -= npkts;
+            td->packets -= npkts;
+        }
+
+        build_and_store_matrix(td);
+
+        if (npkts > 0)
+        {
+            td->R[0]    = src_saddr;
+            td->C[0]    = dst_saddr;
+            td->V[0]    = npkts;
+            td->npkts   = npkts;
+            td->rec     = 1;
+            td->packets += npkts;
+        }
+    }
+}
+
+/// @brief Flow logger: add an IPv4 flow's packets to the thread's subwindow, as json2grb adds its EVE record.
+static int GraphBLASLogFlow(ThreadVars *tv, void *thread_data, Flow *f)
+{
+    struct grb_thread *td  = thread_data;
+    struct grb_output *out = td->out;
+    in_addr_t src_saddr, dst_saddr;
+
+    if (!FLOW_IS_IPV4(f)) // json2grb skips records whose addresses inet_aton() does not read
+        return 0;
+
+    // The addresses EVE gives as src_ip and dest_ip (network byte order), and its pkts_toserver and pkts_toclient.
+    if ((f->flags & FLOW_DIR_REVERSED) == 0)
+    {
+        src_saddr = BSWAP(f->src.addr_data32[0]);
+        dst_saddr = BSWAP(f->dst.addr_data32[0]);
+    }
+    else
+    {
+        src_saddr = BSWAP(f->dst.addr_data32[0]);
+        dst_saddr = BSWAP(f->src.addr_data32[0]);
+    }
+
+    if (out->anonymize == ANON_MEMO)
+    {
+        src_saddr = ip4memo_get(&out->memo, src_saddr);
+        dst_saddr = ip4memo_get(&out->memo, dst_saddr);
+    }
+
+    td->flows++;
+    add_packets(td, src_saddr, dst_saddr, f->todstpktcnt);
+    add_packets(td, dst_saddr, src_saddr, f->tosrcpktcnt);
+    return 0;
+}
+
+static TmEcode GraphBLASLogThreadInit(ThreadVars *tv, const void *initdata, void **data)
+{
+    struct grb_thread *td;
+
+    if (initdata == NULL)
+    {
+        SCLogError(SC_ERR_INVALID_ARGUMENT, "Error getting context for " MODULE_NAME ": NULL");
+        return TM_ECODE_FAILED;
+    }
+
+    if ((td = SCCalloc(1, sizeof(*td))) == NULL)
+    {
+        return TM_ECODE_FAILED;
+    }
+    td->out = ((OutputCtx *)initdata)->data;
+    td->R   = SCMalloc(sizeof(GrB_Index) * td->out->subwinsize);
+    td->C   = SCMalloc(sizeof(GrB_Index) * td->out->subwinsize);
+    td->V   = SCMalloc(sizeof(uint32_t) * td->out->subwinsize);
+    if (td->R == NULL || td->C == NULL || td->V == NULL)
+    {
+        SCLogError(SC_ERR_MEM_ALLOC, "Failed to allocate a %u packet subwindow", td->out->subwinsize);
+        SCFree(td->R);
+        SCFree(td->C);
+        SCFree(td->V);
+        SCFree(td);
+        return TM_ECODE_FAILED;
+    }
+
+    *data = td;
+    return TM_ECODE_OK;
+}
+
+/// @brief Store the thread's last, partial subwindow (with 'partial'), and add its counts to the totals.
+static TmEcode GraphBLASLogThreadDeinit(ThreadVars *tv, void *data)
+{
+    struct grb_thread *td  = data;
+    struct grb_output *out = td->out;
+
+    if (td->rec > 0)
+    {
+        if (out->partial)
+        {
+            SCLogInfo("Adding trailing %u packets to tar file.", td->npkts);
+            build_and_store_matrix(td);
+        }
+        else
+        {
+            SCLogInfo("Not processing %u remaining packets (less than matrix size of %u).", td->npkts,
+                      out->subwinsize);
+        }
+    }
+
+    pthread_mutex_lock(&out->lock);
+    out->flows += td->flows;
+    out->total_packets += td->packets;
+    out->matrices += td->matrices;
+    pthread_mutex_unlock(&out->lock);
+
+    SCFree(td->R);
+    SCFree(td->C);
+    SCFree(td->V);
+    SCFree(td);
+    return TM_ECODE_OK;
+}
+
+static void GraphBLASLogExitPrintStats(ThreadVars *tv, void *data)
+{
+    struct grb_thread *td = data;
+
+    SCLogInfo("%s: %" PRIu64 " flows, %" PRIu64 " packets, %" PRIu64 " matrices.", tv->name, td->flows, td->packets,
+              td->matrices);
+}
+
+/// @brief Close the tar file (moved to the output directory only with 'partial', like json2grb -p), print the
+///        totals, and save the memo.
+static void GraphBLASLogDeInit(OutputCtx *output_ctx)
+{
+    struct grb_output *out = output_ctx->data;
+    long memo_saved;
+
+    if (tar_writer_is_open(&out->tw))
+    {
+        tar_writer_close(&out->tw, 1);
+        if (out->partial && out->out_prefix != NULL)
+        {
+            SCLogInfo("Partial option selected -- unfilled tar file will be moved.");
+            move_file_to_dir(out->f_name, out->out_prefix);
+        }
+        else
+        {
+            SCLogInfo("Not moving unfilled tar file, '%s' (less than window size of %u).", out->f_name,
+                      out->windowsize);
+        }
+    }
+
+    SCLogInfo("Done: %" PRIu64 " flows, %" PRIu64 " packets, %" PRIu64 " matrices.  GrB: elapsed %.2fs", out->flows,
+              out->total_packets, out->matrices, out->t_grb);
+
+    if (out->anonymize == ANON_AFTER_AGG || out->anonymize == ANON_MEMO)
+    {
+        SCLogInfo("Anonymized %" PRIu64 " new addresses (%zu in memo).", (uint64_t)out->memo.misses,
+                  ip4memo_count(&out->memo));
+        if (out->memofile != NULL && (memo_saved = ip4memo_save(&out->memo, out->memofile)) >= 0)
+            SCLogInfo("saved %ld addresses to memo: %s", memo_saved, out->memofile);
+        ip4memo_free(&out->memo);
+    }
+    if (out->cpan != NULL)
+    {
+        SCFree(out->cpan);
+    }
+
+    pthread_mutex_destroy(&out->lock);
+    SCFree(out);
+    SCFree(output_ctx);
+}
+
+/// @brief Read the 'graphblas' output section of suricata.yaml:
+///
+///     - graphblas:
+///         enabled: yes
+///         dir: /path/to/outdir            # where filled tar files are moved (json2grb -o)
+///         tmpdir: /path/to/tmpdir         # where tar files are built (-t; default: dir); on dir's file
+///                                         # system, finished files are renamed rather than copied
+///         windowsize: 64                  # matrices per tar file (-W)
+///         subwinsize: 131072              # packets per matrix (-w)
+///         partial: no                     # at exit, store partial matrices and move the unfilled tar file (-p)
+///         swap: no                        # swap the byte order of addresses (-S)
+///         anonymize-key: /path/to/key     # CryptopANT (-a), through the memo
+///         anonymize-after-aggregation: no # (-A)
+///         memo-file: /path/to/memo        # (-m)
+///         cryptopan-key: /path/to/key     # Crypto-PAn (-k), instead of anonymize-key
+static OutputInitResult GraphBLASLogInit(ConfNode *conf)
+{
+    OutputInitResult result = { NULL, false };
+    struct grb_output *out;
+    OutputCtx *output_ctx;
+    const char *anonkey, *cpankey;
+    intmax_t val;
+    int flag;
+    long memo_loaded;
+
+    if ((out = SCCalloc(1, sizeof(*out))) == NULL || (output_ctx = SCCalloc(1, sizeof(*output_ctx))) == NULL)
+    {
+        SCFree(out);
+        return result;
+    }
+
+    out->windowsize = WINDOWSIZE;
+    out->subwinsize = SUBWINSIZE;
+    out->out_prefix = ConfNodeLookupChildValue(conf, "dir");
+    if ((out->tmpdir = ConfNodeLookupChildValue(conf, "tmpdir")) == NULL)
+        out->tmpdir = out->out_prefix != NULL ? out->out_prefix : ".";
+    if (ConfGetChildValueInt(conf, "windowsize", &val) && val > 0)
+        out->windowsize = val;
+    if (ConfGetChildValueInt(conf, "subwinsize", &val) && val > 0 && val <= UINT32_MAX)
+        out->subwinsize = val;
+    if (ConfGetChildValueBool(conf, "partial", &flag))
+        out->partial = flag;
+    if (ConfGetChildValueBool(conf, "swap", &flag))
+        out->swapped = flag;
+    out->memofile = ConfNodeLookupChildValue(conf, "memo-file");
+    anonkey       = ConfNodeLookupChildValue(conf, "anonymize-key");
+    cpankey       = ConfNodeLookupChildValue(conf, "cryptopan-key");
+
+    if (cpankey != NULL && anonkey != NULL)
+    {
+        SCLogError(SC_ERR_INVALID_ARGUMENT, "anonymize-key and cryptopan-key are mutually exclusive: use one "
+                                            "anonymization method");
+        goto error;
+    }
+
+    if (cpankey != NULL)
+    {
+        SCLogInfo("anonymizing using Crypto-PAn keyfile: %s", cpankey);
+        if ((out->cpan = SCMalloc(sizeof(struct cryptopan))) == NULL ||
+            cryptopan_init_from_file(out->cpan, cpankey, 16) < 0) // preserve 16 upper bits, like anonymize-key
+        {
+            SCLogError(SC_ERR_INVALID_ARGUMENT, "Could not load Crypto-PAn key %s", cpankey);
+            goto error;
+        }
+        out->anonymize = ANON_CRYPTOPAN;
+    }
+    else if (anonkey != NULL)
+    {
+        SCLogInfo("anonymizing using scramble keyfile: %s", anonkey);
+        if (scramble_init_from_file(anonkey, SCRAMBLE_BLOWFISH, SCRAMBLE_BLOWFISH, NULL) < 0)
+        {
+            SCLogError(SC_ERR_INVALID_ARGUMENT, "scramble_init_from_file(): could not load %s", anonkey);
+            goto error;
+        }
+
+        // scramble_ip4() is not thread safe: flows are anonymized through the memo, which serializes it.
+        out->anonymize = ANON_MEMO;
+        if (ConfGetChildValueBool(conf, "anonymize-after-aggregation", &flag) && flag)
+            out->anonymize = ANON_AFTER_AGG;
+        ip4memo_init(&out->memo, IP4MEMO_DEFAULT_BITS);
+        if (out->memofile != NULL && (memo_loaded = ip4memo_load(&out->memo, out->memofile)) > 0)
+            SCLogInfo("loaded %ld addresses from memo", memo_loaded);
+    }
+
+    tar_writer_init(&out->tw);
+    pthread_mutex_init(&out->lock, NULL);
+    GrB_init(GrB_NONBLOCKING);
+
+    SCLogInfo(MODULE_NAME ": %u packets per matrix, %u matrices per tar file, built in %s, moved to %s.",
+              out->subwinsize, out->windowsize, out->tmpdir, out->out_prefix != NULL ? out->out_prefix : "(not moved)");
+
+    output_ctx->data   = out;
+    output_ctx->DeInit = GraphBLASLogDeInit;
+    result.ctx         = output_ctx;
+    result.ok          = true;
+    return result;
+
+error:
+    SCFree(out->cpan);
+    SCFree(out);
+    SCFree(output_ctx);
+    return result;
+}
+
+static void SCPluginInit(void)
+{
+    OutputRegisterFlowModule(LOGGER_UNDEFINED, MODULE_NAME, CONF_NAME, GraphBLASLogInit, GraphBLASLogFlow,
+                             GraphBLASLogThreadInit, GraphBLASLogThreadDeinit, GraphBLASLogExitPrintStats);
+}
+
+const SCPlugin PluginRegistration = {
+    .name    = "suricata2grb",
+    .author  = "GraphBLAS Network Tools",
+    .license = "MIT",
+    .Init    = SCPluginInit,
+};
+
+const SCPlugin *SCPluginRegister(void)
+{
+    return &PluginRegistration;
+}
@@ -135,6 +135,10 @@ int main(int argc, const char **argv)
                 perror("fread1");
                 exit(1);
             }
+            if (th.name[0] == '\0') // end-of-archive marker
+            {
+                break;
+            }
             if (strcmp(TMAGIC, th.magic) != 0)
             {
                 perror("invalid tar file");
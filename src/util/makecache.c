@@ -19,35 +19,98 @@
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 /* see README */
 #include "common.h"
 #include "cryptopANT.h"
+#include "cryptopan.h"
+#include "ip4cache.h"
+
+#define SLICE_ENTRIES (1 << 20) // addresses per pwrite() (4 MB)
+
+struct cryptopan *cpan = NULL; // -k: Crypto-PAn (AES) instead of CryptopANT
 
 void usage(const char *name)
 {
-    fprintf(stdout, "usage: %s -a <path to cryptoPAN anonymization key> -o <path to output ip4 cache file>\n", name);
+    fprintf(stdout, "usage: %s <-a <path to cryptoPAN anonymization key> | -k <path to Crypto-PAn AES key>> -o <path to output ip4 cache file> [-t workers]\n", name);
     fprintf(stdout, "       If CryptoPAN anonymization keyfile does not exist, a random key will be generated and saved.\n");
+    fprintf(stdout, "       -k Build the table for Crypto-PAn (AES-128, batched with AES-NI) keys, as used by pcap2grb -k.\n");
     fprintf(stdout, "       Output is a 16GB anonymization table.\n");
+    fprintf(stdout, "       -t Number of worker processes (default: one per online CPU).\n");
+}
+
+/// @brief Fill and write every nworkers-th slice of the table, starting at slice w.
+/// @param fd Output file.
+/// @param w Worker number.
+/// @param nworkers Number of workers.
+/// @param done Shared count of addresses written, for progress reports.
+/// @return 0 on success.
+int make_slices(int fd, uint32_t w, uint32_t nworkers, volatile uint64_t *done)
+{
+    uint32_t *slice = malloc(sizeof(uint32_t) * SLICE_ENTRIES);
+    uint64_t first;
+
+    if (slice == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for (first = (uint64_t)w * SLICE_ENTRIES; first < IP4CACHE_ENTRIES; first += (uint64_t)nworkers * SLICE_ENTRIES)
+    {
+        uint64_t n   = (IP4CACHE_ENTRIES - first < SLICE_ENTRIES) ? IP4CACHE_ENTRIES - first : SLICE_ENTRIES;
+        size_t bytes = sizeof(uint32_t) * n, off = 0;
+
+        if (cpan != NULL)
+        {
+            for (uint64_t i = 0; i < n; i++)
+                slice[i] = first + i;
+            cryptopan_anonymize_batch(cpan, slice, slice, n);
+        }
+        else
+        {
+            for (uint64_t i = 0; i < n; i++)
+                slice[i] = scramble_ip4(first + i, 16); // preserve 16 upper bits
+        }
+
+        while (off < bytes)
+        {
+            ssize_t ret = pwrite(fd, (char *)slice + off, bytes - off, sizeof(uint32_t) * first + off);
+
+            if (ret < 0)
+            {
+                perror("pwrite");
+                return 1;
+            }
+            off += ret;
+        }
+
+        __atomic_add_fetch(done, n, __ATOMIC_RELAXED);
+    }
+
+    free(slice);
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
-    struct timespec ts_start;
-    uint32_t i;
-    uint32_t *ipc;
-    size_t ret;
+    struct timespec ts_start, ts_now, tsdiff;
     char *output_file = NULL;
-    FILE *fp;
-    int c, reqargs = 0;
-    char anonkey[PATH_MAX] = { 0 }, prefix[128] = { 0 };
+    volatile uint64_t *done;
+    pid_t *pids;
+    int c, fd, reqargs = 0, failed = 0, use_cryptopan = 0;
+    uint32_t w, nworkers = sysconf(_SC_NPROCESSORS_ONLN), running;
+    char anonkey[PATH_MAX] = { 0 };
+    double t_elapsed;
 
     scramble_crypt_t key_crypto = SCRAMBLE_BLOWFISH;
 
-    while ((c = getopt(argc, argv, "a:o:")) != -1)
+    while ((c = getopt(argc, argv, "a:k:o:t:")) != -1)
     {
         switch (c)
         {
@@ -55,13 +118,25 @@ int main(int argc, char **argv)
                 reqargs++;
                 snprintf(anonkey, sizeof(anonkey), "%s", optarg);
                 break;
+            case 'k':
+                reqargs++;
+                use_cryptopan = 1;
+                snprintf(anonkey, sizeof(anonkey), "%s", optarg);
+                break;
             case 'o':
                 // output dir
                 reqargs++;
                 output_file = strdup(optarg);
                 break;
+            case 't':
+                if (sscanf(optarg, "%u", &nworkers) != 1 || nworkers == 0)
+                {
+                    fprintf(stderr, "Invalid argument to option -%c.\n", c);
+                    exit(1);
+                }
+                break;
             case '?':
-                if (optopt == 'a' || optopt == 'o')
+                if (optopt == 'a' || optopt == 'k' || optopt == 'o' || optopt == 't')
                 {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 }
@@ -88,39 +163,107 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    fprintf(stderr, "using cryptoPAN anonymization key: %s\n", anonkey);
-    if (scramble_init_from_file(anonkey, key_crypto, key_crypto, NULL) < 0)
+    if (use_cryptopan)
     {
-        fprintf(stderr, "error in scramble_init_from_file()\n");
-        return 1;
+        fprintf(stderr, "using Crypto-PAn anonymization key: %s\n", anonkey);
+        if ((cpan = malloc(sizeof(struct cryptopan))) == NULL ||
+            cryptopan_init_from_file(cpan, anonkey, 16) < 0) // preserve 16 upper bits
+        {
+            fprintf(stderr, "error in cryptopan_init_from_file()\n");
+            return 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "using cryptoPAN anonymization key: %s\n", anonkey);
+        if (scramble_init_from_file(anonkey, key_crypto, key_crypto, NULL) < 0)
+        {
+            fprintf(stderr, "error in scramble_init_from_file()\n");
+            return 1;
+        }
+    }
+
+    if ((fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0644)) == -1)
+    {
+        perror("open");
+        exit(1);
+    }
+
+    // Reserve the whole table up front: slices land out of order.
+    if (fallocate(fd, 0, 0, IP4CACHE_SIZE) == -1 && ftruncate(fd, IP4CACHE_SIZE) == -1)
+    {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    // Workers are processes: the CryptopANT state (and its lookup cache) is not thread safe.
+    done = mmap(NULL, sizeof(*done), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pids = calloc(nworkers, sizeof(pid_t));
+
+    if (done == MAP_FAILED || pids == NULL)
+    {
+        perror("mmap");
+        exit(1);
     }
 
-    const size_t cachesize = sizeof(uint32_t) * (UINT_MAX - 1);
+    fprintf(stderr, "Generating ip4cache of size %ld with %u workers\n", IP4CACHE_SIZE, nworkers);
 
-    fprintf(stderr, "Allocating ip4cache of size %ld\n", cachesize);
-    ipc = malloc(cachesize);
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-    if ((fp = fopen(output_file, "w")) == NULL)
+    for (w = 0; w < nworkers; w++)
     {
-        perror("fopen");
-        exit(0);
+        if ((pids[w] = fork()) == 0)
+        {
+            _exit(make_slices(fd, w, nworkers, done));
+        }
+        else if (pids[w] == -1)
+        {
+            perror("fork");
+            exit(1);
+        }
     }
 
-    TIC(CLOCK_REALTIME, "random IP cache creation");
-    for (i = 0; i < UINT_MAX - 1; i++)
+    for (running = nworkers; running > 0;)
     {
-        if (i % 10000000 == 0)
-        { // this takes a while, provide some periodic status output
-            fprintf(stderr, "Generating, i=%u\n", i);
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+
+        if (pid > 0)
+        {
+            running--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                failed = 1;
+            continue;
+        }
+
+        sleep(1);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_now);
+        timespec_diff(&ts_now, &ts_start, &tsdiff);
+        t_elapsed = tsdiff.tv_sec + tsdiff.tv_nsec * 1e-9;
+
+        if (tsdiff.tv_sec % 10 == 0) // this takes a while, provide some periodic status output
+        {
+            uint64_t n = __atomic_load_n(done, __ATOMIC_RELAXED);
+
+            fprintf(stderr, "Generating, %5.1f%% (%.2f M addresses/s)\n", 100.0 * n / IP4CACHE_ENTRIES,
+                    n / t_elapsed * 1e-6);
         }
-        ipc[i] = scramble_ip4(i, 16); // preserve 16 upper bits
     }
-    TOC(CLOCK_REALTIME, "random IP cache creation");
 
-    if ((ret = fwrite(ipc, cachesize, 1, fp)) < 1)
+    clock_gettime(CLOCK_MONOTONIC, &ts_now);
+    timespec_diff(&ts_now, &ts_start, &tsdiff);
+    t_elapsed = tsdiff.tv_sec + tsdiff.tv_nsec * 1e-9;
+
+    if (failed || fsync(fd) == -1 || close(fd) == -1)
     {
-        perror("write");
+        fprintf(stderr, "error writing %s\n", output_file);
+        unlink(output_file);
+        exit(1);
     }
-    fclose(fp);
-    free(ipc);
+
+    fprintf(stderr, "Done: %lu addresses in %.2fs (%.2f M addresses/s, %.1f MB/s)\n", (uint64_t)IP4CACHE_ENTRIES,
+            t_elapsed, IP4CACHE_ENTRIES / t_elapsed * 1e-6, IP4CACHE_SIZE / t_elapsed / (1 << 20));
+
+    return 0;
 }